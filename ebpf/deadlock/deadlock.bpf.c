@@ -9,37 +9,139 @@ char LICENSE[] SEC("license") = "GPL";
 
 // 可通过用户态修改：仅跟踪此 tgid（进程）；为 0 表示不过滤
 const volatile __u32 target_tgid = 0;
+// 1：持有者从 glibc mutex 结构里读，不维护 mutex_owner、不挂 unlock。
+// 慢路径模式（只挂 __lll_lock_wait）看不到加解锁，总是这样取
+const volatile __u8 owner_from_mutex = 0;
+// 1：lockdep 模式，加锁成功时上报新出现的 “已持有 -> 新加锁” 顺序边
+const volatile __u8 lock_order = 0;
+// 0：沿等待链走 MAX_HOPS 跳，循环完全展开（任何内核都能跑）；
+// >0：用 bpf_loop 走至多 max_hops 跳（<= MAX_CHAIN，需要 5.17+），程序体积
+// 与跳数无关，验证器也只验证一遍循环体
+const volatile __u32 max_hops = 0;
+// 同一个环两次上报之间至少间隔这么久；期间再被检测到只计数，下次上报时带上
+const volatile __u64 report_cooldown_ns = 10ULL * 1000000000;
+// 1：加锁成功时记持有者的用户栈，开始阻塞时记等待者的用户栈
+const volatile __u8 record_stacks = 1;
+// 1：竞争统计模式，按 (tgid, 锁, 加锁栈) 累计等待和持有时间
+const volatile __u8 contention = 0;
+// 1：记每把锁第一次加锁成功时的用户栈，堆上的锁按这个位置命名
+const volatile __u8 record_sites = 0;
 
-// 检测深度上限（影响栈大小/验证器展开）
+// glibc x86_64 pthread_mutex_t.__data 布局：__lock(int) @0，__count @4，
+// __owner(int，持有者 TID) @8，__nusers @12，__kind @16。
+// __lll_lock_wait 的参数就是 &__lock，即 mutex 地址
+#define GLIBC_MUTEX_OWNER_OFF 8
+#define GLIBC_MUTEX_KIND_OFF 16
+#define GLIBC_MUTEX_RECURSIVE 1  // __kind & 3
+#define GLIBC_MUTEX_ERRORCHECK 2 // 重入返回 EDEADLK，不阻塞
+// pthread_rwlock_t.__data.__cur_writer(int，写者 TID) @24；读者 glibc 不记
+#define GLIBC_RWLOCK_WRITER_OFF 24
+
+// 加锁方式，随 attach cookie 传入（同一个程序挂到不同的 pthread 函数上），
+// 记在 thread_wait 里，也随环上的每条边上报
+#define ACQ_RWLOCK 0x1   // pthread_rwlock_t，否则是 pthread_mutex_t
+#define ACQ_WRITE 0x2    // rwlock 写锁
+#define ACQ_TIMED 0x4    // timedlock/clocklock：超时后自己返回
+#define ACQ_TRY 0x8      // trylock：不阻塞
+#define ACQ_REENTER 0x10 // 运行时判定：递归锁重入 / errorcheck 重入，不阻塞
+#define ACQ_NOWAIT (ACQ_TRY | ACQ_REENTER) // 不构成等待边
+
+// 展开版的检测深度上限（影响程序大小/验证器展开）
 #define MAX_HOPS 6
+// bpf_loop 版（max_hops > 0）链路最长 MAX_CHAIN 条边
+#define MAX_CHAIN 128
 
+// 第 i 条边：chain[i].pid 持有 mutex，上一个线程（i = 0 时为 root）在等它
 struct edge_t {
-  __u32 pid;   // 线程（轻量级 pid/TID）
-  __u64 mutex; // 互斥量地址
+  __u32 pid;         // 线程（轻量级 pid/TID）
+  __u32 flags;       // 上一个线程以何种方式等 mutex（ACQ_*）
+  __u64 mutex;       // 互斥量 / 读写锁地址
+  __s32 hold_stack;  // 持有者加锁时的用户栈，-1 为没有
+  __s32 wait_stack;  // 等待者阻塞处的用户栈
+  __u64 held_since;  // 持有者拿到锁的时间（ktime），0 为未知
+  __u64 wait_since;  // 等待者开始等的时间
 };
 
 struct event_t {
   __u32 root_pid; // 起始线程（触发检测的线程）
   __u32 tgid;     // 进程 id
-  __s32 depth;    // 链路长度（<= MAX_HOPS+1）
+  __s32 depth;    // 链路长度（<= MAX_CHAIN）
+  __u32 repeats;  // 上次上报以来又检测到的次数（0：第一次上报）
   char comm[16];
-  struct edge_t chain[MAX_HOPS + 1]; // Recorder the chain of edges, MAX_HOPS+1 means the last edge can point back to the root
+  __u64 ts;       // 检测时间（ktime），用来算各边已持有/已等待多久
+  // 最后一条边指回 root；只有前 depth 条随事件上报
+  struct edge_t chain[MAX_CHAIN];
+};
+
+// 事件在 per-CPU 暂存区里拼（放不进 512 字节的栈），按实际长度输出。
+// uprobe/tracepoint 程序在同一 CPU 上不会嵌套执行，暂存区不会被覆盖
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct event_t);
+} scratch SEC(".maps");
+
+// 锁地址只在进程内有意义：系统范围跟踪时不同进程的同一虚拟地址是不同的锁
+struct lock_key {
+  __u32 tgid;
+  __u32 pad;
+  __u64 addr;
+};
+
+struct owner_t {
+  __u32 tid;      // 持有者 TID
+  __u32 count;    // 递归锁的重入层数
+  __s32 stack_id; // 最外层加锁时的用户栈
+  __u32 pad;
+  __u64 acq_ns;   // 最外层加锁成功的时间
 };
 
-// key 互斥量 -> value 持有该互斥量的线程（TID）
+// key 互斥量（或 rwlock 写锁）-> value 持有者
 struct {
   __uint(type, BPF_MAP_TYPE_HASH);
   __uint(max_entries, 65536);
-  __type(key, __u64);
-  __type(value, __u32);
+  __type(key, struct lock_key);
+  __type(value, struct owner_t);
 } mutex_owner SEC(".maps");
 
-// key 线程（TID）-> value 等待获取的互斥量地址
+// rwlock 读者集合：每个线程占一个槽（同一线程重复读锁只加计数），
+// 多线程并发进出用 cmpxchg 抢空槽，不需要锁。超过 MAX_READERS 的读者不记
+#define MAX_READERS 8
+
+struct reader_slot {
+  __u32 tid; // 0 为空槽
+  __u32 count;
+};
+
+struct reader_set {
+  __u32 overflow;
+  __u32 pad;
+  struct reader_slot r[MAX_READERS];
+};
+
+// rwlock 销毁后条目不会被删，用 LRU 回收
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, 16384);
+  __type(key, struct lock_key);
+  __type(value, struct reader_set);
+} rw_readers SEC(".maps");
+
+struct wait_t {
+  __u64 lock;
+  __u32 flags;    // ACQ_*
+  __s32 stack_id; // 进入加锁函数时锁已被持有才记
+  __u64 since_ns;
+};
+
+// key 线程（TID，系统内唯一）-> value 正在获取的锁（该线程所在进程内的地址）；
+// ACQ_NOWAIT 的条目只用于返回时建立持有关系，不是等待边
 struct {
   __uint(type, BPF_MAP_TYPE_HASH);
   __uint(max_entries, 65536);
   __type(key, __u32);
-  __type(value, __u64);
+  __type(value, struct wait_t);
 } thread_wait SEC(".maps");
 
 // ring buffer：向用户态上报疑似死锁
@@ -48,6 +150,105 @@ struct {
   __uint(max_entries, 1 << 22); // 4MB，按需调整
 } rb SEC(".maps");
 
+// ---- lockdep 模式 ----
+// 每个线程当前持有的锁（集合，无序）；超过 MAX_HELD 的部分不再记录顺序
+#define MAX_HELD 16
+
+struct held_locks {
+  __u32 nr;
+  __u32 overflow; // 持有数超过 MAX_HELD 的次数
+  __u64 locks[MAX_HELD];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+  __uint(map_flags, BPF_F_NO_PREALLOC);
+  __type(key, int);
+  __type(value, struct held_locks);
+} held SEC(".maps");
+
+struct order_key {
+  __u32 tgid;
+  __u32 pad;
+  __u64 from; // 已持有
+  __u64 to;   // 新加锁
+};
+
+// 已上报过的顺序边，每条边只在第一次出现时上报（带当时的栈）
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, 65536);
+  __type(key, struct order_key);
+  __type(value, __u8);
+} order_seen SEC(".maps");
+
+struct order_event_t {
+  __u32 tgid;
+  __u32 tid;
+  __u64 from;
+  __u64 to;
+  __s32 stack_id; // 第一次按此顺序加锁时的用户栈
+  char comm[16];
+};
+
+// 用户栈：lockdep 顺序边、环上持有者的加锁栈和等待者的阻塞栈共用
+struct {
+  __uint(type, BPF_MAP_TYPE_STACK_TRACE);
+  __uint(max_entries, 16384);
+  __uint(key_size, sizeof(__u32));
+  __uint(value_size, 127 * sizeof(__u64));
+} stacks SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_RINGBUF);
+  __uint(max_entries, 1 << 20);
+} order_rb SEC(".maps");
+
+// ---- 竞争统计模式 ----
+// 等待 = 进入加锁函数到成功返回；持有 = 成功返回到（最外层）解锁，只有
+// mutex 和写锁有（读者集合不记时间）。per-CPU 累加，用户态汇总；
+// 每个条目约 300B × CPU 数，不预分配，只为出现过的 (锁, 栈) 占内存
+#define HIST_SLOTS 32 // log2(us)
+
+struct cont_key {
+  __u32 tgid;
+  __s32 stack_id; // 加锁处的用户栈，-1 为没有（-N）
+  __u64 lock;
+};
+
+struct cont_stats {
+  __u64 count;       // 成功加锁次数（不含递归重入）
+  __u64 wait_ns;     // 总等待
+  __u64 max_wait_ns;
+  __u64 hold_ns;     // 总持有
+  __u64 holds;       // 持有时间的样本数
+  __u32 wait_hist[HIST_SLOTS];
+  __u32 hold_hist[HIST_SLOTS];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+  __uint(map_flags, BPF_F_NO_PREALLOC);
+  __uint(max_entries, 10240); // 用户态按 -p / 系统范围调整
+  __type(key, struct cont_key);
+  __type(value, struct cont_stats);
+} cont_stats SEC(".maps");
+
+// 锁 -> 第一次加锁成功时的用户栈。全局锁用户态按 ELF 数据符号命名，
+// 堆上的锁没有符号，用第一次加锁的位置近似创建处；地址被释放后复用会沿用旧位置
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, 10240);
+  __type(key, struct lock_key);
+  __type(value, __s32);
+} lock_site SEC(".maps");
+
+// 系统范围模式：新进程 exec 后通知用户态去看它映射的 libc 是不是新的文件
+struct {
+  __uint(type, BPF_MAP_TYPE_RINGBUF);
+  __uint(max_entries, 1 << 16);
+} exec_rb SEC(".maps");
+
 static __always_inline int filter_tgid(void) {
   if (!target_tgid)
     return 1;
@@ -56,58 +257,379 @@ static __always_inline int filter_tgid(void) {
   return tgid == target_tgid;
 }
 
+static __always_inline __s32 user_stack(void *ctx) {
+  if (!record_stacks)
+    return -1;
+  return bpf_get_stackid(ctx, &stacks, BPF_F_USER_STACK);
+}
+
+static __always_inline int log2l_u64(__u64 v) {
+  int r = 0;
+  if (v >> 32) {
+    v >>= 32;
+    r += 32;
+  }
+  if (v >> 16) {
+    v >>= 16;
+    r += 16;
+  }
+  if (v >> 8) {
+    v >>= 8;
+    r += 8;
+  }
+  if (v >> 4) {
+    v >>= 4;
+    r += 4;
+  }
+  if (v >> 2) {
+    v >>= 2;
+    r += 2;
+  }
+  if (v >> 1)
+    r += 1;
+  return r;
+}
+
+static __always_inline int hist_slot(__u64 ns) {
+  int slot = log2l_u64(ns / 1000);
+  return slot < HIST_SLOTS ? slot : HIST_SLOTS - 1;
+}
+
+static __always_inline struct cont_stats *cont_get(struct cont_key *k) {
+  struct cont_stats *st = bpf_map_lookup_elem(&cont_stats, k);
+  if (st)
+    return st;
+  struct cont_stats zero = {};
+  bpf_map_update_elem(&cont_stats, k, &zero, BPF_NOEXIST);
+  return bpf_map_lookup_elem(&cont_stats, k);
+}
+
+static __always_inline void account_wait(struct cont_key *k, __u64 ns) {
+  struct cont_stats *st = cont_get(k);
+  if (!st)
+    return;
+  st->count++;
+  st->wait_ns += ns;
+  if (ns > st->max_wait_ns)
+    st->max_wait_ns = ns;
+  st->wait_hist[hist_slot(ns)]++;
+}
+
+static __always_inline void account_hold(struct cont_key *k, __u64 ns) {
+  struct cont_stats *st = cont_get(k);
+  if (!st)
+    return;
+  st->hold_ns += ns;
+  st->holds++;
+  st->hold_hist[hist_slot(ns)]++;
+}
+
+// 读者持有、有人等写锁时，取一个读者作为下一跳：root 本身在读者里
+// 直接闭环（持有读锁又等写锁），否则取第一个也在阻塞等待的读者。
+// 只沿一个读者走，多个读者都在等时可能漏掉经由其他读者的环
+static __always_inline int pick_reader(__u32 tgid, __u64 lock, __u32 root,
+                                       struct owner_t *owner) {
+  struct lock_key k = {.tgid = tgid, .addr = lock};
+  struct reader_set *rs = bpf_map_lookup_elem(&rw_readers, &k);
+  if (!rs)
+    return -1;
+  __u32 cand = 0;
+  for (int i = 0; i < MAX_READERS; i++) {
+    __u32 t = rs->r[i].tid;
+    if (!t)
+      continue;
+    if (t == root) {
+      owner->tid = t;
+      return 0;
+    }
+    if (cand)
+      continue;
+    struct wait_t *w = bpf_map_lookup_elem(&thread_wait, &t);
+    if (w && !(w->flags & ACQ_NOWAIT))
+      cand = t;
+  }
+  if (!cand)
+    return -1;
+  owner->tid = cand;
+  return 0;
+}
+
+// 查锁的持有者。owner_from_mutex 时读 glibc 自己记下的 __owner / __cur_writer
+// （当前进程的用户内存，各线程共享地址空间），每一跳都读最新值：cond_wait
+// 内部的释放/重新加锁、trylock 成功都会反映出来，也不会因为漏掉 unlock
+// 残留旧持有者，但没有加锁栈和时间。rwlock 没有写者时，等写锁的线程在等读者
+// （读者也不记栈和时间）
+static __always_inline int lookup_owner(__u32 tgid, __u64 lock, __u32 flags,
+                                        __u32 root, struct owner_t *owner) {
+  owner->stack_id = -1;
+  owner->acq_ns = 0;
+  if (owner_from_mutex) {
+    __u64 off = flags & ACQ_RWLOCK ? GLIBC_RWLOCK_WRITER_OFF
+                                    : GLIBC_MUTEX_OWNER_OFF;
+    __s32 tid = 0;
+    // 0：无人持有（或正在交接）
+    if (!bpf_probe_read_user(&tid, sizeof(tid), (void *)(lock + off)) &&
+        tid > 0) {
+      owner->tid = tid;
+      return 0;
+    }
+  } else {
+    struct lock_key k = {.tgid = tgid, .addr = lock};
+    struct owner_t *o = bpf_map_lookup_elem(&mutex_owner, &k);
+    if (o) {
+      *owner = *o;
+      return 0;
+    }
+  }
+  // 读者之间不互斥（不考虑排在前面的写者）
+  if ((flags & (ACQ_RWLOCK | ACQ_WRITE)) != (ACQ_RWLOCK | ACQ_WRITE))
+    return -1;
+  return pick_reader(tgid, lock, root, owner);
+}
+
+// 已上报过的环：key 是环的哈希
+struct report_t {
+  __u64 last_ns; // 上次上报时间
+  __u32 repeats; // 此后又检测到的次数
+  __u32 pad;
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, 4096);
+  __type(key, __u64);
+  __type(value, struct report_t);
+} reported SEC(".maps");
+
+static __always_inline __u64 mix64(__u64 x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+struct walk_ctx {
+  struct event_t *ev;
+  struct wait_t cur; // 上一个线程在等的锁
+  __u32 found;       // 回到了起点
+  // 各边 (tid, mutex) 哈希之和：与从哪个线程开始走、边的先后无关，
+  // 相当于对排序后的边集合求哈希
+  __u64 hash;
+};
+
+// 走一跳：查 cur.lock 的持有者记为 chain[i]，再看它在等哪把锁。
+// 返回 1 结束（闭环或链路断开），0 继续
+static __always_inline long walk_hop(__u32 i, struct walk_ctx *c) {
+  struct event_t *ev = c->ev;
+  struct owner_t owner;
+  if (i >= MAX_CHAIN)
+    return 1;
+  if (lookup_owner(ev->tgid, c->cur.lock, c->cur.flags, ev->root_pid, &owner))
+    return 1; // 无人持有，链路断开
+
+  struct edge_t *e = &ev->chain[i];
+  e->pid = owner.tid;
+  e->flags = c->cur.flags;
+  e->mutex = c->cur.lock;
+  e->hold_stack = owner.stack_id;
+  e->held_since = owner.acq_ns;
+  e->wait_stack = c->cur.stack_id;
+  e->wait_since = c->cur.since_ns;
+  ev->depth = i + 1;
+  c->hash += mix64(((__u64)owner.tid << 32) ^ mix64(c->cur.lock));
+
+  // 检测循环：回到起点线程 → 死锁
+  if (owner.tid == ev->root_pid) {
+    c->found = 1;
+    return 1;
+  }
+
+  // 继续沿链查找：查看 owner 是否也在等待某个互斥量
+  struct wait_t *next = bpf_map_lookup_elem(&thread_wait, &owner.tid);
+  if (!next || (next->flags & ACQ_NOWAIT))
+    return 1; // 对方未等待（trylock 不算），链路断开
+  c->cur = *next;
+  return 0;
+}
+
+static long walk_cb(__u32 i, void *ctx) { return walk_hop(i, ctx); }
+
 static __always_inline void try_detect_deadlock(__u32 start_pid, __u32 tgid,
-                                                __u64 first_mutex) {
-  // 在栈上暂存链路，避免过早 reserve ringbuf
-  struct event_t ev = {};
-  ev.root_pid = start_pid;
-  ev.tgid = tgid;
+                                                const struct wait_t *first) {
+  __u32 zero = 0;
+  struct event_t *ev = bpf_map_lookup_elem(&scratch, &zero);
+  if (!ev)
+    return;
+  ev->root_pid = start_pid;
+  ev->tgid = tgid;
+  ev->depth = 0;
   // 把当前正在运行的 task（即当前线程）的 comm 拷贝出来，默认是进程名
-  bpf_get_current_comm(&ev.comm, sizeof(ev.comm));
-
-  __u64 cur_mutex = first_mutex;
-  __u32 cur_owner = 0;
+  bpf_get_current_comm(&ev->comm, sizeof(ev->comm));
 
+  struct walk_ctx c = {.ev = ev, .cur = *first};
+  if (max_hops) {
+    bpf_loop(max_hops, walk_cb, &c, 0);
+  } else {
 // 通过 #pragma unroll 展开循环，避免 verifier 报错
 #pragma unroll
-  for (int i = 0; i < MAX_HOPS + 1; i++) {
-    // 在内核里查某个 BPF map 里是否有对应 key 的值，并返回指向 value 的指针
-    // 这里查的就是 cur_mutex 这个锁的持有者
-    __u32 *owner = bpf_map_lookup_elem(&mutex_owner, &cur_mutex);
-
-    if (!owner)
-      return; // 无人持有，链路断开
-
-    cur_owner = *owner;
-    ev.chain[i].pid = cur_owner;
-    ev.chain[i].mutex = cur_mutex;
-    ev.depth = i + 1;
-
-    // 检测循环：回到起点线程 → 死锁
-    if (cur_owner == start_pid) {
-      // 提交事件
-      struct event_t *out = bpf_ringbuf_reserve(&rb, sizeof(ev), 0);
-      if (!out)
-        return;
-      *out = ev;
-      bpf_ringbuf_submit(out, 0);
+    for (int i = 0; i < MAX_HOPS + 1; i++)
+      if (walk_hop(i, &c))
+        break;
+  }
+  // 走满仍未闭环，则放弃
+  if (!c.found)
+    return;
+
+  // 环一旦形成，参与的线程每次重试加锁都会再走到它：第一次上报，之后
+  // 冷却期内只计数，过了冷却期带着次数再报一次
+  __u64 key = c.hash ^ tgid;
+  __u64 now = bpf_ktime_get_ns();
+  ev->ts = now;
+  struct report_t *r = bpf_map_lookup_elem(&reported, &key);
+  if (r) {
+    if (now - r->last_ns < report_cooldown_ns) {
+      __sync_fetch_and_add(&r->repeats, 1);
       return;
     }
+    ev->repeats = r->repeats + 1;
+    r->repeats = 0;
+    r->last_ns = now;
+  } else {
+    struct report_t nr = {.last_ns = now};
+    // 多个 CPU 同时第一次发现同一个环时只有一个上报
+    if (bpf_map_update_elem(&reported, &key, &nr, BPF_NOEXIST))
+      return;
+    ev->repeats = 0;
+  }
 
-    // 继续沿链查找：查看 cur_owner 是否也在等待某个互斥量
-    __u64 *next_mutex = bpf_map_lookup_elem(&thread_wait, &cur_owner);
-    if (!next_mutex)
-      return; // 对方未等待，链路断开
-    cur_mutex = *next_mutex;
+  __u32 depth = ev->depth;
+  if (depth > MAX_CHAIN)
+    return;
+  bpf_ringbuf_output(&rb, ev,
+                     offsetof(struct event_t, chain) +
+                         depth * sizeof(struct edge_t),
+                     0);
+}
+
+// 加锁成功：对每个已持有的锁 h 记一条 h -> m，第一次出现的边带栈上报；
+// 然后把 m 加入持有集合。每次加锁最多 MAX_HELD 次 map 查询。
+// trylock 和递归锁重入（edges 为 0）都不会等待，不构成顺序边：std::lock 和
+// “持有 A 时 try_lock B，失败就放掉 A” 的退让写法靠前者避免死锁；持有 R、X
+// 后再重入 R 也不是 X -> R。它们只进持有集合，之后阻塞加的锁仍然记边
+static __always_inline void held_push(void *ctx, __u32 tgid, __u32 pid,
+                                      __u64 m, bool edges) {
+  struct task_struct *task = bpf_get_current_task_btf();
+  struct held_locks *h =
+      bpf_task_storage_get(&held, task, 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+  if (!h)
+    return;
+
+  __s32 stack_id = -1;
+  for (int i = 0; edges && i < MAX_HELD; i++) {
+    if (i >= h->nr)
+      break;
+    struct order_key k = {.tgid = tgid, .from = h->locks[i], .to = m};
+    if (k.from == m) // 递归锁重入，不是顺序边
+      continue;
+    if (bpf_map_lookup_elem(&order_seen, &k))
+      continue;
+    __u8 one = 1;
+    bpf_map_update_elem(&order_seen, &k, &one, BPF_ANY);
+    if (stack_id < 0)
+      stack_id = bpf_get_stackid(ctx, &stacks, BPF_F_USER_STACK);
+    struct order_event_t *e = bpf_ringbuf_reserve(&order_rb, sizeof(*e), 0);
+    if (!e)
+      continue;
+    e->tgid = tgid;
+    e->tid = pid;
+    e->from = k.from;
+    e->to = m;
+    e->stack_id = stack_id;
+    bpf_get_current_comm(&e->comm, sizeof(e->comm));
+    bpf_ringbuf_submit(e, 0);
   }
 
-  // 走满 MAX_HOPS 仍未闭环，则放弃（避免无限循环）
-  return;
+  __u32 n = h->nr;
+  if (n < MAX_HELD) {
+    h->locks[n] = m;
+    h->nr = n + 1;
+  } else {
+    h->overflow++;
+  }
 }
 
-// ---- uprobes/uretprobes: pthread_mutex_lock/unlock ----
+// 解锁：从持有集合里删掉 m（解锁顺序不一定和加锁相反，用末尾元素填洞）
+static __always_inline void held_pop(__u64 m) {
+  struct task_struct *task = bpf_get_current_task_btf();
+  struct held_locks *h = bpf_task_storage_get(&held, task, 0, 0);
+  if (!h)
+    return;
+  __u32 last = h->nr - 1;
+  if (last >= MAX_HELD) // nr 为 0
+    return;
+  for (int i = 0; i < MAX_HELD; i++) {
+    if (i > last)
+      break;
+    if (h->locks[i] == m) {
+      h->locks[i] = h->locks[last];
+      h->nr = last;
+      return;
+    }
+  }
+}
 
-// 进入 pthread_mutex_lock：记录“当前线程等待的互斥量”，并尝试检测死锁
+// 读锁成功：已在集合里只加计数，否则抢一个空槽
+static __always_inline void reader_add(struct lock_key *k, __u32 pid) {
+  struct reader_set *rs = bpf_map_lookup_elem(&rw_readers, k);
+  if (!rs) {
+    struct reader_set zero = {};
+    bpf_map_update_elem(&rw_readers, k, &zero, BPF_NOEXIST);
+    rs = bpf_map_lookup_elem(&rw_readers, k);
+    if (!rs)
+      return;
+  }
+  for (int i = 0; i < MAX_READERS; i++) {
+    if (rs->r[i].tid == pid) { // 只有本线程会改自己的槽
+      rs->r[i].count++;
+      return;
+    }
+  }
+  for (int i = 0; i < MAX_READERS; i++) {
+    if (__sync_val_compare_and_swap(&rs->r[i].tid, 0, pid) == 0) {
+      rs->r[i].count = 1;
+      return;
+    }
+  }
+  __sync_fetch_and_add(&rs->overflow, 1);
+}
+
+// 读锁释放：计数归零时先清计数再腾出槽
+static __always_inline void reader_del(struct lock_key *k, __u32 pid) {
+  struct reader_set *rs = bpf_map_lookup_elem(&rw_readers, k);
+  if (!rs)
+    return;
+  for (int i = 0; i < MAX_READERS; i++) {
+    if (rs->r[i].tid != pid)
+      continue;
+    if (rs->r[i].count > 1) {
+      rs->r[i].count--;
+    } else {
+      rs->r[i].count = 0;
+      rs->r[i].tid = 0;
+    }
+    return;
+  }
+}
+
+// ---- uprobes/uretprobes: pthread_mutex_* / pthread_rwlock_* ----
+// 一组程序挂到所有加锁函数上，attach cookie 给出 ACQ_* 标志：
+//   pthread_mutex_lock 0，timedlock/clocklock ACQ_TIMED，trylock ACQ_TRY；
+//   pthread_rwlock_{,timed,clock,try}{rd,wr}lock 再加 ACQ_RWLOCK(|ACQ_WRITE)
+// 它们第一个参数都是锁地址，返回 0 表示拿到锁
+
+// 进入加锁函数：记录“当前线程正在获取的锁”，会阻塞的尝试检测死锁
 SEC("uprobe/pthread_mutex_lock")
 int BPF_KPROBE(lock_enter, void *mutex) {
   if (!filter_tgid())
@@ -115,22 +637,41 @@ int BPF_KPROBE(lock_enter, void *mutex) {
   __u64 id = bpf_get_current_pid_tgid();
   __u32 pid = (__u32)id;
   __u32 tgid = id >> 32;
-  __u64 m = (__u64)mutex;
-
-  // 记录等待关系
-  bpf_map_update_elem(&thread_wait, &pid, &m, BPF_ANY);
+  struct wait_t w = {.lock = (__u64)mutex,
+                     .flags = (__u32)bpf_get_attach_cookie(ctx),
+                     .stack_id = -1,
+                     .since_ns = bpf_ktime_get_ns()};
 
-  // 只有在已知该互斥量存在持有者时才有机会形成环
-  __u32 *owner = bpf_map_lookup_elem(&mutex_owner, &m);
-  if (owner) {
-    // 从当前线程出发沿“等待→持有→等待→...”链检查有界环
-    try_detect_deadlock(pid, tgid, m);
+  // 自己已持有：递归 mutex 重入成功、errorcheck mutex 和 rwlock 返回
+  // EDEADLK，都不会阻塞；普通 mutex 重入是真的自死锁，照常检测
+  struct owner_t owner;
+  int held = !(w.flags & ACQ_TRY) &&
+             !lookup_owner(tgid, w.lock, w.flags & ~ACQ_WRITE, pid, &owner);
+  if (held && owner.tid == pid) {
+    __s32 kind = 0;
+    if (w.flags & ACQ_RWLOCK)
+      w.flags |= ACQ_REENTER;
+    else if (!bpf_probe_read_user(&kind, sizeof(kind),
+                                  (void *)(w.lock + GLIBC_MUTEX_KIND_OFF)) &&
+             ((kind & 3) == GLIBC_MUTEX_RECURSIVE ||
+              (kind & 3) == GLIBC_MUTEX_ERRORCHECK))
+      w.flags |= ACQ_REENTER;
   }
+  // 锁正被别人持有，多半要阻塞，才取栈（无竞争的加锁不付这个开销）
+  if (held && !(w.flags & ACQ_NOWAIT))
+    w.stack_id = user_stack(ctx);
+
+  bpf_map_update_elem(&thread_wait, &pid, &w, BPF_ANY);
+
+  // 从当前线程出发沿“等待→持有→等待→...”链检查有界环；
+  // 该锁无人持有时第一跳就断开
+  if (!(w.flags & ACQ_NOWAIT))
+    try_detect_deadlock(pid, tgid, &w);
   return 0;
 }
 
-// pthread_mutex_lock 返回：成功则建立“互斥量 →
-// 当前线程”的持有关系，并清理等待标记
+// 加锁函数返回：成功则建立持有关系（mutex/写锁记持有者和重入层数，
+// 读锁加入读者集合），并清理等待标记
 SEC("uretprobe/pthread_mutex_lock")
 int BPF_KRETPROBE(lock_exit) {
   if (!filter_tgid())
@@ -140,23 +681,53 @@ int BPF_KRETPROBE(lock_exit) {
   __u64 id = bpf_get_current_pid_tgid();
   __u32 pid = (__u32)id;
 
-  __u64 *pm = bpf_map_lookup_elem(&thread_wait, &pid);
-  if (!pm)
-    return 0; // 未记录等待，可能是 trylock 或其他路径
-
-  if (ret == 0) {
-    // 建立持有关系
-    __u64 m = *pm;
-    bpf_map_update_elem(&mutex_owner, &m, &pid, BPF_ANY);
-  }
-
+  struct wait_t *pw = bpf_map_lookup_elem(&thread_wait, &pid);
+  if (!pw)
+    return 0; // 进入时没记录（比如探针挂上时已在等待）
+  struct wait_t w = *pw;
   // 无论成功与否，退出时移除等待标记
   bpf_map_delete_elem(&thread_wait, &pid);
+  if (ret != 0)
+    return 0;
+
+  struct lock_key k = {.tgid = id >> 32, .addr = w.lock};
+  __u64 now = bpf_ktime_get_ns();
+  __s32 stack_id = -1;
+  int reenter = w.flags & ACQ_REENTER;
+  int reader = (w.flags & (ACQ_RWLOCK | ACQ_WRITE)) == ACQ_RWLOCK;
+  // 加锁栈只取一次，新的持有关系和竞争统计共用；读者集合不记栈，
+  // 不开竞争统计时读锁不付取栈的开销
+  if (!reenter && (contention || (!reader && !owner_from_mutex)))
+    stack_id = user_stack(ctx);
+  if (reader) {
+    reader_add(&k, pid);
+  } else if (!owner_from_mutex) {
+    struct owner_t *o = bpf_map_lookup_elem(&mutex_owner, &k);
+    if (o && o->tid == pid) {
+      o->count++; // 递归锁重入
+    } else {
+      struct owner_t nw = {
+          .tid = pid, .count = 1, .stack_id = stack_id, .acq_ns = now};
+      bpf_map_update_elem(&mutex_owner, &k, &nw, BPF_ANY);
+    }
+  }
+  // 已有位置的锁只多一次查表，不取栈
+  if (record_sites && !reenter && !bpf_map_lookup_elem(&lock_site, &k)) {
+    __s32 site = stack_id >= 0 ? stack_id : user_stack(ctx);
+    bpf_map_update_elem(&lock_site, &k, &site, BPF_NOEXIST);
+  }
+  if (contention && !reenter) {
+    struct cont_key ck = {.tgid = k.tgid, .stack_id = stack_id, .lock = w.lock};
+    account_wait(&ck, now - w.since_ns);
+  }
+  if (lock_order)
+    held_push(ctx, id >> 32, pid, w.lock, !(w.flags & ACQ_NOWAIT));
   return 0;
 }
 
-// 进入 pthread_mutex_unlock：移除“互斥量 →
-// 持有线程”的关系（仅限自己持有的情况）
+// 进入解锁函数（cookie：pthread_rwlock_unlock 为 ACQ_RWLOCK）：
+// 重入层数减到 0 才移除持有关系（仅限自己持有的情况）；
+// rwlock 解锁不区分读写，自己不是写者就是读者
 SEC("uprobe/pthread_mutex_unlock")
 int BPF_KPROBE(unlock_enter, void *mutex) {
   if (!filter_tgid())
@@ -164,10 +735,129 @@ int BPF_KPROBE(unlock_enter, void *mutex) {
   __u64 id = bpf_get_current_pid_tgid();
   __u32 pid = (__u32)id;
   __u64 m = (__u64)mutex;
+  __u32 flags = (__u32)bpf_get_attach_cookie(ctx);
 
-  __u32 *owner = bpf_map_lookup_elem(&mutex_owner, &m);
-  if (owner && *owner == pid) {
-    bpf_map_delete_elem(&mutex_owner, &m);
+  struct lock_key k = {.tgid = id >> 32, .addr = m};
+  struct owner_t *o = bpf_map_lookup_elem(&mutex_owner, &k);
+  if (o && o->tid == pid) {
+    if (o->count > 1) {
+      o->count--;
+    } else {
+      if (contention) {
+        struct cont_key ck = {
+            .tgid = k.tgid, .stack_id = o->stack_id, .lock = m};
+        account_hold(&ck, bpf_ktime_get_ns() - o->acq_ns);
+      }
+      bpf_map_delete_elem(&mutex_owner, &k);
+    }
+  } else if (flags & ACQ_RWLOCK) {
+    reader_del(&k, pid);
   }
+  if (lock_order)
+    held_pop(m);
+  return 0;
+}
+
+// ---- 慢路径模式：只挂 __lll_lock_wait ----
+// 无竞争的 lock/unlock 在用户态原子操作里完成，不进 __lll_lock_wait，
+// 也就不触发 uprobe；只有真正要阻塞的线程才进入等待图。
+// 返回时已经拿到锁（__lll_lock_wait 循环到加锁成功为止）。
+// 发行版的 libc 往往只剩 .dynsym，里面没有 __lll_lock_wait，此时改挂
+// futex 系统调用：lll_lock 竞争时固定以 FUTEX_WAIT(val=2) 睡在 &__lock 上
+
+// 这里的线程一定会阻塞，总是取栈；持有者的加锁栈在此模式下没有
+static __always_inline void slow_wait_begin(void *ctx, __u64 m) {
+  __u64 id = bpf_get_current_pid_tgid();
+  __u32 pid = (__u32)id;
+  __u32 tgid = id >> 32;
+
+  struct wait_t w = {.lock = m,
+                     .stack_id = user_stack(ctx),
+                     .since_ns = bpf_ktime_get_ns()};
+  bpf_map_update_elem(&thread_wait, &pid, &w, BPF_ANY);
+  try_detect_deadlock(pid, tgid, &w);
+}
+
+static __always_inline void slow_wait_end(void) {
+  __u32 pid = (__u32)bpf_get_current_pid_tgid();
+  bpf_map_delete_elem(&thread_wait, &pid);
+}
+
+SEC("uprobe/__lll_lock_wait")
+int BPF_KPROBE(slow_wait_enter, int *futex) {
+  if (!filter_tgid())
+    return 0;
+  slow_wait_begin(ctx, (__u64)futex);
+  return 0;
+}
+
+SEC("uretprobe/__lll_lock_wait")
+int BPF_KRETPROBE(slow_wait_exit) {
+  if (!filter_tgid())
+    return 0;
+  slow_wait_end();
+  return 0;
+}
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAIT_BITSET 9
+#define FUTEX_CMD_MASK 0x7f // 去掉 PRIVATE/CLOCK_REALTIME 标志位
+#define LLL_LOCK_CONTENDED 2
+// __kind 里 lll_lock 路径会出现的位：类型(低 2 位)、PSHARED、ELISION/NO_ELISION；
+// robust / PI / PROTECT 的 mutex 不走 FUTEX_WAIT(2)
+#define GLIBC_MUTEX_LLL_KIND_BITS 0x383
+#define PID_MAX_LIMIT (1 << 22)
+
+// lll_lock_wait_private（stdio、malloc 等 libc 内部锁）和自己写的锁也会以
+// FUTEX_WAIT(2) 睡下去，它们后面不是 pthread_mutex_t。要求像一把被别人持有的
+// mutex：__owner 是别的线程、__nusers 非 0、__kind 只有 lll_lock 会用的位
+static __always_inline bool plausible_pthread_mutex(__u64 m, __u32 pid) {
+  struct {
+    int owner;           // @8
+    unsigned int nusers; // @12
+    int kind;            // @16
+  } d;
+  if (bpf_probe_read_user(&d, sizeof(d), (void *)(m + GLIBC_MUTEX_OWNER_OFF)))
+    return false;
+  if (d.owner <= 0 || d.owner >= PID_MAX_LIMIT || (__u32)d.owner == pid)
+    return false;
+  return d.nusers && !(d.kind & ~GLIBC_MUTEX_LLL_KIND_BITS);
+}
+
+SEC("tracepoint/syscalls/sys_enter_futex")
+int slow_futex_enter(struct trace_event_raw_sys_enter *ctx) {
+  if (!filter_tgid())
+    return 0;
+  int op = (int)ctx->args[1] & FUTEX_CMD_MASK;
+  if (op != FUTEX_WAIT && op != FUTEX_WAIT_BITSET)
+    return 0;
+  // 条件变量、信号量等也走 FUTEX_WAIT，但期望值不是 2
+  if ((int)ctx->args[2] != LLL_LOCK_CONTENDED)
+    return 0;
+  if (!plausible_pthread_mutex(ctx->args[0],
+                               (__u32)bpf_get_current_pid_tgid()))
+    return 0;
+  slow_wait_begin(ctx, ctx->args[0]);
+  return 0;
+}
+
+SEC("tracepoint/syscalls/sys_exit_futex")
+int slow_futex_exit(struct trace_event_raw_sys_exit *ctx) {
+  (void)ctx;
+  if (!filter_tgid())
+    return 0;
+  slow_wait_end();
   return 0;
-}
\ No newline at end of file
+}
+
+// 只报 tgid；此时动态链接器还没映射 libc，用户态稍后再读 maps
+SEC("tracepoint/sched/sched_process_exec")
+int exec_notify(void *ctx) {
+  (void)ctx;
+  __u32 *e = bpf_ringbuf_reserve(&exec_rb, sizeof(*e), 0);
+  if (!e)
+    return 0;
+  *e = bpf_get_current_pid_tgid() >> 32;
+  bpf_ringbuf_submit(e, 0);
+  return 0;
+}
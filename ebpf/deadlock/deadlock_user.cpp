@@ -3,15 +3,26 @@
 
 #include "deadlock.skel.h" // 由 bpftool gen skeleton 生成
 #include "elf_utils.hpp"
+#include "lockorder.hpp"
 #include "utils.hpp"
+#include "watchdog.hpp"
+#include <bpf/bpf.h>
 #include <bpf/libbpf.h>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <errno.h>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <optional>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
 #include <unistd.h>
+#include <vector>
 
 static volatile sig_atomic_t stop;
 static void on_sigint(int sig) {
@@ -19,42 +30,324 @@ static void on_sigint(int sig) {
   stop = 1;
 }
 
+// 加锁方式（与 bpf 一致），作为 attach cookie 传给探针
+#define ACQ_RWLOCK 0x1
+#define ACQ_WRITE 0x2
+#define ACQ_TIMED 0x4
+#define ACQ_TRY 0x8
+
 struct edge_t {
   __u32 pid;
+  __u32 flags;
   __u64 mutex;
+  __s32 hold_stack; // -1 为没有
+  __s32 wait_stack;
+  __u64 held_since; // ktime，0 为未知
+  __u64 wait_since;
 };
+#define MAX_HOPS 6    // 展开版（与 bpf 一致）
+#define MAX_CHAIN 128 // bpf_loop 版
 struct event_t {
   __u32 root_pid;
   __u32 tgid;
   __s32 depth;
+  __u32 repeats;
   char comm[16];
-  struct edge_t chain[7]; // MAX_HOPS+1（与 bpf 一致）
+  __u64 ts;
+  struct edge_t chain[MAX_CHAIN]; // 只上报前 depth 条
+};
+
+#define MAX_STACK_DEPTH 127
+
+static int stacks_fd = -1;
+static Symbolizer symbolizer;
+
+static void print_user_stack(__u32 tgid, int stack_id, const char *indent) {
+  __u64 ips[MAX_STACK_DEPTH] = {};
+  if (stacks_fd < 0 || stack_id < 0 ||
+      bpf_map_lookup_elem(stacks_fd, &stack_id, ips)) {
+    fprintf(stdout, "%s<no stack>\n", indent);
+    return;
+  }
+  for (int i = 0; i < MAX_STACK_DEPTH && ips[i]; i++)
+    fprintf(stdout, "%s#%-2d %s\n", indent, i,
+            symbolizer.symbolize(tgid, ips[i]).c_str());
+}
+
+// -A：锁 -> 第一次加锁时的用户栈（与 bpf 一致）
+struct lock_key {
+  __u32 tgid;
+  __u32 pad;
+  __u64 addr;
 };
+static int sites_fd = -1;
+
+// 锁地址 -> 名字：全局/静态变量为 "符号+偏移 (模块)"；其它的（堆上）给地址，
+// 开了 -A 时附第一次加锁的位置，近似锁的创建处
+static std::string lock_name(__u32 tgid, __u64 addr) {
+  std::string name = symbolizer.symbolize_data(tgid, addr);
+  if (!name.empty())
+    return name;
+  char buf[32];
+  snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)addr);
+  name = buf;
+  lock_key k = {tgid, 0, addr};
+  __s32 site;
+  __u64 ips[MAX_STACK_DEPTH] = {};
+  if (sites_fd >= 0 && stacks_fd >= 0 &&
+      !bpf_map_lookup_elem(sites_fd, &k, &site) && site >= 0 &&
+      !bpf_map_lookup_elem(stacks_fd, &site, ips) && ips[0])
+    name += " [first locked at " + symbolizer.symbolize(tgid, ips[0]) + "]";
+  return name;
+}
+
+// now 与 since 都是 ktime；since 为 0 表示不知道
+static std::string age(__u64 now, __u64 since) {
+  if (!since || now < since)
+    return "?";
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.3fs", (now - since) / 1e9);
+  return buf;
+}
+
+// 等待方式：mutex 为 wait，rwlock 为 rdwait/wrwait，带超时的加 timed
+static std::string wait_label(__u32 flags) {
+  std::string s = !(flags & ACQ_RWLOCK) ? "wait"
+                  : (flags & ACQ_WRITE) ? "wrwait"
+                                         : "rdwait";
+  if (flags & ACQ_TIMED)
+    s = "timed" + s;
+  return s;
+}
+
+// BPF 上报和 watchdog 共用的输出格式
+// repeats：BPF 冷却期内又检测到同一个环的次数，非 0 说明环仍然存在；
+// now：检测时间，BPF 上报时逐条边打印持有/等待多久和两边的栈
+static void print_chain(__u32 tgid, __u32 root, const char *comm,
+                        const edge_t *chain, int depth, __u32 repeats = 0,
+                        __u64 now = 0) {
+  fprintf(stdout, "\n[DEADLOCK?] tgid=%u root_tid=%u comm=%s", tgid, root,
+          comm);
+  if (repeats)
+    fprintf(stdout, " (still present, seen %u more times)", repeats);
+  fprintf(stdout, "\n");
+
+  // 打印链路： T0(wait M0)->T1(wait M1)->...->T0
+  bool timed = false;
+  fprintf(stdout, " chain: T%u", root);
+  for (int i = 0; i < depth; i++) {
+    fprintf(stdout, " --%s(%s)--> T%u", wait_label(chain[i].flags).c_str(),
+            lock_name(tgid, chain[i].mutex).c_str(), chain[i].pid);
+    timed |= chain[i].flags & ACQ_TIMED;
+  }
+  // 若闭环，最后一个应回到 root_tid；有带超时的等待时环会在超时后自己解开
+  if (depth > 0 && chain[depth - 1].pid == root)
+    fprintf(stdout, " <== CYCLE%s\n", timed ? " (until timeout)" : "");
+  else
+    fprintf(stdout, "\n");
+
+  for (int i = 0; now && i < depth; i++) {
+    const edge_t &e = chain[i];
+    __u32 waiter = i ? chain[i - 1].pid : root;
+    fprintf(stdout, "  [%d] T%u holds %s for %s, acquired at:\n", i, e.pid,
+            lock_name(tgid, e.mutex).c_str(), age(now, e.held_since).c_str());
+    print_user_stack(tgid, e.hold_stack, "        ");
+    fprintf(stdout, "      T%u %s for %s, blocked at:\n", waiter,
+            wait_label(e.flags).c_str(), age(now, e.wait_since).c_str());
+    print_user_stack(tgid, e.wait_stack, "        ");
+  }
+  fflush(stdout);
+}
 
 static int on_rb_event(void *ctx, void *data, size_t len) {
   (void)ctx;
-  if (len < sizeof(struct event_t))
+  if (len < offsetof(struct event_t, chain))
     return 0;
   const struct event_t *e = static_cast<const event_t *>(data);
+  size_t max_depth = (len - offsetof(struct event_t, chain)) / sizeof(edge_t);
+  if (e->depth < 0 || (size_t)e->depth > max_depth)
+    return 0;
+  print_chain(e->tgid, e->root_pid, e->comm, e->chain, e->depth, e->repeats,
+              e->ts);
+  return 0;
+}
 
-  fprintf(stdout, "\n[DEADLOCK?] tgid=%u root_tid=%u comm=%s\n", e->tgid,
-          e->root_pid, e->comm);
+struct order_event_t {
+  __u32 tgid;
+  __u32 tid;
+  __u64 from;
+  __u64 to;
+  __s32 stack_id;
+  char comm[16];
+};
 
-  // 打印链路： T0(wait M0)->T1(wait M1)->...->T0
-  fprintf(stdout, " chain: T%u", e->root_pid);
-  for (int i = 0; i < e->depth; i++) {
-    fprintf(stdout, " --wait(0x%llx)--> T%u",
-            (unsigned long long)e->chain[i].mutex, e->chain[i].pid);
-  }
-  // 若闭环，最后一个应回到 root_tid
-  if (e->depth > 0 && e->chain[e->depth - 1].pid == e->root_pid)
-    fprintf(stdout, " <== CYCLE\n");
-  else
+static void print_order_edge(const lockorder::Graph &g, int a, int b) {
+  const lockorder::EdgeInfo *info = g.edge(a, b);
+  __u32 tgid = g.lock(a).tgid;
+  fprintf(stdout, "  %s -> %s", lock_name(tgid, g.lock(a).addr).c_str(),
+          lock_name(tgid, g.lock(b).addr).c_str());
+  if (!info) {
     fprintf(stdout, "\n");
+    return;
+  }
+  fprintf(stdout, "  first by T%u (%s):\n", info->tid, info->comm.c_str());
+  print_user_stack(tgid, info->stack_id, "      ");
+}
+
+// -L：每条新出现的 “已持有 -> 新加锁” 边进全局锁顺序图，成环即报告
+static int on_order_event(void *ctx, void *data, size_t len) {
+  auto *g = static_cast<lockorder::Graph *>(ctx);
+  if (len < sizeof(struct order_event_t))
+    return 0;
+  const struct order_event_t *e = static_cast<const order_event_t *>(data);
+  lockorder::EdgeInfo info;
+  info.tid = e->tid;
+  info.stack_id = e->stack_id;
+  info.comm.assign(e->comm, strnlen(e->comm, sizeof(e->comm)));
+
+  std::vector<int> cycle;
+  if (!g->add_edge(e->tgid, e->from, e->to, std::move(info), &cycle))
+    return 0;
+  // cycle 为 to -> ... -> from，加上新边 from -> to 闭合
+  fprintf(stdout,
+          "\n[LOCK ORDER INVERSION] tgid=%u tid=%u comm=%.16s, %zu locks\n",
+          e->tgid, e->tid, e->comm, cycle.size());
+  for (size_t i = 0; i + 1 < cycle.size(); i++)
+    print_order_edge(*g, cycle[i], cycle[i + 1]);
+  print_order_edge(*g, cycle.back(), cycle.front());
   fflush(stdout);
   return 0;
 }
 
+// -c：竞争统计（与 bpf 一致）
+#define HIST_SLOTS 32
+struct cont_key {
+  __u32 tgid;
+  __s32 stack_id;
+  __u64 lock;
+};
+struct cont_stats {
+  __u64 count;
+  __u64 wait_ns;
+  __u64 max_wait_ns;
+  __u64 hold_ns;
+  __u64 holds;
+  __u32 wait_hist[HIST_SLOTS];
+  __u32 hold_hist[HIST_SLOTS];
+};
+
+static void print_log2_hist(const __u32 *slots, const char *indent) {
+  __u32 peak = 0;
+  int last = -1;
+  for (int i = 0; i < HIST_SLOTS; i++) {
+    if (slots[i] > peak)
+      peak = slots[i];
+    if (slots[i])
+      last = i;
+  }
+  for (int i = 0; i <= last; i++) {
+    unsigned long long lo = (i == 0) ? 0ull : (1ull << i);
+    unsigned long long hi = (1ull << (i + 1));
+    int bars = peak ? (int)((__u64)slots[i] * 30 / peak) : 0;
+    if (bars < 1 && slots[i])
+      bars = 1;
+    printf("%s%8llu - %-8llu us : %-8u | ", indent, lo, hi, slots[i]);
+    for (int b = 0; b < bars; b++)
+      putchar('#');
+    putchar('\n');
+  }
+}
+
+static std::string usecs(__u64 ns) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.1f", ns / 1e3);
+  return buf;
+}
+
+// 汇总各 CPU 的累计值，按总等待时间降序打印前 top 个 (锁, 加锁栈)
+static void print_contention(int fd, int top) {
+  int ncpu = libbpf_num_possible_cpus();
+  if (ncpu <= 0)
+    return;
+  std::vector<cont_stats> percpu(ncpu);
+  std::vector<std::pair<cont_key, cont_stats>> rows;
+  cont_key key, next;
+  cont_key *prev = nullptr;
+  while (!bpf_map_get_next_key(fd, prev, &next)) {
+    key = next;
+    prev = &key;
+    if (bpf_map_lookup_elem(fd, &key, percpu.data()))
+      continue;
+    cont_stats sum = {};
+    for (const auto &c : percpu) {
+      sum.count += c.count;
+      sum.wait_ns += c.wait_ns;
+      sum.max_wait_ns = std::max(sum.max_wait_ns, c.max_wait_ns);
+      sum.hold_ns += c.hold_ns;
+      sum.holds += c.holds;
+      for (int i = 0; i < HIST_SLOTS; i++) {
+        sum.wait_hist[i] += c.wait_hist[i];
+        sum.hold_hist[i] += c.hold_hist[i];
+      }
+    }
+    if (sum.count || sum.holds)
+      rows.emplace_back(key, sum);
+  }
+  std::sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) {
+    return a.second.wait_ns > b.second.wait_ns;
+  });
+  if (top > 0 && rows.size() > (size_t)top)
+    rows.resize(top);
+
+  printf("\n%-8s %-18s %10s %12s %10s %10s %10s\n", "TGID", "LOCK", "COUNT",
+         "TOTAL_WAIT", "AVG_WAIT", "MAX_WAIT", "AVG_HOLD");
+  printf("%-8s %-18s %10s %12s %10s %10s %10s\n", "", "", "", "(us)", "(us)",
+         "(us)", "(us)");
+  for (const auto &[k, st] : rows)
+    printf("%-8u 0x%-16llx %10llu %12s %10s %10s %10s\n", k.tgid,
+           (unsigned long long)k.lock, (unsigned long long)st.count,
+           usecs(st.wait_ns).c_str(),
+           st.count ? usecs(st.wait_ns / st.count).c_str() : "-",
+           usecs(st.max_wait_ns).c_str(),
+           st.holds ? usecs(st.hold_ns / st.holds).c_str() : "-");
+
+  for (const auto &[k, st] : rows) {
+    printf("\n tgid=%u lock=%s count=%llu, acquired at:\n", k.tgid,
+           lock_name(k.tgid, k.lock).c_str(), (unsigned long long)st.count);
+    print_user_stack(k.tgid, k.stack_id, "    ");
+    printf("   wait:\n");
+    print_log2_hist(st.wait_hist, "    ");
+    if (st.holds) {
+      printf("   hold:\n");
+      print_log2_hist(st.hold_hist, "    ");
+    }
+  }
+  fflush(stdout);
+}
+
+// -w：不加载 BPF，每秒扫一次目标进程的线程
+static int run_watchdog(pid_t pid, double stuck_secs) {
+  printf("deadlock watchdog running. pid=%d stuck>=%.1fs (no probes)\n", pid,
+         stuck_secs);
+  fflush(stdout);
+  watchdog::Watchdog wd(pid, stuck_secs);
+  while (!stop) {
+    for (const auto &c : wd.scan()) {
+      std::vector<edge_t> chain;
+      for (const auto &e : c.chain)
+        chain.push_back({e.tid, 0, e.mutex, -1, -1, 0, 0});
+      print_chain(pid, c.root, c.comm.c_str(), chain.data(),
+                  (int)chain.size());
+    }
+    if (kill(pid, 0) && errno == ESRCH) {
+      fprintf(stderr, "process %d exited\n", pid);
+      break;
+    }
+    sleep(1);
+  }
+  return 0;
+}
+
 static const char *guess_pthread_path(void) {
   // 尝试常见路径（也可通过命令行传入）
   const char *candidates[] = {
@@ -71,6 +364,210 @@ static const char *guess_pthread_path(void) {
   return NULL;
 }
 
+// 探针挂在哪些 pthread 函数上；cookie 告诉 BPF 是哪种锁、哪种加锁方式。
+// pthread_mutex_lock/unlock 必须有，其余随 glibc 版本可能没有（clocklock 2.30+）
+struct LockFunc {
+  const char *name;
+  __u64 cookie; // ACQ_*
+  bool unlock;
+};
+
+static const LockFunc lock_funcs[] = {
+    {"pthread_mutex_lock", 0, false},
+    {"pthread_mutex_timedlock", ACQ_TIMED, false},
+    {"pthread_mutex_clocklock", ACQ_TIMED, false},
+    {"pthread_mutex_trylock", ACQ_TRY, false},
+    {"pthread_mutex_unlock", 0, true},
+    {"pthread_rwlock_rdlock", ACQ_RWLOCK, false},
+    {"pthread_rwlock_timedrdlock", ACQ_RWLOCK | ACQ_TIMED, false},
+    {"pthread_rwlock_clockrdlock", ACQ_RWLOCK | ACQ_TIMED, false},
+    {"pthread_rwlock_tryrdlock", ACQ_RWLOCK | ACQ_TRY, false},
+    {"pthread_rwlock_wrlock", ACQ_RWLOCK | ACQ_WRITE, false},
+    {"pthread_rwlock_timedwrlock", ACQ_RWLOCK | ACQ_WRITE | ACQ_TIMED,
+     false},
+    {"pthread_rwlock_clockwrlock", ACQ_RWLOCK | ACQ_WRITE | ACQ_TIMED,
+     false},
+    {"pthread_rwlock_trywrlock", ACQ_RWLOCK | ACQ_WRITE | ACQ_TRY, false},
+    {"pthread_rwlock_unlock", ACQ_RWLOCK, true},
+};
+
+static bpf_link *attach_uprobe(bpf_program *prog, pid_t pid, const char *bin,
+                               size_t off, bool retprobe, const char *what,
+                               __u64 cookie = 0) {
+  LIBBPF_OPTS(bpf_uprobe_opts, opts, .bpf_cookie = cookie,
+              .retprobe = retprobe, );
+  bpf_link *link = bpf_program__attach_uprobe_opts(prog, pid, bin, off, &opts);
+  if (!link || libbpf_get_error(link)) {
+    std::fprintf(stderr, "attach %s failed: %s\n", what,
+                 strerror(-libbpf_get_error(link)));
+    return nullptr;
+  }
+  return link;
+}
+
+// 按库文件（dev/ino）挂探针：-p 时只有目标进程用的那一个；系统范围时是
+// 所有进程映射到的每个不同的 libc/libpthread（包括容器里的），之后新进程
+// exec 时再看它带来的是不是新文件。uprobe 挂在文件上，同一个库只挂一次
+struct LibEntry {
+  LibRef ref;
+  std::map<std::string, size_t> syms; // 空：没有 pthread 函数（2.34+ 的 libpthread 空壳）
+  bool attached = false;
+};
+
+class LibAttacher {
+public:
+  LibAttacher(pid_t pid, bool slow_path, bool owner_from_mutex)
+      : pid_(pid), slow_path_(slow_path), owner_from_mutex_(owner_from_mutex) {}
+
+  // 按优先级取第一个有 pthread_mutex_lock 的库；符号表每个文件只解析一次
+  LibEntry *pick(const std::vector<LibRef> &cands) {
+    for (const auto &ref : cands) {
+      auto [it, fresh] = libs_.try_emplace({ref.dev, ref.ino});
+      LibEntry &e = it->second;
+      if (fresh) {
+        e.ref = ref;
+        std::vector<std::string> names{"__lll_lock_wait"};
+        for (const auto &f : lock_funcs)
+          names.push_back(f.name);
+        e.syms = find_func_offsets_in_elf(ref.path, names);
+        if (!e.syms.count("pthread_mutex_lock") ||
+            !e.syms.count("pthread_mutex_unlock"))
+          e.syms.clear();
+      }
+      if (!e.syms.empty())
+        return &e;
+    }
+    return nullptr;
+  }
+
+  // 把 pick 过、还没挂的库都挂上；慢路径挂 __lll_lock_wait，否则挂 lock_funcs
+  int attach_pending(deadlock_bpf *skel) {
+    for (auto &[key, e] : libs_) {
+      if (e.syms.empty() || e.attached)
+        continue;
+      const char *bin = e.ref.path.c_str();
+      int n = 0;
+      if (slow_path_) {
+        size_t off = e.syms.at("__lll_lock_wait");
+        if (!attach_uprobe(skel->progs.slow_wait_enter, pid_, bin, off, false,
+                           "slow_wait_enter") ||
+            !attach_uprobe(skel->progs.slow_wait_exit, pid_, bin, off, true,
+                           "slow_wait_exit"))
+          return -1;
+        n = 1;
+      }
+      for (const auto &f : lock_funcs) {
+        auto it = e.syms.find(f.name);
+        if (slow_path_ || it == e.syms.end())
+          continue;
+        // 持有者读 __owner 时 mutex 解锁不用挂
+        if (f.unlock && owner_from_mutex_ && !(f.cookie & ACQ_RWLOCK))
+          continue;
+        if (f.unlock) {
+          if (!attach_uprobe(skel->progs.unlock_enter, pid_, bin, it->second,
+                             false, f.name, f.cookie))
+            return -1;
+        } else if (!attach_uprobe(skel->progs.lock_enter, pid_, bin,
+                                  it->second, false, f.name, f.cookie) ||
+                   !attach_uprobe(skel->progs.lock_exit, pid_, bin,
+                                  it->second, true, f.name, f.cookie)) {
+          return -1;
+        }
+        n++;
+      }
+      e.attached = true;
+      printf("attached %s (%d functions)\n", bin, n);
+    }
+    return 0;
+  }
+
+  size_t attached() const {
+    size_t n = 0;
+    for (const auto &[key, e] : libs_)
+      n += e.attached;
+    return n;
+  }
+
+private:
+  pid_t pid_;
+  bool slow_path_, owner_from_mutex_;
+  std::map<std::pair<dev_t, ino_t>, LibEntry> libs_;
+};
+
+// 系统范围：exec 之后动态链接器才映射 libc，先记下来，过一会儿再读 maps。
+// 一次读不准：短命进程 200ms 后可能已经退出，libpthread 也可能稍后才
+// dlopen，所以按退避重读，找到带 pthread 函数的库或进程退出就不再看
+struct ExecQueue {
+  struct Entry {
+    pid_t pid;
+    std::chrono::steady_clock::time_point due;
+    int attempt;
+  };
+  static constexpr std::chrono::milliseconds delays[] = {
+      std::chrono::milliseconds(20), std::chrono::milliseconds(200),
+      std::chrono::milliseconds(1000), std::chrono::milliseconds(5000)};
+  std::vector<Entry> pids;
+
+  // 到期的都重读一遍；返回是否有新库要挂
+  bool rescan(LibAttacher &libs) {
+    auto now = std::chrono::steady_clock::now();
+    bool found = false;
+    std::vector<Entry> later;
+    for (const Entry &e : pids) {
+      if (e.due > now) {
+        later.push_back(e);
+        continue;
+      }
+      if (libs.pick(pthread_lib_candidates(e.pid))) {
+        found = true;
+        continue;
+      }
+      std::string proc = "/proc/" + std::to_string(e.pid);
+      int next = e.attempt + 1;
+      if (next < (int)std::size(delays) && access(proc.c_str(), F_OK) == 0)
+        later.push_back({e.pid, now + delays[next], next});
+    }
+    pids.swap(later);
+    return found;
+  }
+
+  // 下一次到期还有多久，用作 poll 的超时
+  int timeout_ms(int max_ms) const {
+    auto now = std::chrono::steady_clock::now();
+    long ms = max_ms;
+    for (const Entry &e : pids) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      e.due - now)
+                      .count();
+      ms = std::min(ms, std::max(left, 0L));
+    }
+    return (int)ms;
+  }
+};
+
+static int on_exec_event(void *ctx, void *data, size_t len) {
+  auto *q = static_cast<ExecQueue *>(ctx);
+  if (len < sizeof(__u32))
+    return 0;
+  pid_t pid = *static_cast<const __u32 *>(data);
+  symbolizer.forget(pid); // 旧映像的 maps 作废
+  q->pids.push_back(
+      {pid, std::chrono::steady_clock::now() + ExecQueue::delays[0], 0});
+  return 0;
+}
+
+// 检测路径所在程序的验证/体积数据，用来对比展开版和 bpf_loop 版
+static void print_prog_stats(bpf_program *prog, const char *name) {
+  if (!bpf_program__autoload(prog))
+    return;
+  struct bpf_prog_info info = {};
+  __u32 len = sizeof(info);
+  if (bpf_obj_get_info_by_fd(bpf_program__fd(prog), &info, &len))
+    return;
+  printf("  %-16s verified %u insns, xlated %u B, jited %u B\n", name,
+         info.verified_insns, info.xlated_prog_len, info.jited_prog_len);
+}
+
 static int libbpf_log_cb(enum libbpf_print_level level, const char *fmt,
                          va_list args) {
   if (level == LIBBPF_DEBUG)
@@ -83,8 +580,15 @@ int main(int argc, char **argv) {
   const char *pthread_path = NULL;
   int opt;
   pid_t target_pid = -1;
+  bool slow_path = false, owner_from_mutex = false, lock_order = false;
+  double watchdog_secs = 0;
+  int max_hops = 0;
+  double cooldown_secs = 10;
+  bool record_stacks = true;
+  int contention_top = -1; // -1：不统计；0：全部
+  bool record_sites = false;
 
-  while ((opt = getopt(argc, argv, "p:l:")) != -1) {
+  while ((opt = getopt(argc, argv, "p:l:sow:LH:C:Nc:A")) != -1) {
     switch (opt) {
     case 'p':
       target_pid = (pid_t)atoi(optarg); // 仅跟踪此 TGID
@@ -92,30 +596,126 @@ int main(int argc, char **argv) {
     case 'l':
       pthread_path = optarg; // 指定 libpthread 路径
       break;
+    case 's':
+      slow_path = true; // 只跟踪真正阻塞的加锁
+      break;
+    case 'o':
+      owner_from_mutex = true; // 持有者读 mutex.__data.__owner
+      break;
+    case 'w':
+      watchdog_secs = atof(optarg); // 看门狗：阻塞超过该秒数的线程才进图
+      break;
+    case 'L':
+      lock_order = true; // lockdep：加锁顺序成环即报告
+      break;
+    case 'H':
+      max_hops = atoi(optarg); // bpf_loop 沿等待链最多走的跳数
+      if (max_hops <= 0 || max_hops > MAX_CHAIN) {
+        fprintf(stderr, "-H must be 1..%d\n", MAX_CHAIN);
+        return 1;
+      }
+      break;
+    case 'C':
+      cooldown_secs = atof(optarg); // 同一个环重复上报的最小间隔
+      break;
+    case 'N':
+      record_stacks = false; // 不记持有者/等待者的栈
+      break;
+    case 'c':
+      contention_top = atoi(optarg); // 竞争统计，退出时打印前 N 个
+      if (contention_top < 0) {
+        fprintf(stderr, "-c must be >= 0\n");
+        return 1;
+      }
+      break;
+    case 'A':
+      record_sites = true; // 记每把锁第一次加锁的位置，给堆上的锁命名
+      break;
     default:
-      fprintf(stderr, "Usage: %s [-p tgid] [-l /path/to/libpthread.so.0]\n",
-              argv[0]);
+      fprintf(stderr,
+              "Usage: %s [-p tgid] [-l /path/to/libpthread.so.0] [-s] [-o] "
+              "[-w secs] [-L] [-H hops] [-C secs] [-N] [-c top] [-A]\n"
+              "  -p  只跟踪该进程；省略时系统范围：挂所有进程（含容器）用到的 "
+              "每个 libc/libpthread，新进程 exec 后自动补挂\n"
+              "  -l  指定库文件（优先于自动查找）\n"
+              "  -s  只挂 glibc 竞争慢路径 __lll_lock_wait，持有者读 "
+              "mutex.__data.__owner；无竞争的加解锁零开销（只覆盖 mutex）\n"
+              "  -o  仍挂 pthread_mutex_lock，但持有者读 __owner，"
+              "不挂 unlock、不维护 mutex_owner\n"
+              "  -w  看门狗：不挂探针，每秒扫 /proc/<pid>/task，对卡在 "
+              "futex 锁等待超过 secs 秒的线程读 __owner 找环（需要 -p）\n"
+              "  -L  lockdep：记录 “已持有 -> 新加锁” 顺序边，锁顺序图成环即报告"
+              "（不必真的死锁），附每条边第一次出现时的栈\n"
+              "  -H  用 bpf_loop 沿等待链最多走 hops 跳（1..%d，内核 5.17+）；"
+              "默认展开 %d 跳\n"
+              "  -C  同一个环（按线程/锁集合去重）至多每 secs 秒上报一次，"
+              "附期间的检测次数（默认 10）\n"
+              "  -N  不记加锁/阻塞时的用户栈（默认记，环上每条边打印两边的栈）\n"
+              "  -c  竞争统计：按 (锁, 加锁栈) 累计等待/持有时间，退出时按总等待"
+              "降序打印前 top 个（0 为全部）及 log2 直方图；-o 时没有持有时间\n"
+              "  -A  记每把锁第一次加锁成功时的栈，没有数据符号的锁（堆上的）"
+              "在输出里附这个位置\n",
+              argv[0], MAX_CHAIN, MAX_HOPS + 1);
       return 1;
     }
   }
 
-  auto libpath = find_lib_for_pid(target_pid, "libpthread");
-  if (!libpath)
-    libpath =
-        find_lib_for_pid(target_pid, "libc"); // glibc 2.34 后 pthread 并入 libc
+  signal(SIGINT, on_sigint);
+  if (lock_order && (slow_path || owner_from_mutex || watchdog_secs > 0)) {
+    fprintf(stderr, "-L 需要完整的 lock/unlock 探针，不能与 -s/-o/-w 同用\n");
+    return 1;
+  }
+  if (contention_top >= 0 && (slow_path || watchdog_secs > 0)) {
+    fprintf(stderr, "-c 需要 pthread 加锁函数的进出探针，不能与 -s/-w 同用\n");
+    return 1;
+  }
+  if (record_sites && (slow_path || watchdog_secs > 0 || !record_stacks)) {
+    fprintf(stderr, "-A 需要加锁返回探针和用户栈，不能与 -s/-w/-N 同用\n");
+    return 1;
+  }
+  if (watchdog_secs > 0) {
+    if (target_pid <= 0) {
+      fprintf(stderr, "-w needs -p\n");
+      return 1;
+    }
+    return run_watchdog(target_pid, watchdog_secs);
+  }
 
-  if (!libpath) {
-    fprintf(stderr,
-            "Failed to find libpthread.so.0; use -l to specify path.\n");
+  if (slow_path)
+    owner_from_mutex = true;
+  // 没有 -p 也没有 -l：系统范围，挂所有进程用到的库，并跟进新进程
+  bool system_wide = target_pid <= 0 && !pthread_path;
+  LibAttacher libs(target_pid > 0 ? target_pid : -1, slow_path,
+                   owner_from_mutex);
+  LibEntry *lib = nullptr;
+  if (pthread_path) {
+    LibRef ref;
+    struct stat st;
+    if (stat(pthread_path, &st)) {
+      fprintf(stderr, "%s: %s\n", pthread_path, strerror(errno));
+      return 1;
+    }
+    ref.path = pthread_path;
+    ref.dev = st.st_dev;
+    ref.ino = st.st_ino;
+    lib = libs.pick({ref});
+  } else if (target_pid > 0) {
+    lib = libs.pick(pthread_lib_candidates(target_pid));
+  } else if (!slow_path) {
+    for (int pid : list_pids())
+      if (LibEntry *e = libs.pick(pthread_lib_candidates(pid)))
+        lib = e;
+  }
+  // 系统范围的 -s 直接用 futex tracepoint，不用找库
+  if (!lib && !(system_wide && slow_path)) {
+    fprintf(stderr, "Failed to find pthread functions in libpthread/libc; "
+                    "use -l to specify path.\n");
     return 1;
   }
 
-  pthread_path = libpath->c_str();
   libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
   libbpf_set_print(libbpf_log_cb); // 静默 libbpf 日志（按需）
 
-  signal(SIGINT, on_sigint);
-
   auto skel_ptr =
       std::unique_ptr<deadlock_bpf, decltype(&deadlock_bpf__destroy)>(
           nullptr, deadlock_bpf__destroy);
@@ -125,52 +725,78 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (target_pid > 0)
+    skel_ptr->rodata->target_tgid = target_pid;
+  skel_ptr->rodata->owner_from_mutex = owner_from_mutex;
+  // 两种模式的探针只加载一组；持有者读 __owner 时不需要 unlock 和 mutex_owner
+  bpf_program__set_autoload(skel_ptr->progs.lock_enter, !slow_path);
+  bpf_program__set_autoload(skel_ptr->progs.lock_exit, !slow_path);
+  // rwlock 读者集合总是要靠 unlock 维护
+  bpf_program__set_autoload(skel_ptr->progs.unlock_enter, !slow_path);
+  // 慢路径优先挂 __lll_lock_wait；libc 去掉了 .symtab 时退回 futex tracepoint
+  bool off_wait = slow_path && lib && lib->syms.count("__lll_lock_wait");
+  bpf_program__set_autoload(skel_ptr->progs.slow_wait_enter,
+                            slow_path && off_wait);
+  bpf_program__set_autoload(skel_ptr->progs.slow_wait_exit,
+                            slow_path && off_wait);
+  bpf_program__set_autoload(skel_ptr->progs.slow_futex_enter,
+                            slow_path && !off_wait);
+  bpf_program__set_autoload(skel_ptr->progs.slow_futex_exit,
+                            slow_path && !off_wait);
+  if (owner_from_mutex)
+    bpf_map__set_max_entries(skel_ptr->maps.mutex_owner, 1);
+  if (slow_path)
+    bpf_map__set_max_entries(skel_ptr->maps.rw_readers, 1);
+  skel_ptr->rodata->lock_order = lock_order;
+  skel_ptr->rodata->max_hops = max_hops;
+  skel_ptr->rodata->report_cooldown_ns = (__u64)(cooldown_secs * 1e9);
+  bpf_program__set_autoload(skel_ptr->progs.exec_notify,
+                            system_wide && !slow_path);
+  if (!system_wide || slow_path)
+    bpf_map__set_max_entries(skel_ptr->maps.exec_rb, getpagesize());
+  skel_ptr->rodata->record_stacks = record_stacks;
+  skel_ptr->rodata->contention = contention_top >= 0;
+  if (contention_top < 0)
+    bpf_map__set_max_entries(skel_ptr->maps.cont_stats, 1);
+  else if (!system_wide)
+    bpf_map__set_max_entries(skel_ptr->maps.cont_stats, 4096); // 单个进程
+  skel_ptr->rodata->record_sites = record_sites;
+  if (!record_sites)
+    bpf_map__set_max_entries(skel_ptr->maps.lock_site, 1);
+  if (!lock_order && !record_stacks)
+    bpf_map__set_max_entries(skel_ptr->maps.stacks, 1);
+  if (!lock_order) {
+    bpf_map__set_max_entries(skel_ptr->maps.order_seen, 1);
+    bpf_map__set_max_entries(skel_ptr->maps.order_rb, getpagesize());
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
   int err = deadlock_bpf__load(skel_ptr.get());
   if (err) {
     fprintf(stderr, "load skel failed: %d\n", err);
     return 1;
   }
+  double load_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - t0)
+                       .count();
+  if (max_hops)
+    printf("wait-chain walk: bpf_loop, %d hops; load %.1f ms\n", max_hops,
+           load_ms);
+  else
+    printf("wait-chain walk: unrolled, %d hops; load %.1f ms\n", MAX_HOPS + 1,
+           load_ms);
+  print_prog_stats(skel_ptr->progs.lock_enter, "lock_enter");
+  print_prog_stats(skel_ptr->progs.slow_wait_enter, "slow_wait_enter");
+  print_prog_stats(skel_ptr->progs.slow_futex_enter, "slow_futex_enter");
 
-  // 解析偏移
-  auto off_lock_opt =
-      find_func_offset_in_elf(pthread_path, "pthread_mutex_lock");
-  auto off_unlock_opt =
-      find_func_offset_in_elf(pthread_path, "pthread_mutex_unlock");
-  if (!off_lock_opt || !off_unlock_opt) {
-    fprintf(stderr, "ELF: not found pthread symbols in %s\n", pthread_path);
-    return 1;
-  }
-  size_t off_lock = *off_lock_opt;
-  size_t off_unlock = *off_unlock_opt;
-
-  pid_t target = target_pid; // 或 -1 做系统范围
-  const char *bin = pthread_path;
-
-  LIBBPF_OPTS(bpf_uprobe_opts, enter_opts, .retprobe = false, );
-
-  bpf_link *link_lock_enter = bpf_program__attach_uprobe_opts(
-      skel_ptr->progs.lock_enter, target, bin, off_lock, &enter_opts);
-  if (!link_lock_enter || libbpf_get_error(link_lock_enter)) {
-    std::fprintf(stderr, "attach lock_enter failed: %s\n",
-                 strerror(-libbpf_get_error(link_lock_enter)));
-    return 1;
-  }
-
-  LIBBPF_OPTS(bpf_uprobe_opts, exit_opts, .retprobe = true, );
-  bpf_link *link_lock_exit = bpf_program__attach_uprobe_opts(
-      skel_ptr->progs.lock_exit, target, bin, off_lock, &exit_opts);
-  if (!link_lock_exit || libbpf_get_error(link_lock_exit)) {
-    std::fprintf(stderr, "attach lock_ret failed: %s\n",
-                 strerror(-libbpf_get_error(link_lock_exit)));
-    return 1;
-  }
-
-  LIBBPF_OPTS(bpf_uprobe_opts, unlock_opts, .retprobe = false, );
-  bpf_link *link_unlock_enter = bpf_program__attach_uprobe_opts(
-      skel_ptr->progs.unlock_enter, target, bin, off_unlock, &unlock_opts);
-  if (!link_unlock_enter || libbpf_get_error(link_unlock_enter)) {
-    std::fprintf(stderr, "attach unlock_enter failed: %s\n",
-                 strerror(-libbpf_get_error(link_unlock_enter)));
+  if (slow_path && !off_wait) {
+    // tracepoint 对所有进程生效，按 target_tgid 在 BPF 里过滤
+    if (!bpf_program__attach(skel_ptr->progs.slow_futex_enter) ||
+        !bpf_program__attach(skel_ptr->progs.slow_futex_exit)) {
+      fprintf(stderr, "attach futex tracepoints failed\n");
+      return 1;
+    }
+  } else if (libs.attach_pending(skel_ptr.get())) {
     return 1;
   }
 
@@ -183,15 +809,50 @@ int main(int argc, char **argv) {
     std::fprintf(stderr, "rb new fail\n");
     return 1;
   }
+  ExecQueue execs;
+  if (system_wide && !slow_path &&
+      ring_buffer__add(rb_ptr.get(), bpf_map__fd(skel_ptr->maps.exec_rb),
+                       on_exec_event, &execs)) {
+    std::fprintf(stderr, "exec rb add fail\n");
+    return 1;
+  }
+  lockorder::Graph order_graph;
+  if (lock_order || record_stacks)
+    stacks_fd = bpf_map__fd(skel_ptr->maps.stacks);
+  if (record_sites)
+    sites_fd = bpf_map__fd(skel_ptr->maps.lock_site);
+  if (lock_order) {
+    if (ring_buffer__add(rb_ptr.get(), bpf_map__fd(skel_ptr->maps.order_rb),
+                         on_order_event, &order_graph)) {
+      std::fprintf(stderr, "order rb add fail\n");
+      return 1;
+    }
+  }
 
-  printf("deadlock (CO-RE + ringbuf) running. libpthread=%s %s\n", pthread_path,
-         target_pid > 0 ? "[filter by tgid]" : "[all processes]");
+  printf("deadlock (CO-RE + ringbuf) running. %zu lib(s) %s%s\n",
+         libs.attached(),
+         target_pid > 0 ? "[filter by tgid]" : "[all processes]",
+         !slow_path ? ""
+         : off_wait ? " [contended only: __lll_lock_wait]"
+                    : " [contended only: futex]");
+  fflush(stdout);
 
   while (!stop) {
-    int r = ring_buffer__poll(rb_ptr.get(), 200 /*ms*/);
+    int r = ring_buffer__poll(rb_ptr.get(), execs.timeout_ms(200));
     if (r == -EINTR)
       break;
+    // 新进程 exec 后按退避读它的 maps，带来新的库文件就补挂
+    if (execs.rescan(libs)) {
+      if (libs.attach_pending(skel_ptr.get()))
+        break;
+      fflush(stdout);
+    }
   }
+  if (lock_order)
+    printf("lock order graph: %zu locks, %zu edges\n", order_graph.nodes(),
+           order_graph.edges());
+  if (contention_top >= 0)
+    print_contention(bpf_map__fd(skel_ptr->maps.cont_stats), contention_top);
 
   return 0;
 }
\ No newline at end of file
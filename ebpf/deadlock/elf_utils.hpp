@@ -5,11 +5,20 @@
 #include <fcntl.h>
 #include <gelf.h>
 #include <libelf.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <cxxabi.h>
+#include <fstream>
 #include <limits>
+#include <map>
+#include <memory>
 #include <optional>
 #include <stdexcept>
 #include <string>
@@ -70,6 +79,16 @@ inline uint64_t calc_load_bias(Elf *e) {
   return min_vaddr;
 }
 
+// 要收的符号种类：函数（uprobe、栈符号化）和/或数据对象（全局变量，如锁）
+enum SymKind : unsigned { kFuncSym = 1, kObjectSym = 2 };
+
+inline bool kind_matches(unsigned char st_type, unsigned kinds) {
+  if (st_type == STT_FUNC || st_type == STT_GNU_IFUNC)
+    return kinds & kFuncSym;
+  // TLS 符号的值是 TLS 块内偏移，不是地址，不收
+  return st_type == STT_OBJECT && (kinds & kObjectSym);
+}
+
 inline bool name_matches(const char *elf_name, const char *want) {
   if (!elf_name)
     return false;
@@ -85,9 +104,11 @@ inline bool name_matches(const char *elf_name, const char *want) {
   return false;
 }
 
-// 扫描某个符号表（DYNSYM 或 SYMTAB），返回 (命中?, st_value, bind, type)
+// 扫描某个符号表（DYNSYM 或 SYMTAB），返回 (命中?, st_value, bind, type)；
+// kinds 决定收函数还是数据对象，默认只收函数
 inline std::optional<std::tuple<uint64_t, unsigned char, unsigned char>>
-scan_symtab(Elf *e, Elf_Scn *scn, const char *want) {
+scan_symtab(Elf *e, Elf_Scn *scn, const char *want,
+            unsigned kinds = kFuncSym) {
   GElf_Shdr shdr;
   if (!gelf_getshdr(scn, &shdr))
     return std::nullopt;
@@ -99,7 +120,7 @@ scan_symtab(Elf *e, Elf_Scn *scn, const char *want) {
     return std::nullopt;
   size_t count = shdr.sh_size / shdr.sh_entsize;
 
-  // 优先选择 GLOBAL/WEAK 且已定义的函数
+  // 优先选择 GLOBAL/WEAK 且已定义的符号
   std::optional<std::tuple<uint64_t, unsigned char, unsigned char>> best;
 
   for (size_t i = 0; i < count; ++i) {
@@ -107,7 +128,7 @@ scan_symtab(Elf *e, Elf_Scn *scn, const char *want) {
     if (!gelf_getsym(data, (int)i, &sym))
       continue;
     unsigned char st_type = GELF_ST_TYPE(sym.st_info);
-    if (st_type != STT_FUNC && st_type != STT_GNU_IFUNC)
+    if (!kind_matches(st_type, kinds))
       continue;
     if (sym.st_shndx == SHN_UNDEF)
       continue;
@@ -173,6 +194,56 @@ inline std::optional<uint64_t> find_sym_value(Elf *e, const char *want) {
   return val;
 }
 
+// 一次遍历符号表，为 found 里每个还没找到（bind 为 0xff）的名字取函数地址，
+// 偏好规则同 scan_symtab
+struct SymHit {
+  uint64_t value = 0;
+  unsigned char bind = 0xff;
+};
+
+inline void scan_symtab_many(Elf *e, Elf_Scn *scn,
+                             std::map<std::string, SymHit> &found) {
+  GElf_Shdr shdr;
+  if (!gelf_getshdr(scn, &shdr))
+    return;
+  Elf_Data *data = elf_getdata(scn, nullptr);
+  if (!data || !shdr.sh_entsize)
+    return;
+  size_t count = shdr.sh_size / shdr.sh_entsize;
+  auto rank = [](unsigned char b) {
+    return (b == STB_GLOBAL) ? 2 : (b == STB_WEAK ? 1 : 0);
+  };
+  // 本轮开始前已找到的不再覆盖（DYNSYM 优先于 SYMTAB）
+  std::map<std::string, SymHit> hits;
+  for (size_t i = 0; i < count; ++i) {
+    GElf_Sym sym;
+    if (!gelf_getsym(data, (int)i, &sym))
+      continue;
+    unsigned char st_type = GELF_ST_TYPE(sym.st_info);
+    if (st_type != STT_FUNC && st_type != STT_GNU_IFUNC)
+      continue;
+    if (sym.st_shndx == SHN_UNDEF)
+      continue;
+    const char *nm = elf_strptr(e, shdr.sh_link, sym.st_name);
+    if (!nm)
+      continue;
+    // 去掉 @版本 后查表
+    const char *at = std::strchr(nm, '@');
+    auto it = found.find(at ? std::string(nm, at - nm) : std::string(nm));
+    if (it == found.end() || it->second.bind != 0xff)
+      continue;
+
+    unsigned char bind = GELF_ST_BIND(sym.st_info);
+    auto [h, fresh] = hits.try_emplace(it->first);
+    if (fresh || rank(bind) > rank(h->second.bind) ||
+        (rank(bind) == rank(h->second.bind) &&
+         (uint64_t)sym.st_value < h->second.value))
+      h->second = {(uint64_t)sym.st_value, bind};
+  }
+  for (auto &[name, hit] : hits)
+    found[name] = hit;
+}
+
 } // namespace elfutil
 
 // ---------- 对外 API ----------
@@ -218,3 +289,321 @@ inline std::optional<size_t> find_func_offset_in_elf(const std::string &path,
     return std::nullopt;
   }
 }
+
+// 同上，但一次打开 ELF、每个符号表只遍历一遍就解析出所有名字，
+// 用于一次挂一批探针；没找到的名字不在返回值里
+inline std::map<std::string, size_t>
+find_func_offsets_in_elf(const std::string &path,
+                         const std::vector<std::string> &symnames) {
+  std::map<std::string, size_t> out;
+  try {
+    elfutil::ElfHandle h;
+    if (elf_version(EV_CURRENT) == EV_NONE)
+      throw std::runtime_error("elf_version failed");
+    h.fd = ::open(path.c_str(), O_RDONLY);
+    if (h.fd < 0)
+      throw std::runtime_error("open ELF failed: " + path);
+    h.e = elf_begin(h.fd, ELF_C_READ, nullptr);
+    if (!h.e)
+      throw std::runtime_error("elf_begin failed");
+    auto eh = elfutil::get_ehdr(h.e);
+
+    std::map<std::string, elfutil::SymHit> found;
+    for (const auto &n : symnames)
+      found[n];
+    // 先 DYNSYM，再 SYMTAB
+    for (unsigned type : {SHT_DYNSYM, SHT_SYMTAB}) {
+      Elf_Scn *scn = nullptr;
+      while ((scn = elf_nextscn(h.e, scn)) != nullptr) {
+        GElf_Shdr shdr;
+        if (gelf_getshdr(scn, &shdr) && shdr.sh_type == type)
+          elfutil::scan_symtab_many(h.e, scn, found);
+      }
+    }
+
+    uint64_t bias = eh.e_type == ET_EXEC ? elfutil::calc_load_bias(h.e) : 0;
+    for (auto &[name, hit] : found) {
+      if (hit.bind == 0xff || hit.value < bias)
+        continue;
+      out[name] = static_cast<size_t>(hit.value - bias);
+    }
+  } catch (...) {
+  }
+  return out;
+}
+
+// ---------- 地址 -> 符号 ----------
+
+namespace elfutil {
+
+struct Sym {
+  uint64_t addr;
+  uint64_t size;
+  std::string name;
+};
+
+// 一个 ELF 文件的函数或数据符号（按地址排序）和 PT_LOAD 段，建一次之后
+// 每次查找都是二分
+class SymIndex {
+public:
+  explicit SymIndex(const std::string &path, unsigned kinds = kFuncSym) {
+    ElfHandle h;
+    if (elf_version(EV_CURRENT) == EV_NONE)
+      return;
+    h.fd = ::open(path.c_str(), O_RDONLY);
+    if (h.fd < 0)
+      return;
+    h.e = elf_begin(h.fd, ELF_C_READ, nullptr);
+    if (!h.e)
+      return;
+
+    size_t nph = 0;
+    if (elf_getphdrnum(h.e, &nph) == 0) {
+      for (size_t i = 0; i < nph; ++i) {
+        GElf_Phdr phdr;
+        if (gelf_getphdr(h.e, i, &phdr) && phdr.p_type == PT_LOAD)
+          loads_.push_back(
+              {phdr.p_offset, phdr.p_vaddr, phdr.p_filesz, phdr.p_memsz});
+      }
+    }
+
+    // SYMTAB 和 DYNSYM 都收，同一地址重复的只留一个
+    Elf_Scn *scn = nullptr;
+    while ((scn = elf_nextscn(h.e, scn)) != nullptr) {
+      GElf_Shdr shdr;
+      if (!gelf_getshdr(scn, &shdr) || !shdr.sh_entsize ||
+          (shdr.sh_type != SHT_SYMTAB && shdr.sh_type != SHT_DYNSYM))
+        continue;
+      Elf_Data *data = elf_getdata(scn, nullptr);
+      if (!data)
+        continue;
+      size_t count = shdr.sh_size / shdr.sh_entsize;
+      for (size_t i = 0; i < count; ++i) {
+        GElf_Sym sym;
+        if (!gelf_getsym(data, (int)i, &sym))
+          continue;
+        unsigned char st_type = GELF_ST_TYPE(sym.st_info);
+        if (!kind_matches(st_type, kinds) || sym.st_shndx == SHN_UNDEF ||
+            !sym.st_value)
+          continue;
+        // 大小为 0 的数据符号多是 __bss_start/_edata 这类边界标记
+        if (st_type == STT_OBJECT && !sym.st_size)
+          continue;
+        const char *nm = elf_strptr(h.e, shdr.sh_link, sym.st_name);
+        if (!nm || !*nm)
+          continue;
+        std::string name(nm);
+        auto at = name.find('@');
+        if (at != std::string::npos)
+          name.resize(at);
+        syms_.push_back({sym.st_value, sym.st_size, std::move(name)});
+      }
+    }
+    std::sort(syms_.begin(), syms_.end(), [](const Sym &a, const Sym &b) {
+      return a.addr < b.addr;
+    });
+    syms_.erase(std::unique(syms_.begin(), syms_.end(),
+                            [](const Sym &a, const Sym &b) {
+                              return a.addr == b.addr;
+                            }),
+                syms_.end());
+  }
+
+  // 文件偏移 -> 链接时虚拟地址
+  std::optional<uint64_t> off_to_vaddr(uint64_t off) const {
+    for (const auto &l : loads_)
+      if (off >= l.offset && off < l.offset + l.filesz)
+        return off - l.offset + l.vaddr;
+    return std::nullopt;
+  }
+
+  // 文件偏移 0 映射到的链接地址（PIE/共享库为 0），用来把 .bss 这种
+  // 没有文件内容的地址换算成链接地址：vaddr = addr - 偏移 0 映射的起点 + 它
+  uint64_t link_base() const {
+    if (loads_.empty())
+      return 0;
+    return (loads_[0].vaddr - loads_[0].offset) & ~0xfffull;
+  }
+
+  // vaddr 是否落在某个 PT_LOAD 的内存范围里（含 .bss）
+  bool in_load(uint64_t vaddr) const {
+    for (const auto &l : loads_)
+      if (vaddr >= l.vaddr && vaddr < l.vaddr + l.memsz)
+        return true;
+    return false;
+  }
+
+  // 包含 vaddr 的符号；大小为 0 的符号（汇编函数）只要在下一个符号之前就算
+  const Sym *find(uint64_t vaddr) const {
+    auto it = std::upper_bound(
+        syms_.begin(), syms_.end(), vaddr,
+        [](uint64_t v, const Sym &s) { return v < s.addr; });
+    if (it == syms_.begin())
+      return nullptr;
+    --it;
+    if (it->size && vaddr >= it->addr + it->size)
+      return nullptr;
+    return &*it;
+  }
+
+private:
+  struct Load {
+    uint64_t offset, vaddr, filesz, memsz;
+  };
+  std::vector<Load> loads_;
+  std::vector<Sym> syms_;
+};
+
+} // namespace elfutil
+
+// 进程里的地址 -> "func+0x1c (libfoo.so.1)"，数据地址 -> "var+0x8 (foo)"。
+// 文件经 /proc/<pid>/root 打开，容器里的进程也能解析；符号索引按文件的
+// (dev, ino) 缓存，不同容器里同一路径的不同文件不会混用。进程的 maps 缓存到
+// exec（forget）为止，地址落空且快照超过 1 秒时重读，补上后来 dlopen 的库
+class Symbolizer {
+public:
+  std::string symbolize(pid_t pid, uint64_t addr) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)addr);
+    const Mapping *m = mapping(pid, addr, true);
+    if (!m)
+      return buf;
+    std::string base = m->path.substr(m->path.rfind('/') + 1);
+    auto &idx = files_[m->file];
+    if (!idx)
+      idx = std::make_unique<elfutil::SymIndex>(m->root_path);
+    auto vaddr = idx->off_to_vaddr(addr - m->start + m->offset);
+    const elfutil::Sym *sym = vaddr ? idx->find(*vaddr) : nullptr;
+    if (!sym)
+      return std::string(buf) + " (" + base + ")";
+    snprintf(buf, sizeof(buf), "+0x%llx",
+             (unsigned long long)(*vaddr - sym->addr));
+    return demangle(sym->name) + buf + " (" + base + ")";
+  }
+
+  // 全局/静态变量（.data/.bss）里的地址，不是则返回空串（比如堆、栈上的）。
+  // .bss 超出文件页的部分是紧跟在文件映射后的匿名映射，也算这个文件的
+  std::string symbolize_data(pid_t pid, uint64_t addr) {
+    const Mapping *m = mapping(pid, addr, false);
+    if (!m)
+      return "";
+    // 同一文件偏移 0 的映射是加载基址
+    const Mapping *first = nullptr;
+    for (const auto &x : maps_[pid].maps)
+      if (x.file == m->file && x.offset == 0 && x.start <= addr &&
+          (!first || x.start > first->start))
+        first = &x;
+    if (!first)
+      return "";
+    auto &idx = data_files_[m->file];
+    if (!idx)
+      idx = std::make_unique<elfutil::SymIndex>(m->root_path,
+                                                elfutil::kObjectSym);
+    uint64_t vaddr = addr - first->start + idx->link_base();
+    const elfutil::Sym *sym = idx->in_load(vaddr) ? idx->find(vaddr) : nullptr;
+    if (!sym)
+      return "";
+    std::string name = demangle(sym->name);
+    if (vaddr != sym->addr) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "+0x%llx",
+               (unsigned long long)(vaddr - sym->addr));
+      name += buf;
+    }
+    return name + " (" + m->path.substr(m->path.rfind('/') + 1) + ")";
+  }
+
+  // 进程 exec 后调用（pid 复用的新进程也要经过 exec），下次重新读 maps
+  void forget(pid_t pid) { maps_.erase(pid); }
+
+private:
+  using FileKey = std::pair<dev_t, ino_t>;
+
+  struct Mapping {
+    uint64_t start, end, offset;
+    std::string path;      // 进程自己看到的路径，用于输出
+    std::string root_path; // /proc/<pid>/root + path，用于打开
+    FileKey file;
+    bool exec;
+  };
+
+  struct Snapshot {
+    std::chrono::steady_clock::time_point read_at;
+    std::vector<Mapping> maps;
+  };
+
+  static void read_maps(pid_t pid, Snapshot *snap) {
+    snap->read_at = std::chrono::steady_clock::now();
+    snap->maps.clear();
+    std::string root = "/proc/" + std::to_string(pid) + "/root";
+    std::ifstream in("/proc/" + std::to_string(pid) + "/maps");
+    std::string line;
+    std::map<std::string, FileKey> seen; // 同一文件有多个段，只 stat 一次
+    while (std::getline(in, line)) {
+      unsigned long long start, end, off;
+      char perms[8];
+      int path_pos = 0;
+      if (sscanf(line.c_str(), "%llx-%llx %7s %llx %*s %*s %n", &start, &end,
+                 perms, &off, &path_pos) < 4 ||
+          !path_pos)
+        continue;
+      auto &v = snap->maps;
+      if (line[path_pos] == '/') {
+        std::string path = line.substr(path_pos);
+        auto it = seen.find(path);
+        if (it == seen.end()) {
+          struct stat st;
+          if (stat((root + path).c_str(), &st))
+            continue;
+          it = seen.emplace(path, FileKey{st.st_dev, st.st_ino}).first;
+        }
+        v.push_back({start, end, off, path, root + path, it->second,
+                     strchr(perms, 'x') != nullptr});
+      } else if (!line[path_pos] && !v.empty() && v.back().end == start &&
+                 !v.back().exec) {
+        // 紧跟在文件数据段后的匿名映射：.bss 的剩余部分
+        Mapping bss = v.back();
+        bss.offset += start - bss.start;
+        bss.start = start;
+        bss.end = end;
+        v.push_back(std::move(bss));
+      }
+    }
+  }
+
+  // exec：只找可执行段（代码地址），否则找任意文件映射（数据地址）
+  const Mapping *mapping(pid_t pid, uint64_t addr, bool exec) {
+    auto [it, fresh] = maps_.try_emplace(pid);
+    Snapshot &snap = it->second;
+    if (fresh)
+      read_maps(pid, &snap);
+    for (int pass = 0; pass < 2; pass++) {
+      for (const auto &m : snap.maps)
+        if (addr >= m.start && addr < m.end && (m.exec || !exec))
+          return &m;
+      // 堆/栈上的数据地址本来就不在文件映射里，限制重读频率
+      if (pass || std::chrono::steady_clock::now() - snap.read_at <
+                      std::chrono::seconds(1))
+        break;
+      read_maps(pid, &snap);
+    }
+    return nullptr;
+  }
+
+  // 只处理 _Z 开头的名字：C 符号 "g"、"f" 也能被当成内置类型编码解出来
+  static std::string demangle(const std::string &name) {
+    if (name.compare(0, 2, "_Z") != 0)
+      return name;
+    int status = 0;
+    char *d = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+    if (!d)
+      return name;
+    std::string out(d);
+    free(d);
+    return out;
+  }
+
+  std::map<pid_t, Snapshot> maps_;
+  std::map<FileKey, std::unique_ptr<elfutil::SymIndex>> files_;
+  std::map<FileKey, std::unique_ptr<elfutil::SymIndex>> data_files_;
+};
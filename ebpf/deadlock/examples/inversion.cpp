@@ -0,0 +1,36 @@
+// inversion.cpp
+// 两个线程先后以相反顺序加锁，时间上错开，永远不会真的死锁；
+// deadlock_user -L 仍能从锁顺序图里发现 A -> B -> A
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+std::mutex A;
+std::mutex B;
+
+void t1() {
+  pthread_setname_np(pthread_self(), "thread1");
+  std::lock_guard<std::mutex> a(A);
+  std::lock_guard<std::mutex> b(B);
+  std::cout << "t1 acquired A->B\n";
+}
+
+void t2() {
+  pthread_setname_np(pthread_self(), "thread2");
+  std::lock_guard<std::mutex> b(B);
+  std::lock_guard<std::mutex> a(A);
+  std::cout << "t2 acquired B->A\n";
+}
+
+int main() {
+  std::this_thread::sleep_for(15s); // 等待 ebpf 程序附加
+  std::thread x(t1);
+  x.join();
+  std::thread y(t2);
+  y.join();
+  return 0;
+}
@@ -0,0 +1,91 @@
+// lockbench.cpp
+// pthread mutex 加解锁吞吐，用来对比挂上 deadlock_user 前后的开销：
+//   ./lockbench [-t threads] [-d seconds] [-w wait_seconds] [-c]
+// 默认每个线程锁自己的 mutex（全部走无竞争快路径，常见的服务端场景）；
+// -c 让所有线程抢同一把锁（大量进入 __lll_lock_wait）。
+// -w 先等若干秒再开始，留时间执行 sudo ./deadlock_user -p <pid> [-s]
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+struct alignas(64) Slot {
+  std::mutex m;
+  unsigned long long ops = 0;
+  unsigned long long counter = 0; // 临界区里改一下，防止被优化掉
+};
+
+static std::atomic<bool> running{true};
+
+static void worker(std::mutex *m, Slot *slot) {
+  unsigned long long n = 0;
+  while (running.load(std::memory_order_relaxed)) {
+    for (int i = 0; i < 1024; i++) {
+      m->lock();
+      slot->counter++;
+      m->unlock();
+    }
+    n += 1024;
+  }
+  slot->ops = n;
+}
+
+int main(int argc, char **argv) {
+  int threads = 4, seconds = 5, wait = 0, opt;
+  bool contended = false;
+  while ((opt = getopt(argc, argv, "t:d:w:c")) != -1) {
+    switch (opt) {
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'd':
+      seconds = atoi(optarg);
+      break;
+    case 'w':
+      wait = atoi(optarg);
+      break;
+    case 'c':
+      contended = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t threads] [-d seconds] [-w wait] [-c]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (threads <= 0 || seconds <= 0)
+    return 1;
+
+  printf("pid=%d threads=%d %s\n", getpid(), threads,
+         contended ? "shared mutex" : "per-thread mutex");
+  fflush(stdout);
+  std::this_thread::sleep_for(std::chrono::seconds(wait));
+
+  std::vector<Slot> slots(threads);
+  std::mutex shared;
+  std::vector<std::thread> ts;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < threads; i++)
+    ts.emplace_back(worker, contended ? &shared : &slots[i].m, &slots[i]);
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  running = false;
+  for (auto &t : ts)
+    t.join();
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                              t0)
+                    .count();
+
+  unsigned long long total = 0;
+  for (auto &s : slots)
+    total += s.ops;
+  printf("lock+unlock: %llu ops in %.2fs, %.0f ops/sec (%.0f per thread)\n",
+         total, secs, total / secs, total / secs / threads);
+  return 0;
+}
@@ -0,0 +1,37 @@
+// reenter.cpp
+// 持有递归锁 R 和普通锁 X 时再重入 R：重入不会阻塞，不是 X -> R 的加锁顺序，
+// 和另一个线程的 R -> X 不构成倒序，deadlock_user -L 不应报告
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+std::recursive_mutex R;
+std::mutex X;
+
+void t1() {
+  pthread_setname_np(pthread_self(), "thread1");
+  std::lock_guard<std::recursive_mutex> r(R);
+  std::lock_guard<std::mutex> x(X);
+  std::lock_guard<std::recursive_mutex> again(R); // 重入
+  std::cout << "t1 acquired R->X->R\n";
+}
+
+void t2() {
+  pthread_setname_np(pthread_self(), "thread2");
+  std::lock_guard<std::recursive_mutex> r(R);
+  std::lock_guard<std::mutex> x(X);
+  std::cout << "t2 acquired R->X\n";
+}
+
+int main() {
+  std::this_thread::sleep_for(15s); // 等待 ebpf 程序附加
+  std::thread x(t1);
+  x.join();
+  std::thread y(t2);
+  y.join();
+  return 0;
+}
@@ -0,0 +1,53 @@
+// ring.cpp
+// N 个线程围成一圈：线程 i 先锁 m[i]，再锁 m[(i+1)%N]，形成长度为 N 的等待环。
+// 默认 N=80，超过展开版检测的 7 跳，用来验证 deadlock_user -H：
+//   ./ring [-n threads] [-w wait_seconds]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+int main(int argc, char **argv) {
+  int n = 80, wait = 15, opt;
+  while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+    switch (opt) {
+    case 'n':
+      n = atoi(optarg);
+      break;
+    case 'w':
+      wait = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n threads] [-w wait]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (n < 2)
+    return 1;
+
+  printf("pid=%d ring of %d threads\n", getpid(), n);
+  fflush(stdout);
+  std::this_thread::sleep_for(std::chrono::seconds(wait)); // 等待 ebpf 程序附加
+
+  std::vector<std::mutex> m(n);
+  std::vector<std::thread> ts;
+  for (int i = 0; i < n; i++) {
+    ts.emplace_back([&m, i, n] {
+      char name[16];
+      snprintf(name, sizeof(name), "ring%d", i);
+      pthread_setname_np(pthread_self(), name);
+      std::lock_guard<std::mutex> a(m[i]);
+      std::this_thread::sleep_for(200ms); // 等所有线程都拿到第一把锁
+      std::lock_guard<std::mutex> b(m[(i + 1) % n]);
+    });
+  }
+  for (auto &t : ts)
+    t.join();
+  return 0;
+}
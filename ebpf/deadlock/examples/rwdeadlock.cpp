@@ -0,0 +1,48 @@
+// rwdeadlock.cpp
+// 读写锁参与的死锁：thread1 持有 S 的读锁去拿 M，thread2 持有 M 去拿 S 的写锁。
+// 两个线程在进入死锁前都会递归地重入一把 std::recursive_mutex R，
+// 用来确认重入不会被误报成自死锁
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <shared_mutex>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+std::shared_mutex S;
+std::mutex M;
+std::recursive_mutex R;
+
+void reenter(int depth) {
+  std::lock_guard<std::recursive_mutex> g(R);
+  if (depth > 0)
+    reenter(depth - 1);
+}
+
+void t1() {
+  pthread_setname_np(pthread_self(), "reader");
+  reenter(3);
+  std::shared_lock<std::shared_mutex> s(S);
+  std::this_thread::sleep_for(100ms);
+  std::cout << "reader waiting M\n";
+  std::lock_guard<std::mutex> m(M);
+}
+
+void t2() {
+  pthread_setname_np(pthread_self(), "writer");
+  reenter(3);
+  std::lock_guard<std::mutex> m(M);
+  std::this_thread::sleep_for(100ms);
+  std::cout << "writer waiting S (exclusive)\n";
+  std::unique_lock<std::shared_mutex> s(S);
+}
+
+int main() {
+  std::this_thread::sleep_for(15s); // 等待 ebpf 程序附加
+  std::thread a(t1), b(t2);
+  a.join();
+  b.join();
+  return 0;
+}
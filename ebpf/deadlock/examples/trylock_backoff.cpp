@@ -0,0 +1,51 @@
+// trylock_backoff.cpp
+// std::lock 的“先阻塞加一把、其余 try_lock，失败就全放掉换个顺序重来”
+// 和手写的 try_lock 退让都不会死锁：trylock 拿不到锁时直接返回，不等待。
+// 两个线程分别以 A,B 和 B,A 的顺序反复加锁，deadlock_user -L 不应报倒序
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+std::mutex A;
+std::mutex B;
+
+// libstdc++ 的 std::lock：lock(first) 后 try_lock 其余的
+void t1() {
+  pthread_setname_np(pthread_self(), "thread1");
+  for (int i = 0; i < 100000; i++) {
+    std::lock(A, B);
+    A.unlock();
+    B.unlock();
+  }
+  std::cout << "t1 done std::lock(A, B)\n";
+}
+
+// 手写退让：持有 B 时只 try_lock A，拿不到就放掉 B 重来
+void t2() {
+  pthread_setname_np(pthread_self(), "thread2");
+  for (int i = 0; i < 100000; i++) {
+    for (;;) {
+      std::unique_lock<std::mutex> b(B);
+      if (A.try_lock()) {
+        A.unlock();
+        break;
+      }
+      b.unlock();
+      std::this_thread::yield();
+    }
+  }
+  std::cout << "t2 done B, try A\n";
+}
+
+int main() {
+  std::this_thread::sleep_for(15s); // 等待 ebpf 程序附加
+  std::thread x(t1);
+  std::thread y(t2);
+  x.join();
+  y.join();
+  return 0;
+}
@@ -0,0 +1,142 @@
+// lockorder.hpp
+// 用户态 lockdep：全局锁顺序图，节点是 (tgid, 锁地址)，边 a -> b 表示
+// 某线程持有 a 时加了 b。图里一旦出现环，就存在可能死锁的加锁顺序，
+// 不需要真的撞上。
+// 边是逐条到来的，用 Pearce-Kelly 在线拓扑序维护：每个节点有一个序号 ord，
+// 所有边都满足 ord[a] < ord[b]；新边 x -> y 违反时只在 [ord[y], ord[x]]
+// 区间内搜索和重排，能从 y 走回 x 就说明成环。成环的边不加入图（图始终是 DAG），
+// 单独记下来报告。
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace lockorder {
+
+struct EdgeInfo {
+  uint32_t tid = 0; // 第一次按此顺序加锁的线程
+  int32_t stack_id = -1;
+  std::string comm;
+};
+
+struct Lock {
+  uint32_t tgid;
+  uint64_t addr;
+};
+
+class Graph {
+public:
+  // 加入边 from -> to（同一进程）。已存在（包括之前成环被拒绝过）返回 false；
+  // 成环时返回 true 并在 cycle 里给出 to -> ... -> from 的锁序列（不含闭合边）。
+  // BPF 侧的 order_seen 是 LRU，淘汰后同一条边会再来，靠这里只报一次
+  bool add_edge(uint32_t tgid, uint64_t from, uint64_t to, EdgeInfo info,
+                std::vector<int> *cycle) {
+    int x = node(tgid, from), y = node(tgid, to);
+    cycle->clear();
+    if (x == y || edges_.count({x, y}) || inverted_.count({x, y}))
+      return false;
+    if (ord_[y] < ord_[x] && !reorder(x, y, cycle)) {
+      inverted_.emplace(std::make_pair(x, y), std::move(info));
+      return true;
+    }
+    edges_.emplace(std::make_pair(x, y), std::move(info));
+    out_[x].push_back(y);
+    in_[y].push_back(x);
+    return false;
+  }
+
+  const Lock &lock(int n) const { return locks_[n]; }
+  // 图内的边或成环被拒绝的边
+  const EdgeInfo *edge(int a, int b) const {
+    auto it = edges_.find({a, b});
+    if (it != edges_.end())
+      return &it->second;
+    it = inverted_.find({a, b});
+    return it != inverted_.end() ? &it->second : nullptr;
+  }
+  size_t nodes() const { return locks_.size(); }
+  size_t edges() const { return edges_.size(); }
+
+private:
+  int node(uint32_t tgid, uint64_t addr) {
+    auto [it, fresh] = ids_.try_emplace({tgid, addr}, (int)locks_.size());
+    if (fresh) {
+      locks_.push_back({tgid, addr});
+      ord_.push_back((int)ord_.size()); // 新节点排在最后
+      out_.emplace_back();
+      in_.emplace_back();
+    }
+    return it->second;
+  }
+
+  // ord[y] < ord[x]：前向从 y 出发只走 ord < ord[x] 的节点，碰到 x 即成环；
+  // 否则后向从 x 出发只走 ord > ord[y] 的节点，再把两组节点按原相对顺序
+  // 重新分配它们占用的序号：后向组整体排在前向组之前
+  bool reorder(int x, int y, std::vector<int> *cycle) {
+    int lb = ord_[y], ub = ord_[x];
+    std::vector<int> fwd, bwd;
+    std::map<int, int> parent;
+    std::vector<int> stack{y};
+    parent[y] = -1;
+    while (!stack.empty()) {
+      int n = stack.back();
+      stack.pop_back();
+      fwd.push_back(n);
+      for (int w : out_[n]) {
+        if (w == x) {
+          // y -> ... -> n -> x，加上新边 x -> y 闭合
+          std::vector<int> path{x};
+          for (int p = n; p != -1; p = parent[p])
+            path.push_back(p);
+          cycle->assign(path.rbegin(), path.rend());
+          return false;
+        }
+        if (ord_[w] < ub && !parent.count(w)) {
+          parent[w] = n;
+          stack.push_back(w);
+        }
+      }
+    }
+    std::map<int, bool> seen{{x, true}};
+    stack.push_back(x);
+    while (!stack.empty()) {
+      int n = stack.back();
+      stack.pop_back();
+      bwd.push_back(n);
+      for (int w : in_[n]) {
+        if (ord_[w] > lb && !seen.count(w)) {
+          seen[w] = true;
+          stack.push_back(w);
+        }
+      }
+    }
+
+    auto by_ord = [this](int a, int b) { return ord_[a] < ord_[b]; };
+    std::sort(fwd.begin(), fwd.end(), by_ord);
+    std::sort(bwd.begin(), bwd.end(), by_ord);
+    std::vector<int> slots;
+    for (int n : bwd)
+      slots.push_back(ord_[n]);
+    for (int n : fwd)
+      slots.push_back(ord_[n]);
+    std::sort(slots.begin(), slots.end());
+    size_t i = 0;
+    for (int n : bwd)
+      ord_[n] = slots[i++];
+    for (int n : fwd)
+      ord_[n] = slots[i++];
+    return true;
+  }
+
+  std::map<std::pair<uint32_t, uint64_t>, int> ids_;
+  std::vector<Lock> locks_;
+  std::vector<int> ord_;
+  std::vector<std::vector<int>> out_, in_;
+  std::map<std::pair<int, int>, EdgeInfo> edges_;
+  std::map<std::pair<int, int>, EdgeInfo> inverted_;
+};
+
+} // namespace lockorder
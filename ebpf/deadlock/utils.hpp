@@ -1,38 +1,75 @@
-// find_lib_for_pid.hpp
+// utils.hpp
 #pragma once
 #include <optional>
 #include <fstream>
 #include <string>
 #include <climits>
+#include <cstdlib>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-inline std::optional<std::string>
-find_lib_for_pid(int pid, const std::string& needle) {
-  std::ifstream in("/proc/" + std::to_string(pid) + "/maps");
-  if (!in) return std::nullopt;
-
-  std::string line;
-  while (std::getline(in, line)) {
-    // 形如: 7f2b7e0f1000-7f2b7e2f1000 r-xp 00000000 08:01 123456 /usr/lib/x86_64-linux-gnu/libpthread.so.0
-    auto first_sp = line.find(' ');
-    if (first_sp == std::string::npos) continue;
-    auto second_sp = line.find(' ', first_sp + 1);
-    if (second_sp == std::string::npos) continue;
+// 进程里 pthread 函数可能所在的库，按优先级：glibc 2.34 前是 libpthread
+// （libc 里只有转发桩，两个都挂会重复计数），之后并入 libc，libpthread.so.0
+// 只剩一个空壳，要由调用方看符号表决定用哪个。
+// path 经 /proc/<pid>/root 拼出，容器（其他 mount namespace）里的库也能从
+// 这里打开；dev/ino 标识文件本身，不同进程、不同路径映射的同一个库只挂一次
+struct LibRef {
+  std::string path;
+  dev_t dev = 0;
+  ino_t ino = 0;
+};
 
-    std::string perms = line.substr(first_sp + 1, second_sp - first_sp - 1);
-    if (perms.find('x') == std::string::npos) continue;     // 只要可执行映射
-
-    auto slash = line.find('/', second_sp + 1);
-    if (slash == std::string::npos) continue;               // 无路径（如 [vdso]）跳过
+inline bool is_lib(const std::string &path, const std::string &stem) {
+  auto base = path.substr(path.rfind('/') + 1);
+  // libc.so.6 / libc-2.31.so，不能让 libcrypto、libcap 之类混进来
+  return base.compare(0, stem.size() + 3, stem + ".so") == 0 ||
+         base.compare(0, stem.size() + 1, stem + "-") == 0;
+}
 
+inline std::vector<LibRef> pthread_lib_candidates(int pid) {
+  std::vector<LibRef> out;
+  std::ifstream in("/proc/" + std::to_string(pid) + "/maps");
+  if (!in)
+    return out;
+  std::string line, found[2]; // libpthread, libc
+  while (std::getline(in, line)) {
+    auto slash = line.find('/');
+    if (slash == std::string::npos ||
+        line.find("(deleted)") != std::string::npos)
+      continue;
     std::string path = line.substr(slash);
-    if (path.find("(deleted)") != std::string::npos) continue;
-    if (path.find(needle) == std::string::npos) continue;
+    if (found[0].empty() && is_lib(path, "libpthread"))
+      found[0] = path;
+    else if (found[1].empty() && is_lib(path, "libc"))
+      found[1] = path;
+  }
+  for (const auto &path : found) {
+    if (path.empty())
+      continue;
+    LibRef ref;
+    ref.path = "/proc/" + std::to_string(pid) + "/root" + path;
+    struct stat st;
+    if (stat(ref.path.c_str(), &st))
+      continue; // 进程已退出
+    ref.dev = st.st_dev;
+    ref.ino = st.st_ino;
+    out.push_back(ref);
+  }
+  return out;
+}
 
-    // 规范化真实路径
-    char buf[PATH_MAX];
-    if (realpath(path.c_str(), buf)) return std::string(buf);
-    return path; // realpath 失败也先返回 maps 里的原样路径
+inline std::vector<int> list_pids() {
+  std::vector<int> pids;
+  DIR *d = opendir("/proc");
+  if (!d)
+    return pids;
+  while (struct dirent *de = readdir(d)) {
+    int pid = atoi(de->d_name);
+    if (pid > 0)
+      pids.push_back(pid);
   }
-  return std::nullopt;
+  closedir(d);
+  return pids;
 }
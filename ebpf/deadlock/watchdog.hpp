@@ -0,0 +1,206 @@
+// watchdog.hpp
+// 零插桩的死锁看门狗：不挂任何探针，定期扫描目标进程的线程，
+// 只对“卡在 futex 等待里超过 N 秒”的线程建等待图：
+//   - /proc/<pid>/task/<tid>/syscall 给出当前系统调用号和参数
+//     （futex 的 uaddr/op/val），线程在跑时为 "running"
+//   - /proc/<pid>/task/<tid>/schedstat 第三列是被调度上 CPU 的次数，
+//     两次扫描之间不变且仍在同一个 futex 上，说明这段时间一直没醒过
+//   - lll_lock 竞争时以 FUTEX_WAIT(val=2) 睡在 &mutex->__data.__lock 上，
+//     持有者 TID 在 mutex+8（__owner），用 process_vm_readv 读
+// 每个卡住的线程至多一条出边（等的那把锁 -> 持有者），沿出边走即可找环
+#pragma once
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace watchdog {
+
+constexpr long kFutexWait = 0;
+constexpr long kFutexWaitBitset = 9;
+constexpr long kFutexCmdMask = 0x7f;
+constexpr long kLllLockContended = 2;
+constexpr uint64_t kMutexOwnerOff = 8; // glibc x86_64 pthread_mutex_t.__data.__owner
+
+struct Edge {
+  uint32_t tid;   // 持有者
+  uint64_t mutex; // 等待的锁
+};
+
+// 一个环：root 等 chain[0].mutex，其持有者 chain[0].tid 等 chain[1].mutex ...
+// 最后一个持有者回到 root，与 BPF 上报的 event_t 同构
+struct Cycle {
+  uint32_t root;
+  std::string comm;
+  std::vector<Edge> chain;
+};
+
+struct Waiter {
+  uint64_t uaddr = 0;
+  bool lock = false;       // val == 2：在等 lll 锁，而不是条件变量等
+  uint64_t switches = 0;   // schedstat 第三列
+  std::chrono::steady_clock::time_point since;
+};
+
+inline bool read_line(const std::string &path, std::string &out) {
+  std::ifstream in(path);
+  return in && std::getline(in, out);
+}
+
+// 当前系统调用是 futex 等待时返回 true，并给出 uaddr 和是否为锁等待
+inline bool futex_wait_of(pid_t pid, pid_t tid, uint64_t *uaddr, bool *lock) {
+  std::string line;
+  if (!read_line("/proc/" + std::to_string(pid) + "/task/" +
+                     std::to_string(tid) + "/syscall",
+                 line))
+    return false;
+  unsigned long long nr, a0, a1, a2;
+  if (sscanf(line.c_str(), "%llu 0x%llx 0x%llx 0x%llx", &nr, &a0, &a1, &a2) !=
+      4)
+    return false; // "running" 或被信号打断等
+  if (nr != SYS_futex)
+    return false;
+  long op = (long)a1 & kFutexCmdMask;
+  if (op != kFutexWait && op != kFutexWaitBitset)
+    return false;
+  *uaddr = a0;
+  *lock = (long)(int)a2 == kLllLockContended;
+  return true;
+}
+
+inline uint64_t sched_switches(pid_t pid, pid_t tid) {
+  std::string line;
+  unsigned long long run, wait, slices;
+  if (!read_line("/proc/" + std::to_string(pid) + "/task/" +
+                     std::to_string(tid) + "/schedstat",
+                 line) ||
+      sscanf(line.c_str(), "%llu %llu %llu", &run, &wait, &slices) != 3)
+    return UINT64_MAX;
+  return slices;
+}
+
+inline std::string thread_comm(pid_t pid, pid_t tid) {
+  std::string comm;
+  if (!read_line("/proc/" + std::to_string(pid) + "/task/" +
+                     std::to_string(tid) + "/comm",
+                 comm))
+    comm = "?";
+  return comm;
+}
+
+inline bool read_owner(pid_t pid, uint64_t mutex, uint32_t *owner) {
+  int32_t tid = 0;
+  struct iovec local = {&tid, sizeof(tid)};
+  struct iovec remote = {(void *)(mutex + kMutexOwnerOff), sizeof(tid)};
+  if (process_vm_readv(pid, &local, 1, &remote, 1, 0) != sizeof(tid))
+    return false;
+  if (tid <= 0)
+    return false;
+  *owner = (uint32_t)tid;
+  return true;
+}
+
+class Watchdog {
+public:
+  Watchdog(pid_t pid, double stuck_secs) : pid_(pid), stuck_(stuck_secs) {}
+
+  // 扫描一轮，返回新出现的环；同一个环持续存在时只报告一次
+  std::vector<Cycle> scan() {
+    auto now = std::chrono::steady_clock::now();
+    std::map<uint32_t, Waiter> cur;
+    std::string dir = "/proc/" + std::to_string(pid_) + "/task";
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+      return {};
+    while (struct dirent *de = readdir(d)) {
+      pid_t tid = atoi(de->d_name);
+      if (tid <= 0)
+        continue;
+      Waiter w;
+      if (!futex_wait_of(pid_, tid, &w.uaddr, &w.lock))
+        continue;
+      w.switches = sched_switches(pid_, tid);
+      w.since = now;
+      auto it = waiters_.find(tid);
+      if (it != waiters_.end() && it->second.uaddr == w.uaddr &&
+          it->second.switches == w.switches)
+        w.since = it->second.since; // 上次扫描以来一直没被调度过
+      cur[tid] = w;
+    }
+    closedir(d);
+    waiters_.swap(cur);
+
+    // 只有卡住足够久的锁等待进图：tid -> 等的锁
+    std::map<uint32_t, uint64_t> stuck;
+    for (auto &[tid, w] : waiters_) {
+      double secs = std::chrono::duration<double>(now - w.since).count();
+      if (w.lock && secs >= stuck_)
+        stuck[tid] = w.uaddr;
+    }
+
+    std::vector<Cycle> found;
+    std::set<std::vector<uint32_t>> alive;
+    std::set<uint32_t> done;
+    for (auto &[start, m0] : stuck) {
+      if (done.count(start))
+        continue;
+      // 沿出边走，记录路径上每个线程第一次出现的位置
+      std::vector<uint32_t> path;
+      std::map<uint32_t, size_t> pos;
+      uint32_t t = start;
+      while (!done.count(t) && !pos.count(t)) {
+        auto it = stuck.find(t);
+        if (it == stuck.end())
+          break;
+        pos[t] = path.size();
+        path.push_back(t);
+        uint32_t owner;
+        if (!read_owner(pid_, it->second, &owner))
+          break;
+        t = owner;
+      }
+      for (uint32_t x : path)
+        done.insert(x);
+      if (!pos.count(t))
+        continue; // 走到了没卡住的线程或已处理过的部分，没有新环
+      // path[pos[t]..] 构成环，从 tid 最小的线程开始，便于去重
+      std::vector<uint32_t> ring(path.begin() + pos[t], path.end());
+      std::rotate(ring.begin(), std::min_element(ring.begin(), ring.end()),
+                  ring.end());
+      std::vector<uint32_t> key(ring);
+      std::sort(key.begin(), key.end());
+      alive.insert(key);
+      if (reported_.count(key))
+        continue;
+
+      Cycle c;
+      c.root = ring[0];
+      c.comm = thread_comm(pid_, ring[0]);
+      for (size_t i = 0; i < ring.size(); i++)
+        c.chain.push_back({ring[(i + 1) % ring.size()], stuck[ring[i]]});
+      found.push_back(std::move(c));
+    }
+    reported_.swap(alive); // 已解开的环下次重新出现时再报
+    return found;
+  }
+
+  size_t waiting() const { return waiters_.size(); }
+
+private:
+  pid_t pid_;
+  double stuck_;
+  std::map<uint32_t, Waiter> waiters_;
+  std::set<std::vector<uint32_t>> reported_;
+};
+
+} // namespace watchdog
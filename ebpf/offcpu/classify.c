@@ -0,0 +1,450 @@
+// classify.c
+#define _GNU_SOURCE
+#include "classify.h"
+#include "offcpu.h"
+#include "stack_cache.h"
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct rule {
+  int cat;
+  char *pattern;
+};
+
+struct classify_rules {
+  char **names; // 下标即类别
+  int nr_names;
+  struct rule *rules;
+  int nr_rules;
+};
+
+// 内置表：顺序即优先级。比如 folio_wait_bit 下面还会有 io_schedule，
+// 页缓存等待要先于通用 io 命中；futex/epoll 等具体原因要先于 schedule_timeout
+static const struct {
+  const char *cat;
+  const char *pattern;
+} builtin_rules[] = {
+    {"futex", "futex_wait_queue*"},
+    {"futex", "futex_wait*"},
+    {"futex", "futex_lock_pi*"},
+    {"epoll", "ep_poll"},
+    {"epoll", "do_epoll_wait"},
+    {"poll/select", "do_sys_poll"},
+    {"poll/select", "do_poll"},
+    {"poll/select", "do_select"},
+    {"poll/select", "core_sys_select"},
+    {"io_uring", "io_cqring_wait*"},
+    {"sleep", "do_nanosleep"},
+    {"sleep", "hrtimer_nanosleep"},
+    {"sleep", "common_nsleep*"},
+    {"signal", "do_sigtimedwait"},
+    {"signal", "sigsuspend"},
+    {"signal", "__*sys_pause"},
+    {"wait-child", "do_wait"},
+    {"wait-child", "kernel_wait4"},
+    {"pagecache", "folio_wait_bit*"},
+    {"pagecache", "__folio_lock*"},
+    {"pagecache", "folio_wait_writeback"},
+    {"pagecache", "wait_on_page_bit*"},
+    {"pagecache", "__lock_page*"},
+    {"pagecache", "wait_on_page_writeback"},
+    {"journal", "jbd2_log_wait_commit"},
+    {"journal", "jbd2_journal_*"},
+    {"journal", "wait_transaction_locked"},
+    {"io", "io_schedule*"},
+    {"io", "blk_mq_get_tag"},
+    {"io", "submit_bio_wait"},
+    {"io", "__wait_on_buffer"},
+    {"io", "bit_wait_io"},
+    {"pipe", "pipe_read"},
+    {"pipe", "pipe_write"},
+    {"pipe", "pipe_wait*"},
+    {"net", "sk_wait_data"},
+    {"net", "sk_stream_wait_memory"},
+    {"net", "sk_stream_wait_connect"},
+    {"net", "inet_csk_accept"},
+    {"net", "inet_wait_for_connect"},
+    {"net", "__skb_wait_for_more_packets"},
+    {"net", "__skb_recv_datagram"},
+    {"net", "unix_stream_data_wait"},
+    {"net", "unix_wait_for_peer"},
+    {"net", "tcp_recvmsg*"},
+    {"net", "__lock_sock"},
+    {"tty", "n_tty_read"},
+    {"rwsem", "rwsem_down_*"},
+    {"mutex", "__mutex_lock*"},
+    {"mutex", "mutex_lock*"},
+    {"semaphore", "__down*"},
+    {"completion", "wait_for_completion*"},
+    {"rcu", "synchronize_rcu*"},
+    {"rcu", "__wait_rcu_gp"},
+    {"reclaim", "throttle_direct_reclaim"},
+    {"reclaim", "mem_cgroup_handle_over_high"},
+    {"reclaim", "balance_dirty_pages*"},
+    {"kthread-idle", "worker_thread"},
+    {"kthread-idle", "kthread_worker_fn"},
+    {"kthread-idle", "smpboot_thread_fn"},
+    {"kthread-idle", "rcu_gp_kthread"},
+    {"kthread-idle", "kswapd"},
+    {"preempt", "preempt_schedule*"},
+    {"preempt", "exit_to_user_mode_loop"},
+    {"preempt", "irqentry_exit_to_user_mode"},
+    {"preempt", "__cond_resched"},
+    {"preempt", "do_sched_yield"},
+};
+
+static int category_of(struct classify_rules *r, const char *name) {
+  for (int i = 0; i < r->nr_names; i++)
+    if (!strcmp(r->names[i], name))
+      return i;
+  char **tmp = realloc(r->names, (r->nr_names + 1) * sizeof(*tmp));
+  if (!tmp)
+    return -ENOMEM;
+  r->names = tmp;
+  if (!(r->names[r->nr_names] = strdup(name)))
+    return -ENOMEM;
+  return r->nr_names++;
+}
+
+static int add_rule(struct classify_rules *r, const char *cat,
+                    const char *pattern) {
+  int c = category_of(r, cat);
+  if (c < 0)
+    return c;
+  struct rule *tmp = realloc(r->rules, (r->nr_rules + 1) * sizeof(*tmp));
+  if (!tmp)
+    return -ENOMEM;
+  r->rules = tmp;
+  if (!(r->rules[r->nr_rules].pattern = strdup(pattern)))
+    return -ENOMEM;
+  r->rules[r->nr_rules++].cat = c;
+  return 0;
+}
+
+static int load_file(struct classify_rules *r, const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+  char *line = NULL;
+  size_t len = 0;
+  int lineno = 0, err = 0;
+  while (!err && getline(&line, &len, f) > 0) {
+    lineno++;
+    char *save = NULL;
+    char *cat = strtok_r(line, " \t\n", &save);
+    if (!cat || cat[0] == '#')
+      continue;
+    int n = 0;
+    for (char *p; (p = strtok_r(NULL, " \t\n", &save)) && p[0] != '#'; n++)
+      if ((err = add_rule(r, cat, p)))
+        break;
+    if (!err && !n) {
+      fprintf(stderr, "%s:%d: category '%s' without patterns\n", path, lineno,
+              cat);
+      err = -EINVAL;
+    }
+  }
+  free(line);
+  fclose(f);
+  return err;
+}
+
+struct classify_rules *classify_rules__new(const char *path) {
+  struct classify_rules *r = calloc(1, sizeof(*r));
+  if (!r)
+    return NULL;
+  if (category_of(r, "[no-stack]") != CATEGORY_NO_STACK ||
+      category_of(r, "other") != CATEGORY_OTHER)
+    goto err;
+  // 用户规则先加入，优先于内置表
+  if (path && load_file(r, path))
+    goto err;
+  for (size_t i = 0; i < sizeof(builtin_rules) / sizeof(builtin_rules[0]); i++)
+    if (add_rule(r, builtin_rules[i].cat, builtin_rules[i].pattern))
+      goto err;
+  return r;
+err:
+  classify_rules__free(r);
+  return NULL;
+}
+
+void classify_rules__free(struct classify_rules *r) {
+  if (!r)
+    return;
+  for (int i = 0; i < r->nr_names; i++)
+    free(r->names[i]);
+  for (int i = 0; i < r->nr_rules; i++)
+    free(r->rules[i].pattern);
+  free(r->names);
+  free(r->rules);
+  free(r);
+}
+
+const char *classify_rules__name(const struct classify_rules *r, int cat) {
+  return cat >= 0 && cat < r->nr_names ? r->names[cat] : "?";
+}
+
+// 内核里编译器生成的克隆带后缀（foo.isra.0 / foo.constprop.0 / foo.cold），
+// 规则只写原名
+static void base_name(const char *name, char *buf, size_t len) {
+  size_t n = strcspn(name, ".");
+  if (n >= len)
+    n = len - 1;
+  memcpy(buf, name, n);
+  buf[n] = '\0';
+}
+
+static int match(const struct classify_rules *r, const struct cached_stack *st) {
+  char names[MAX_STACK_DEPTH][128];
+  int nr = st->nr < MAX_STACK_DEPTH ? st->nr : MAX_STACK_DEPTH;
+  for (int i = 0; i < nr; i++) {
+    if (st->frames[i].name)
+      base_name(st->frames[i].name, names[i], sizeof(names[i]));
+    else
+      names[i][0] = '\0';
+  }
+  for (int j = 0; j < r->nr_rules; j++)
+    for (int i = 0; i < nr; i++)
+      if (names[i][0] && !fnmatch(r->rules[j].pattern, names[i], 0))
+        return r->rules[j].cat;
+  return CATEGORY_OTHER;
+}
+
+struct cat_slot {
+  int stack_id; // -1 为空
+  int cat;
+  uint64_t gen;
+};
+
+struct tgid_row {
+  uint32_t tgid;
+  bool used;
+  uint64_t total_ns;
+  uint64_t *ns;    // [nr_names]
+  uint64_t *count; // [nr_names]
+};
+
+struct classifier {
+  const struct classify_rules *rules;
+  struct cat_slot *slots; // 开放寻址，容量为 2 的幂
+  size_t nr_slots, used_slots;
+  uint64_t gen;
+  struct tgid_row *rows; // 同上
+  size_t nr_rows, used_rows;
+  uint64_t hits, misses;
+};
+
+#define INIT_SLOTS 1024
+
+struct classifier *classifier__new(const struct classify_rules *r) {
+  struct classifier *cl = calloc(1, sizeof(*cl));
+  if (!cl)
+    return NULL;
+  cl->rules = r;
+  cl->slots = malloc(INIT_SLOTS * sizeof(*cl->slots));
+  cl->rows = calloc(INIT_SLOTS, sizeof(*cl->rows));
+  if (!cl->slots || !cl->rows) {
+    classifier__free(cl);
+    return NULL;
+  }
+  for (size_t i = 0; i < INIT_SLOTS; i++)
+    cl->slots[i].stack_id = -1;
+  cl->nr_slots = cl->nr_rows = INIT_SLOTS;
+  return cl;
+}
+
+void classifier__free(struct classifier *cl) {
+  if (!cl)
+    return;
+  for (size_t i = 0; cl->rows && i < cl->nr_rows; i++)
+    free(cl->rows[i].ns);
+  free(cl->rows);
+  free(cl->slots);
+  free(cl);
+}
+
+static size_t hash_u32(uint32_t v) {
+  return (size_t)(((uint64_t)v * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static struct cat_slot *slot_find(struct cat_slot *slots, size_t n,
+                                  int stack_id) {
+  size_t mask = n - 1;
+  for (size_t i = hash_u32(stack_id) & mask;; i = (i + 1) & mask)
+    if (slots[i].stack_id == stack_id || slots[i].stack_id < 0)
+      return &slots[i];
+}
+
+static int slots_grow(struct classifier *cl) {
+  size_t n = cl->nr_slots * 2;
+  struct cat_slot *slots = malloc(n * sizeof(*slots));
+  if (!slots)
+    return -ENOMEM;
+  for (size_t i = 0; i < n; i++)
+    slots[i].stack_id = -1;
+  for (size_t i = 0; i < cl->nr_slots; i++)
+    if (cl->slots[i].stack_id >= 0)
+      *slot_find(slots, n, cl->slots[i].stack_id) = cl->slots[i];
+  free(cl->slots);
+  cl->slots = slots;
+  cl->nr_slots = n;
+  return 0;
+}
+
+int classifier__classify(struct classifier *cl, struct stack_cache *sc,
+                         int kstack_id) {
+  if (kstack_id < 0)
+    return CATEGORY_NO_STACK;
+  struct cat_slot *s = slot_find(cl->slots, cl->nr_slots, kstack_id);
+  if (s->stack_id == kstack_id && s->gen == cl->gen) {
+    cl->hits++;
+    return s->cat;
+  }
+  cl->misses++;
+  const struct cached_stack *st = stack_cache__get(sc, kstack_id, 0, false);
+  if (!st)
+    return CATEGORY_NO_STACK; // 不缓存，下次重试
+  int cat = match(cl->rules, st);
+  if (s->stack_id < 0) {
+    if ((cl->used_slots + 1) * 2 > cl->nr_slots) {
+      if (slots_grow(cl))
+        return cat;
+      s = slot_find(cl->slots, cl->nr_slots, kstack_id);
+    }
+    cl->used_slots++;
+  }
+  *s = (struct cat_slot){kstack_id, cat, cl->gen};
+  return cat;
+}
+
+void classifier__invalidate(struct classifier *cl) { cl->gen++; }
+
+static struct tgid_row *row_find(struct tgid_row *rows, size_t n,
+                                 uint32_t tgid) {
+  size_t mask = n - 1;
+  for (size_t i = hash_u32(tgid) & mask;; i = (i + 1) & mask)
+    if (!rows[i].used || rows[i].tgid == tgid)
+      return &rows[i];
+}
+
+static int rows_grow(struct classifier *cl) {
+  size_t n = cl->nr_rows * 2;
+  struct tgid_row *rows = calloc(n, sizeof(*rows));
+  if (!rows)
+    return -ENOMEM;
+  for (size_t i = 0; i < cl->nr_rows; i++)
+    if (cl->rows[i].used)
+      *row_find(rows, n, cl->rows[i].tgid) = cl->rows[i];
+  free(cl->rows);
+  cl->rows = rows;
+  cl->nr_rows = n;
+  return 0;
+}
+
+static struct tgid_row *row_get(struct classifier *cl, uint32_t tgid) {
+  struct tgid_row *r = row_find(cl->rows, cl->nr_rows, tgid);
+  if (r->used)
+    return r;
+  if ((cl->used_rows + 1) * 2 > cl->nr_rows) {
+    if (rows_grow(cl))
+      return NULL;
+    r = row_find(cl->rows, cl->nr_rows, tgid);
+  }
+  int nr = cl->rules->nr_names;
+  if (!(r->ns = calloc(2 * nr, sizeof(*r->ns))))
+    return NULL;
+  r->count = r->ns + nr;
+  r->tgid = tgid;
+  r->used = true;
+  cl->used_rows++;
+  return r;
+}
+
+void classifier__add(struct classifier *cl, uint32_t tgid, int cat,
+                     uint64_t ns) {
+  struct tgid_row *r = row_get(cl, tgid);
+  if (!r || cat < 0 || cat >= cl->rules->nr_names)
+    return;
+  r->total_ns += ns;
+  r->ns[cat] += ns;
+  r->count[cat]++;
+}
+
+void classifier__merge(struct classifier *dst, const struct classifier *src) {
+  int nr = dst->rules->nr_names;
+  for (size_t i = 0; i < src->nr_rows; i++) {
+    const struct tgid_row *s = &src->rows[i];
+    struct tgid_row *d;
+    if (!s->used || !(d = row_get(dst, s->tgid)))
+      continue;
+    d->total_ns += s->total_ns;
+    for (int c = 0; c < nr; c++) {
+      d->ns[c] += s->ns[c];
+      d->count[c] += s->count[c];
+    }
+  }
+  dst->hits += src->hits;
+  dst->misses += src->misses;
+}
+
+static int cmp_row(const void *a, const void *b) {
+  const struct tgid_row *x = *(const struct tgid_row *const *)a;
+  const struct tgid_row *y = *(const struct tgid_row *const *)b;
+  if (x->total_ns != y->total_ns)
+    return x->total_ns < y->total_ns ? 1 : -1;
+  return x->tgid < y->tgid ? -1 : x->tgid > y->tgid;
+}
+
+void classifier__print(const struct classifier *cl, FILE *out, comm_fn comm,
+                       int top) {
+  int nr = cl->rules->nr_names;
+  const struct tgid_row **rows = calloc(cl->used_rows + 1, sizeof(*rows));
+  int *order = calloc(nr, sizeof(*order));
+  size_t n = 0;
+  if (!rows || !order)
+    goto out;
+  for (size_t i = 0; i < cl->nr_rows; i++)
+    if (cl->rows[i].used)
+      rows[n++] = &cl->rows[i];
+  qsort(rows, n, sizeof(*rows), cmp_row);
+
+  fprintf(out, "\noff-CPU time by blocking category:\n");
+  for (size_t i = 0; i < n && (top <= 0 || (int)i < top); i++) {
+    const struct tgid_row *r = rows[i];
+    char name[64];
+    comm(r->tgid, name, sizeof(name));
+    fprintf(out, "\ntgid=%u %s total=%.3f ms\n", r->tgid, name,
+            r->total_ns / 1e6);
+    // 类别通常只有十几个，插入排序即可
+    int m = 0;
+    for (int c = 0; c < nr; c++) {
+      if (!r->count[c])
+        continue;
+      int j = m++;
+      for (; j > 0 && r->ns[order[j - 1]] < r->ns[c]; j--)
+        order[j] = order[j - 1];
+      order[j] = c;
+    }
+    for (int j = 0; j < m; j++) {
+      int c = order[j];
+      fprintf(out, "  %-16s %12.3f ms %5.1f%% %10llu\n",
+              classify_rules__name(cl->rules, c), r->ns[c] / 1e6,
+              r->total_ns ? r->ns[c] * 100.0 / r->total_ns : 0.0,
+              (unsigned long long)r->count[c]);
+    }
+  }
+out:
+  free(order);
+  free(rows);
+}
+
+void classifier__stats(const struct classifier *cl, uint64_t *hits,
+                       uint64_t *misses) {
+  *hits = cl->hits;
+  *misses = cl->misses;
+}
@@ -0,0 +1,48 @@
+// classify.h
+// 按规则把内核 off-CPU 栈归到阻塞类别（futex / epoll / sleep / io / pagecache /
+// pipe / net / rwsem ...）。规则是 (类别, 函数名通配)：按规则顺序检查，第一条
+// 有帧命中的规则决定类别，所以更具体的规则放前面；用户规则文件排在内置表之前。
+// 分类结果按内核 stack id 缓存，每个唯一的栈只符号化、匹配一次
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+struct stack_cache;
+
+#define CATEGORY_NO_STACK 0 // 没有内核栈或已查不到
+#define CATEGORY_OTHER 1    // 没有规则命中
+
+// 规则表，加载后只读，多个 classifier（各 worker 一个）共享
+struct classify_rules;
+
+// path 为 NULL 时只有内置表。文件格式每行 “类别 通配...”，# 开头为注释，如
+//   mysql-lock  os_event_wait_low  sync_array_wait_event
+//   cgroup-throttle  throttle_direct_reclaim  mem_cgroup_handle_over_high
+// 出错时打印文件名和行号，返回 NULL
+struct classify_rules *classify_rules__new(const char *path);
+void classify_rules__free(struct classify_rules *r);
+const char *classify_rules__name(const struct classify_rules *r, int cat);
+
+// 每个 consumer 一个：stack id -> 类别的缓存 + 按 (tgid, 类别) 累计的时长
+struct classifier;
+
+struct classifier *classifier__new(const struct classify_rules *r);
+void classifier__free(struct classifier *cl);
+// 返回类别下标；只在缓存未命中时经 sc 取符号化后的栈
+int classifier__classify(struct classifier *cl, struct stack_cache *sc,
+                         int kstack_id);
+// 栈存储被 GC（id 可能复用）时调用
+void classifier__invalidate(struct classifier *cl);
+void classifier__add(struct classifier *cl, uint32_t tgid, int cat,
+                     uint64_t ns);
+// 把 src 的累计值并进 dst（两者须用同一份规则表）
+void classifier__merge(struct classifier *dst, const struct classifier *src);
+
+typedef void (*comm_fn)(uint32_t tgid, char *buf, size_t len);
+
+// 每个进程一段：总时长，以及各类别的时长/占比/次数（按时长降序）；
+// 进程按总时长降序，最多 top 个（<= 0 不限）
+void classifier__print(const struct classifier *cl, FILE *out, comm_fn comm,
+                       int top);
+void classifier__stats(const struct classifier *cl, uint64_t *hits,
+                       uint64_t *misses);
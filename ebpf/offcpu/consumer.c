@@ -0,0 +1,242 @@
+// consumer.c
+#define _GNU_SOURCE
+#include "consumer.h"
+#include "classify.h"
+#include "spsc.h"
+#include "syms.h"
+#include "unwind.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const char *state_names[OFFCPU_STATE_MAX] = {
+    [OFFCPU_R] = "R",        [OFFCPU_S] = "S",
+    [OFFCPU_D] = "D",        [OFFCPU_D_IOWAIT] = "D+iowait",
+    [OFFCPU_OTHER] = "other",  [OFFCPU_ONCPU] = "on-cpu",
+};
+
+const char *state_name(__u8 state) {
+  return state < OFFCPU_STATE_MAX ? state_names[state] : "?";
+}
+
+// stack_store GC 回收过栈后 +1
+static atomic_uint cache_gen;
+
+int consumer__init(struct consumer *c, const struct consumer_opts *opts) {
+  c->usyms = syms_cache__new();
+  if (!c->usyms)
+    return -ENOMEM;
+  c->scache = stack_cache__new(opts->lookup, opts->lookup_ctx, opts->ksyms,
+                               c->usyms, opts->use_cache);
+  if (!c->scache)
+    return -ENOMEM;
+  if (opts->dwarf && !(c->uw = unwinder__new(c->usyms)))
+    return -ENOMEM;
+  if (opts->rules && !(c->cls = classifier__new(opts->rules)))
+    return -ENOMEM;
+  c->rules = opts->rules;
+  c->out = opts->out;
+  c->sink = opts->out;
+  return 0;
+}
+
+void consumer__free(struct consumer *c) {
+  stack_cache__free(c->scache);
+  unwinder__free(c->uw);
+  classifier__free(c->cls);
+  syms_cache__free(c->usyms);
+  if (c->out && c->out != c->sink)
+    fclose(c->out);
+  free(c->out_buf);
+  spsc_ring__free(c->q);
+}
+
+void consumer__invalidate_all(void) { atomic_fetch_add(&cache_gen, 1); }
+
+static void consumer_sync_gen(struct consumer *c) {
+  unsigned gen = atomic_load_explicit(&cache_gen, memory_order_relaxed);
+  if (gen != c->gen) {
+    stack_cache__invalidate(c->scache);
+    if (c->cls)
+      classifier__invalidate(c->cls);
+    c->gen = gen;
+  }
+}
+
+void consumer__forget(struct consumer *c, __u32 tgid) {
+  if (syms_cache__forget(c->usyms, (int)tgid))
+    stack_cache__forget_tgid(c->scache, tgid);
+}
+
+int consumer__print_stack(struct consumer *c, const char *label, int stack_id,
+                          __u32 tgid, bool user) {
+  consumer_sync_gen(c);
+  const struct cached_stack *st =
+      stack_cache__get(c->scache, stack_id, tgid, user);
+  if (!st)
+    return -1;
+  fprintf(c->out, "  %s:\n", label);
+  for (int i = 0; i < st->nr; i++) {
+    const struct cached_frame *f = &st->frames[i];
+    if (f->name)
+      fprintf(c->out, "    [<%p>] %s+0x%llx\n", (void *)f->ip, f->name,
+              (unsigned long long)f->offset);
+    else
+      fprintf(c->out, "    [<%p>] [unknown]\n", (void *)f->ip);
+  }
+  return 0;
+}
+
+static void print_dwarf_ustack(struct consumer *c,
+                               const struct dwarf_event *de) {
+  const struct ustack_snap *snap = &de->snap;
+  if (!snap->size) {
+    fprintf(c->out, "  ustack: <no snapshot>\n");
+    return;
+  }
+  struct unwind_regs regs = {.ip = snap->ip, .sp = snap->sp, .bp = snap->bp};
+  uint64_t ips[MAX_STACK_DEPTH];
+  int n = unwinder__unwind(c->uw, (int)de->ev.tgid, &regs, snap->data,
+                           snap->size, ips, MAX_STACK_DEPTH);
+  fprintf(c->out, "  ustack (dwarf, %u bytes):\n", snap->size);
+  for (int i = 0; i < n; i++) {
+    struct sym_info si;
+    if (syms_cache__map_addr(c->usyms, (int)de->ev.tgid, ips[i], &si))
+      fprintf(c->out, "    %p [unknown]\n", (void *)ips[i]);
+    else if (si.name)
+      fprintf(c->out, "    %p %s+0x%llx\n", (void *)ips[i], si.name,
+              (unsigned long long)si.offset);
+    else
+      fprintf(c->out, "    %p %s+0x%llx\n", (void *)ips[i], si.module,
+              (unsigned long long)si.offset);
+  }
+}
+
+int consumer__classify(struct consumer *c, __u32 tgid, int kstack_id,
+                       __u8 state, __u64 ns) {
+  if (!c->cls || state == OFFCPU_ONCPU)
+    return -1;
+  consumer_sync_gen(c);
+  int cat = classifier__classify(c->cls, c->scache, kstack_id);
+  classifier__add(c->cls, tgid, cat, ns);
+  return cat;
+}
+
+void consumer__process_event(struct consumer *c, const void *data,
+                             size_t size) {
+  const struct event *e = data;
+  if (size < sizeof(*e)) { // exec_rb 转来的 exec 通知
+    consumer__forget(c, *(const __u32 *)data);
+    return;
+  }
+  c->events++;
+  fprintf(c->out, "[%s] tgid=%u tid=%u cpu=%u offcpu=%.3f ms state=%s(0x%x)\n",
+          e->comm, e->tgid, e->pid, e->cpu, (double)e->delta_ns / 1e6,
+          state_name(e->state), e->raw_state);
+  if (e->state < OFFCPU_STATE_MAX) {
+    c->state_total_ns[e->state] += e->delta_ns;
+    c->state_count[e->state]++;
+  }
+  int cat = consumer__classify(c, e->tgid, e->kstack_id, e->state, e->delta_ns);
+  if (cat >= 0)
+    fprintf(c->out, "  category: %s\n", classify_rules__name(c->rules, cat));
+
+  if (e->kstack_id >= 0 &&
+      consumer__print_stack(c, "kstack", e->kstack_id, e->tgid, false))
+    fprintf(c->out, "  kstack: <lookup failed>\n");
+  if (e->ustack_id >= 0 &&
+      consumer__print_stack(c, "ustack", e->ustack_id, e->tgid, true))
+    fprintf(c->out, "  ustack: <lookup failed>\n");
+  if (size >= sizeof(struct dwarf_event))
+    print_dwarf_ustack(c, data);
+}
+
+// ---------- -w 模式的 worker ----------
+
+#define WORKER_BATCH 256
+#define WORKER_QUEUE_SIZE (8 << 20)
+
+static void *worker_main(void *arg) {
+  struct consumer *c = arg;
+  int idle = 0;
+  for (;;) {
+    const void *data;
+    uint32_t len;
+    int n = 0;
+    while (n < WORKER_BATCH && (data = spsc_ring__peek(c->q, &len))) {
+      consumer__process_event(c, data, len);
+      spsc_ring__release(c->q);
+      n++;
+    }
+    if (n) {
+      // 一批事件格式化完再整块写出，sink 的锁每批只拿一次，
+      // 也保证不同 worker 的输出不会在事件中间交错
+      fflush(c->out);
+      fwrite(c->out_buf, 1, c->out_len, c->sink);
+      rewind(c->out);
+      idle = 0;
+      continue;
+    }
+    if (atomic_load(c->stop) && spsc_ring__empty(c->q))
+      break;
+    if (++idle < 64)
+      sched_yield();
+    else
+      usleep(100);
+  }
+  return NULL;
+}
+
+int consumer_pool__start(struct consumer_pool *p, int n,
+                         const struct consumer_opts *opts) {
+  atomic_store(&p->stop, false);
+  p->workers = calloc(n, sizeof(*p->workers));
+  if (!p->workers)
+    return -ENOMEM;
+  p->nr = n;
+  for (int i = 0; i < n; i++) {
+    struct consumer *c = &p->workers[i];
+    int err = consumer__init(c, opts);
+    if (err)
+      return err;
+    c->out = open_memstream(&c->out_buf, &c->out_len);
+    c->q = spsc_ring__new(WORKER_QUEUE_SIZE);
+    c->stop = &p->stop;
+    if (!c->out || !c->q)
+      return -ENOMEM;
+    if ((err = pthread_create(&c->thread, NULL, worker_main, c)))
+      return -err;
+    p->nr_running++;
+  }
+  return 0;
+}
+
+void consumer_pool__dispatch(struct consumer_pool *p, __u32 tgid,
+                             const void *data, size_t size) {
+  struct consumer *w = &p->workers[tgid % p->nr];
+  while (spsc_ring__push(w->q, data, size))
+    sched_yield();
+}
+
+void consumer_pool__wait_idle(struct consumer_pool *p) {
+  for (int i = 0; i < p->nr_running; i++)
+    while (!spsc_ring__empty(p->workers[i].q))
+      sched_yield();
+}
+
+void consumer_pool__stop(struct consumer_pool *p) {
+  atomic_store(&p->stop, true);
+  for (int i = 0; i < p->nr_running; i++)
+    pthread_join(p->workers[i].thread, NULL);
+  p->nr_running = 0;
+}
+
+void consumer_pool__free(struct consumer_pool *p) {
+  consumer_pool__stop(p);
+  for (int i = 0; p->workers && i < p->nr; i++)
+    consumer__free(&p->workers[i]);
+  free(p->workers);
+  p->workers = NULL;
+  p->nr = 0;
+}
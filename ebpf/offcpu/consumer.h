@@ -0,0 +1,89 @@
+// consumer.h
+// 逐事件输出的处理者：栈符号化、事件格式化、-w 模式的 worker 线程。
+// offcpu 和 consumer_bench 共用这一份，bench 量到的就是 offcpu 实际跑的路径
+#pragma once
+#include "offcpu.h"
+#include "stack_cache.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+struct ksyms;
+struct syms_cache;
+struct unwinder;
+struct classify_rules;
+struct classifier;
+struct spsc_ring;
+
+const char *state_name(__u8 state);
+
+struct consumer_opts {
+  stack_lookup_fn lookup; // 从栈存储取原始地址
+  void *lookup_ctx;
+  const struct ksyms *ksyms;
+  const struct classify_rules *rules; // -y 时非 NULL，各 consumer 共享
+  bool dwarf;                         // -D：用户栈按 CFI 回溯
+  bool use_cache;                     // -N 时为 false
+  FILE *out;                          // 输出目的地（offcpu 为 stdout）
+};
+
+// 默认只有一个，在 poll 线程里直接处理；-w N 时每个 worker 一个，
+// 栈缓存/符号表/回溯器都不是线程安全的，各持一份。
+// 事件按 tgid 分给 worker，同一进程的事件顺序不变
+struct consumer {
+  struct stack_cache *scache; // stack id -> 符号化后的帧；重复的栈不再查 map
+  struct syms_cache *usyms;
+  struct unwinder *uw; // -D 模式：用户栈按 CFI 回溯
+  struct classifier *cls; // -y 模式：内核栈 -> 阻塞类别，按 (tgid, 类别) 累计
+  const struct classify_rules *rules;
+  FILE *out;  // 直接处理时即 opts->out；worker: memstream，攒一批整块写出
+  FILE *sink; // worker 的整批输出写到这里
+  char *out_buf;
+  size_t out_len;
+  unsigned gen; // 已同步的 consumer__invalidate_all 代数
+  __u64 events;
+  __u64 state_total_ns[OFFCPU_STATE_MAX];
+  __u64 state_count[OFFCPU_STATE_MAX];
+  struct spsc_ring *q; // poll 线程 -> worker
+  const atomic_bool *stop; // 置位且队列已空时 worker 退出
+  pthread_t thread;
+};
+
+int consumer__init(struct consumer *c, const struct consumer_opts *opts);
+// 对全零的 consumer 也安全
+void consumer__free(struct consumer *c);
+// 栈存储被 GC 回收过（id 可能复用）：各 consumer 处理下一个事件前让自己的
+// 缓存失效。任意线程可调
+void consumer__invalidate_all(void);
+// tgid exec 了：映射快照和该进程的用户栈缓存作废
+void consumer__forget(struct consumer *c, __u32 tgid);
+// 打印一个栈（label: 后逐帧缩进）；查不到返回 -1
+int consumer__print_stack(struct consumer *c, const char *label, int stack_id,
+                          __u32 tgid, bool user);
+// -y 模式：按内核栈归类并计入该进程的类别汇总；未启用或 on-CPU 样本返回 -1
+int consumer__classify(struct consumer *c, __u32 tgid, int kstack_id,
+                       __u8 state, __u64 ns);
+// 处理一条 rb 记录：event / dwarf_event，或只有一个 __u32 tgid 的 exec 通知
+void consumer__process_event(struct consumer *c, const void *data,
+                             size_t size);
+
+// -w 模式：poll 线程只拷贝记录，n 个 worker 线程处理
+struct consumer_pool {
+  struct consumer *workers;
+  int nr;         // 已分配的个数，按 tgid 取模分发
+  int nr_running; // 线程已启动的个数
+  atomic_bool stop;
+};
+
+// 失败时已启动的线程留给 consumer_pool__free 收拾
+int consumer_pool__start(struct consumer_pool *p, int n,
+                         const struct consumer_opts *opts);
+// 拷进 tgid 对应 worker 的队列，队列满时等 worker 腾出空间
+void consumer_pool__dispatch(struct consumer_pool *p, __u32 tgid,
+                             const void *data, size_t size);
+// 等所有队列被取空（最后一批可能还在格式化）
+void consumer_pool__wait_idle(struct consumer_pool *p);
+// 等 worker 把队列处理完再返回；可重复调用
+void consumer_pool__stop(struct consumer_pool *p);
+void consumer_pool__free(struct consumer_pool *p);
@@ -0,0 +1,93 @@
+// consumer_bench.c
+// 逐事件模式用户态一侧的吞吐上限：不加载 BPF，合成和 rb 里同样布局的
+// struct event，交给 offcpu 自己的 consumer.c 处理，打印 events/s：
+//   workers=0：consumer__process_event 在“poll 线程”里直接格式化（offcpu 默认）
+//   workers=N：poll 线程只 consumer_pool__dispatch，N 个 worker 格式化、整批写出（-w N）
+// 输出写到 /dev/null。事件不带栈，栈的符号化开销见 stack_cache_bench；
+// 内核侧的 ringbuf 提交/丢弃这里测不到，要看 offcpu 退出时打印的 rb 统计。
+//   ./consumer_bench [nr_events] [max_workers]
+#define _GNU_SOURCE
+#include "consumer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// 事件不带栈，不会被调用
+static int no_stacks(void *ctx, int stack_id, uint64_t *ips, int max_depth) {
+  (void)ctx;
+  (void)stack_id;
+  (void)ips;
+  (void)max_depth;
+  return -1;
+}
+
+static void make_event(struct event *e, unsigned long long i) {
+  memset(e, 0, sizeof(*e));
+  e->tgid = 1000 + (i % 64);
+  e->pid = e->tgid + (i % 7);
+  e->cpu = i % 32;
+  e->delta_ns = 1000 + (i * 7919) % 50000000;
+  e->state = i % OFFCPU_ONCPU; // 各种 off-CPU 状态轮流出现
+  e->raw_state = e->state == OFFCPU_R ? 0 : 1;
+  e->kstack_id = -1;
+  e->ustack_id = -1;
+  snprintf(e->comm, sizeof(e->comm), "worker-%llu", i % 64);
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 返回 events/s；出错返回 0
+static double run(unsigned long long nr_events, int nr_workers, FILE *sink) {
+  struct consumer_opts opts = {.lookup = no_stacks, .use_cache = true,
+                               .out = sink};
+  struct event e;
+  double t0, rate = 0;
+  if (!nr_workers) {
+    struct consumer c = {};
+    if (!consumer__init(&c, &opts)) {
+      t0 = now_sec();
+      for (unsigned long long i = 0; i < nr_events; i++) {
+        make_event(&e, i);
+        consumer__process_event(&c, &e, sizeof(e));
+      }
+      rate = nr_events / (now_sec() - t0);
+    }
+    consumer__free(&c);
+    return rate;
+  }
+
+  struct consumer_pool pool = {};
+  if (!consumer_pool__start(&pool, nr_workers, &opts)) {
+    t0 = now_sec();
+    for (unsigned long long i = 0; i < nr_events; i++) {
+      make_event(&e, i);
+      consumer_pool__dispatch(&pool, e.tgid, &e, sizeof(e));
+    }
+    consumer_pool__stop(&pool);
+    rate = nr_events / (now_sec() - t0);
+  }
+  consumer_pool__free(&pool); // 启动到一半失败时也会 join 已启动的线程
+  return rate;
+}
+
+int main(int argc, char **argv) {
+  unsigned long long nr_events = argc > 1 ? strtoull(argv[1], NULL, 10) : 5000000;
+  int max_workers = argc > 2 ? atoi(argv[2]) : 4;
+  FILE *sink = fopen("/dev/null", "w");
+  if (!sink || !nr_events)
+    return 1;
+
+  printf("%llu events, %ld online CPUs\n", nr_events,
+         sysconf(_SC_NPROCESSORS_ONLN));
+  printf("workers=0: %.0f events/s\n", run(nr_events, 0, sink));
+  for (int n = 1; n <= max_workers; n *= 2)
+    printf("workers=%d: %.0f events/s\n", n, run(nr_events, n, sink));
+  fclose(sink);
+  return 0;
+}
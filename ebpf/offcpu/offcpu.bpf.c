@@ -1,12 +1,20 @@
 // offcpu.bpf.c
 // CO-RE offcpu: 在 sched_switch 采样上一个被切出的任务的 off-CPU 段
+#include "../vmlinux.h"
 #include "offcpu.h"
-#include "vmlinux.h"
+#include <bpf/bpf_core_read.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 
 char LICENSE[] SEC("license") = "GPL";
 
+// vmlinux.h 里没有 errno 宏
+#define ENOMEM 12
+#define EFAULT 14
+#define EEXIST 17
+#define ENOSYS 38
+#define EAGAIN 11
+
 struct {
   __uint(type, BPF_MAP_TYPE_HASH);
   __type(key, __u32); // pid (tid)
@@ -21,61 +29,782 @@ struct {
   __uint(max_entries, 16384);
 } stacks SEC(".maps");
 
+// conf.stack_store：内容寻址的栈存储，条目可以被用户态 GC
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __type(key, __u32);
+  __type(value, struct stack_entry);
+  __uint(max_entries, 16384);
+} stack_store SEC(".maps");
+
+// bpf_get_stack 的 per-CPU 暂存区；sched_switch 与 perf_event（可能在 NMI
+// 里打断前者）各用一个槽，互不覆盖
+#define SCRATCH_SWITCH 0
+#define SCRATCH_SAMPLE 1
+#define SCRATCH_FUTEX 2
+#define SCRATCH_WAKEUP 3
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 4);
+  __type(key, __u32);
+  __type(value, struct stack_entry);
+} stack_scratch SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct stack_stats);
+} stack_stats SEC(".maps");
+
+// dwarf 模式：tid -> 切出时的用户栈快照（LRU，条目大，数量由用户态调整）
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __type(key, __u32);
+  __type(value, struct ustack_snap);
+  __uint(max_entries, 1024);
+} ustack_snaps SEC(".maps");
+
+// 新建 ustack_snaps 条目时的初值来源（value 太大放不进 BPF 栈）；
+// 只读的全零条目，不需要 per-CPU
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct ustack_snap);
+} snap_scratch SEC(".maps");
+
 struct {
   __uint(type, BPF_MAP_TYPE_RINGBUF);
   __uint(max_entries, 1 << 24); // 16MB
 } rb SEC(".maps");
 
-// 运行时配置（由 user 空间写入 .rodata）
 struct {
-  __u64 threshold_ns;
-  __u32 target_tgid;   // 0: 不过滤
-  __u8 sleep_only;     // 1: 仅统计 sleep (prev->state != 0) 的 offcpu
-  __u8 capture_kernel; // 1: 采集内核栈
-  __u8 capture_user;   // 1: 采集用户栈
-} conf SEC(".rodata");
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct rb_stats);
+} rb_stats SEC(".maps");
+
+// 进程 exec 的 tgid：用户态据此丢掉该进程的 maps 快照和用户栈缓存
+struct {
+  __uint(type, BPF_MAP_TYPE_RINGBUF);
+  __uint(max_entries, 64 * 1024);
+} exec_rb SEC(".maps");
+
+// 聚合模式（conf.aggregate）：(tgid, kstack, ustack, state) -> 总时长/次数
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __type(key, struct offcpu_key);
+  __type(value, struct offcpu_val);
+  __uint(max_entries, 65536);
+} aggs SEC(".maps");
+
+// syscall 模式（conf.syscall_mode）：(tgid, 系统调用号) -> 总时长/次数
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __type(key, struct offcpu_sc_key);
+  __type(value, struct offcpu_val);
+  __uint(max_entries, 16384);
+} sc_aggs SEC(".maps");
+
+// hist 模式（conf.hist_mode）：key 同 aggs，value 多一个直方图，条目更少
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __type(key, struct offcpu_key);
+  __type(value, struct offcpu_hist_val);
+  __uint(max_entries, 16384);
+} hist_aggs SEC(".maps");
+
+// thread_times 模式：tid -> 各状态累计时长；退出的线程由 LRU 淘汰
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __type(key, __u32);
+  __type(value, struct thread_times);
+  __uint(max_entries, 65536);
+} thread_times SEC(".maps");
+
+// futex 模式：tid -> 进入 FUTEX_WAIT 时的锁地址/时刻/用户栈
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __type(key, __u32);
+  __type(value, struct futex_start);
+  __uint(max_entries, 65536);
+} futex_starts SEC(".maps");
 
-static __always_inline int get_kstack_id(void *ctx) {
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __type(key, struct futex_key);
+  __type(value, struct offcpu_hist_val);
+  __uint(max_entries, 16384);
+} futex_aggs SEC(".maps");
+
+// hist_only 模式：切出时刻挂在 task 上（task local storage 不预分配），
+// 直方图 per-CPU 累加，不需要原子操作；每个条目 256B × CPU 数，
+// 也不预分配，只为实际出现的 (进程, 状态) 占内存
+struct hist_only_start {
+  __u64 ts_ns;
+  __u8 preempted;
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+  __uint(map_flags, BPF_F_NO_PREALLOC);
+  __type(key, int);
+  __type(value, struct hist_only_start);
+} hist_starts SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+  __uint(map_flags, BPF_F_NO_PREALLOC);
+  __type(key, struct hist_only_key);
+  __type(value, struct offcpu_log2_hist);
+  __uint(max_entries, 1024); // 用户态按过滤条件调整
+} tgid_hists SEC(".maps");
+
+// 过滤：三类里启用了哪些由 conf.filter_* 决定，内容由用户态运行时增删；
+// 任务命中任意一个已启用的过滤器即放行，每类只查一次
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __type(key, __u32); // tgid
+  __type(value, __u8);
+  __uint(max_entries, 4096);
+} filter_tgids SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __type(key, __u64); // cgroup v2 id（cgroup 目录的 inode 号）
+  __type(value, __u8);
+  __uint(max_entries, 1024);
+} filter_cgroups SEC(".maps");
+
+// 进程名前缀：LPM trie 一次查找就能匹配最长前缀
+struct {
+  __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+  __type(key, struct comm_lpm_key);
+  __type(value, __u8);
+  __uint(map_flags, BPF_F_NO_PREALLOC);
+  __uint(max_entries, 256);
+} filter_comms SEC(".maps");
+
+// 运行时配置（rodata）
+const volatile struct offcpu_cfg conf = {};
+
+// 5.14 之前 task_struct 的状态字段叫 state（long）
+struct task_struct___o {
+  volatile long state;
+} __attribute__((preserve_access_index));
+
+static __always_inline struct stack_stats *get_stack_stats(void) {
+  __u32 zero = 0;
+  return bpf_map_lookup_elem(&stack_stats, &zero);
+}
+
+static __always_inline int stackid_or_count(int id) {
+  if (id >= 0)
+    return id;
+  struct stack_stats *st = get_stack_stats();
+  if (st) {
+    if (id == -EEXIST)
+      st->collisions++; // FAST_STACK_CMP 下哈希桶已被别的栈占用
+    else if (id == -ENOMEM)
+      st->dropped++;
+    else if (id != -EFAULT) // -EFAULT：没有用户栈（内核线程），不算错误
+      st->errors++;
+  }
+  return id;
+}
+
+#define FNV64_OFFSET 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+// bpf_get_stack -> 64 位内容哈希 -> stack_store[hash 折叠的 31 位 id]，
+// 槽位被不同内容占用时线性探测 STACK_STORE_PROBES 次
+static __always_inline int store_stack(void *ctx, __u64 flags, __u32 scratch) {
+  struct stack_stats *st = get_stack_stats();
+  struct stack_entry *buf = bpf_map_lookup_elem(&stack_scratch, &scratch);
+  if (!st || !buf)
+    return -1;
+
+  long len = bpf_get_stack(ctx, buf->ips, sizeof(buf->ips), flags);
+  if (len <= 0) {
+    if (len != -EFAULT)
+      st->errors++;
+    return -1;
+  }
+  __u32 nr = len / sizeof(__u64);
+  __u64 h = FNV64_OFFSET;
+  for (int i = 0; i < MAX_STACK_DEPTH; i++) {
+    if (i >= nr)
+      break;
+    h = (h ^ buf->ips[i]) * FNV64_PRIME;
+  }
+  __u64 now = bpf_ktime_get_ns();
+  buf->hash = h;
+  buf->nr = nr;
+  buf->last_seen_ns = now;
+
+  __u32 base = (__u32)(h ^ (h >> 32));
+  for (int probe = 0; probe < STACK_STORE_PROBES; probe++) {
+    __u32 id = (base + probe) & 0x7fffffff; // 保持非负，沿用 int stack id
+    struct stack_entry *e = bpf_map_lookup_elem(&stack_store, &id);
+    if (!e) {
+      long err = bpf_map_update_elem(&stack_store, &id, buf, BPF_NOEXIST);
+      if (!err) {
+        st->stored++;
+        return id;
+      }
+      if (err != -EEXIST) {
+        st->dropped++; // map 已满
+        return -1;
+      }
+      // 其他 CPU 刚写入同一槽位，重新比较
+      e = bpf_map_lookup_elem(&stack_store, &id);
+      if (!e)
+        continue;
+    }
+    if (e->hash == h && e->nr == nr) {
+      e->last_seen_ns = now;
+      st->hits++;
+      return id;
+    }
+    st->collisions++;
+  }
+  st->dropped++;
+  return -1;
+}
+
+static __always_inline int get_kstack_id(void *ctx, __u32 scratch) {
   if (!conf.capture_kernel)
     return -1;
+  if (conf.stack_store)
+    return store_stack(ctx, 0, scratch);
   // FAST_STACK_CMP 有利于去重
-  return bpf_get_stackid(ctx, &stacks, BPF_F_FAST_STACK_CMP);
+  return stackid_or_count(
+      bpf_get_stackid(ctx, &stacks, BPF_F_FAST_STACK_CMP));
 }
 
-static __always_inline int get_ustack_id(void *ctx) {
+static __always_inline int get_ustack_id(void *ctx, __u32 scratch) {
   if (!conf.capture_user)
     return -1;
+  if (conf.stack_store)
+    return store_stack(ctx, BPF_F_USER_STACK, scratch);
   // 采集用户态栈；需要内核开启 perf 相关能力
-  return bpf_get_stackid(ctx, &stacks, BPF_F_USER_STACK | BPF_F_FAST_STACK_CMP);
+  return stackid_or_count(bpf_get_stackid(
+      ctx, &stacks, BPF_F_USER_STACK | BPF_F_FAST_STACK_CMP));
+}
+
+static __always_inline __u32 get_task_state(struct task_struct *t) {
+  if (bpf_core_field_exists(t->__state))
+    return BPF_CORE_READ(t, __state);
+  return (__u32)BPF_CORE_READ((struct task_struct___o *)t, state);
+}
+
+// 把 __state + in_iowait 归到 R/S/D/D+iowait/其他
+static __always_inline __u8 classify_state(bool preempt, __u32 state,
+                                           __u8 iowait) {
+  // 被抢占时即使 __state 已置为睡眠态，任务仍留在运行队列上（见 __schedule）
+  if (preempt || state == 0)
+    return OFFCPU_R;
+  if (state & OFFCPU_TASK_NOLOAD)
+    return OFFCPU_OTHER; // TASK_IDLE：空闲的内核线程，不计入 D
+  if (state & OFFCPU_TASK_UNINTERRUPTIBLE)
+    return iowait ? OFFCPU_D_IOWAIT : OFFCPU_D;
+  if (state & OFFCPU_TASK_INTERRUPTIBLE)
+    return OFFCPU_S;
+  return OFFCPU_OTHER;
+}
+
+static __always_inline void account_agg(__u32 tgid, __u32 pid,
+                                        struct start_info *sip, __u64 delta) {
+  struct offcpu_key key = {
+      .tgid = tgid,
+      .pid = conf.per_thread ? pid : 0,
+      .kstack_id = sip->kstack_id,
+      .ustack_id = sip->ustack_id,
+      .state = sip->state,
+  };
+  struct offcpu_val *v = bpf_map_lookup_elem(&aggs, &key);
+  if (!v) {
+    struct offcpu_val zero = {};
+    bpf_map_update_elem(&aggs, &key, &zero, BPF_NOEXIST);
+    v = bpf_map_lookup_elem(&aggs, &key);
+    if (!v)
+      return;
+  }
+  __sync_fetch_and_add(&v->total_ns, delta);
+  __sync_fetch_and_add(&v->count, 1);
+}
+
+static __always_inline void rb_reserve_failed(void) {
+  __u32 zero = 0;
+  struct rb_stats *st = bpf_map_lookup_elem(&rb_stats, &zero);
+  if (st)
+    st->dropped++;
 }
 
-static __always_inline bool is_sleeping(long state) {
-  // Runnning == 0；非 0 基本可视为 I/IO/UNINTERRUPTIBLE 等睡眠
-  return state != 0;
+// conf.wakeup_batch 为 0 时保持默认（每个事件都可能唤醒消费者）；否则按 CPU
+// 攒够 N 个事件或距上次唤醒超过 wakeup_ns 才强制唤醒，其余 NO_WAKEUP。
+// 事件停下后剩余的尾巴由用户态 poll 超时后 consume 取走
+static __always_inline __u64 rb_submit_flags(void) {
+  __u32 zero = 0;
+  struct rb_stats *st = bpf_map_lookup_elem(&rb_stats, &zero);
+  if (!st)
+    return 0;
+  st->submitted++;
+  if (!conf.wakeup_batch)
+    return 0;
+  __u64 now = bpf_ktime_get_ns();
+  if (++st->pending >= conf.wakeup_batch ||
+      now - st->last_wakeup_ns >= conf.wakeup_ns) {
+    st->pending = 0;
+    st->last_wakeup_ns = now;
+    st->wakeups++;
+    return BPF_RB_FORCE_WAKEUP;
+  }
+  return BPF_RB_NO_WAKEUP;
+}
+
+static __always_inline void emit_event(struct task_struct *next, __u32 pid,
+                                       __u32 tgid, struct start_info *sip,
+                                       __u64 delta) {
+  struct event *e = bpf_ringbuf_reserve(&rb, sizeof(*e), 0);
+  if (!e) {
+    rb_reserve_failed();
+    return;
+  }
+  e->pid = pid;
+  e->tgid = tgid;
+  e->cpu = bpf_get_smp_processor_id();
+  e->delta_ns = delta;
+  e->kstack_id = sip->kstack_id;
+  e->ustack_id = sip->ustack_id;
+  e->raw_state = sip->raw_state;
+  e->state = sip->state;
+  e->iowait = sip->iowait;
+  bpf_core_read_str(&e->comm, sizeof(e->comm), next->comm);
+  bpf_ringbuf_submit(e, rb_submit_flags());
+}
+
+static __always_inline int log2l_u64(__u64 v) {
+  int r = 0;
+  if (v >> 32) {
+    v >>= 32;
+    r += 32;
+  }
+  if (v >> 16) {
+    v >>= 16;
+    r += 16;
+  }
+  if (v >> 8) {
+    v >>= 8;
+    r += 8;
+  }
+  if (v >> 4) {
+    v >>= 4;
+    r += 4;
+  }
+  if (v >> 2) {
+    v >>= 2;
+    r += 2;
+  }
+  if (v >> 1) {
+    r += 1;
+  }
+  return r;
+}
+
+static __always_inline void hist_add(struct offcpu_hist_val *v, __u64 delta) {
+  int slot = log2l_u64(delta / 1000);
+  if (slot >= OFFCPU_HIST_SLOTS)
+    slot = OFFCPU_HIST_SLOTS - 1;
+  __sync_fetch_and_add(&v->slots[slot], 1);
+  __sync_fetch_and_add(&v->total_ns, delta);
+  __sync_fetch_and_add(&v->count, 1);
+  // max 不要求严格原子，偶发丢一次更新可以接受
+  if (delta > v->max_ns)
+    v->max_ns = delta;
+}
+
+static __always_inline void account_hist(__u32 tgid, __u32 pid,
+                                         struct start_info *sip, __u64 delta) {
+  struct offcpu_key key = {
+      .tgid = tgid,
+      .pid = conf.per_thread ? pid : 0,
+      .kstack_id = sip->kstack_id,
+      .ustack_id = sip->ustack_id,
+      .state = sip->state,
+  };
+  struct offcpu_hist_val *v = bpf_map_lookup_elem(&hist_aggs, &key);
+  if (!v) {
+    // value ~280B，仍在 BPF 512B 栈限制内
+    struct offcpu_hist_val zero = {};
+    bpf_map_update_elem(&hist_aggs, &key, &zero, BPF_NOEXIST);
+    v = bpf_map_lookup_elem(&hist_aggs, &key);
+    if (!v)
+      return;
+  }
+  hist_add(v, delta);
+}
+
+#define PF_KTHREAD 0x00200000
+
+// 切出时 prev 正在执行的系统调用。x86 进入系统调用时 orig_ax = 调用号，
+// ax 预置为 -ENOSYS 直到返回；异常路径 orig_ax 是 error code，中断是 ~vector
+static __always_inline int get_syscall_nr(struct task_struct *t) {
+  if (BPF_CORE_READ(t, flags) & PF_KTHREAD)
+    return OFFCPU_SC_KTHREAD;
+  struct pt_regs *regs = (struct pt_regs *)bpf_task_pt_regs(t);
+  if (!regs)
+    return OFFCPU_SC_NONE;
+  long orig_ax = BPF_CORE_READ(regs, orig_ax);
+  long ax = BPF_CORE_READ(regs, ax);
+  if (orig_ax < 0)
+    return OFFCPU_SC_NONE;
+  if (ax == -ENOSYS)
+    return (int)orig_ax;
+  return OFFCPU_SC_FAULT;
+}
+
+// dwarf 模式：切出时（current 仍是 prev）记录用户寄存器，并把 sp 往上
+// conf.ustack_bytes 字节的用户栈拷进 ustack_snaps[tid]，打上切出时刻
+static __always_inline void save_user_stack(struct task_struct *t, __u32 pid,
+                                            __u64 ts) {
+  if (BPF_CORE_READ(t, flags) & PF_KTHREAD)
+    return;
+  struct ustack_snap *snap = bpf_map_lookup_elem(&ustack_snaps, &pid);
+  if (!snap) {
+    __u32 zero = 0;
+    struct ustack_snap *init = bpf_map_lookup_elem(&snap_scratch, &zero);
+    if (!init)
+      return;
+    bpf_map_update_elem(&ustack_snaps, &pid, init, BPF_ANY);
+    snap = bpf_map_lookup_elem(&ustack_snaps, &pid);
+    if (!snap)
+      return;
+  }
+
+  snap->ts_ns = ts;
+  snap->size = 0;
+  struct pt_regs *regs = (struct pt_regs *)bpf_task_pt_regs(t);
+  if (!regs)
+    return;
+  snap->ip = BPF_CORE_READ(regs, ip);
+  snap->sp = BPF_CORE_READ(regs, sp);
+  snap->bp = BPF_CORE_READ(regs, bp);
+
+  // 栈顶附近窗口可能越过栈 VMA 末尾导致整体读失败，逐次减半重试
+  __u32 n = conf.ustack_bytes;
+  if (n > DWARF_STACK_MAX)
+    n = DWARF_STACK_MAX;
+  for (int i = 0; i < 4; i++) {
+    if (!n)
+      break;
+    // n 在 [1, DWARF_STACK_MAX]；这样写验证器能推出上界，且不改变取值
+    __u32 len = ((n - 1) & (DWARF_STACK_MAX - 1)) + 1;
+    if (!bpf_probe_read_user(snap->data, len, (void *)snap->sp)) {
+      snap->size = n;
+      break;
+    }
+    n >>= 1;
+  }
+}
+
+static __always_inline void emit_dwarf_event(struct task_struct *next,
+                                             __u32 pid, __u32 tgid,
+                                             struct start_info *sip,
+                                             __u64 delta) {
+  struct dwarf_event *e = bpf_ringbuf_reserve(&rb, sizeof(*e), 0);
+  if (!e) {
+    rb_reserve_failed();
+    return;
+  }
+  e->ev.pid = pid;
+  e->ev.tgid = tgid;
+  e->ev.cpu = bpf_get_smp_processor_id();
+  e->ev.delta_ns = delta;
+  e->ev.kstack_id = sip->kstack_id;
+  e->ev.ustack_id = -1;
+  e->ev.raw_state = sip->raw_state;
+  e->ev.state = sip->state;
+  e->ev.iowait = sip->iowait;
+  bpf_core_read_str(&e->ev.comm, sizeof(e->ev.comm), next->comm);
+
+  // 快照必须来自这一段的切出；被抢占（-S）、内核线程、取寄存器失败时
+  // 切出没有新快照，留下的是更早一段的
+  struct ustack_snap *snap = bpf_map_lookup_elem(&ustack_snaps, &pid);
+  if (!snap || snap->ts_ns != sip->ts_ns ||
+      bpf_probe_read_kernel(&e->snap, sizeof(e->snap), snap))
+    e->snap.size = 0;
+  bpf_ringbuf_submit(e, rb_submit_flags());
+}
+
+static __always_inline void account_syscall(__u32 tgid, struct start_info *sip,
+                                            __u64 delta) {
+  struct offcpu_sc_key key = {.tgid = tgid, .syscall = sip->syscall};
+  struct offcpu_val *v = bpf_map_lookup_elem(&sc_aggs, &key);
+  if (!v) {
+    struct offcpu_val zero = {};
+    bpf_map_update_elem(&sc_aggs, &key, &zero, BPF_NOEXIST);
+    v = bpf_map_lookup_elem(&sc_aggs, &key);
+    if (!v)
+      return;
+  }
+  __sync_fetch_and_add(&v->total_ns, delta);
+  __sync_fetch_and_add(&v->count, 1);
+}
+
+// 6.15 起 kernfs_node.parent 改名为 __parent（RCU 保护）
+struct kernfs_node___new {
+  struct kernfs_node *__parent;
+} __attribute__((preserve_access_index));
+
+static __always_inline struct kernfs_node *kn_parent(struct kernfs_node *kn) {
+  struct kernfs_node___new *n = (void *)kn;
+  if (bpf_core_field_exists(n->__parent))
+    return BPF_CORE_READ(n, __parent);
+  return BPF_CORE_READ(kn, parent);
+}
+
+#define MAX_CGROUP_DEPTH 16
+
+static __always_inline bool task_allowed(struct task_struct *t, __u32 tgid) {
+  if (!conf.filter_tgid && !conf.filter_cgroup && !conf.filter_comm)
+    return true;
+  if (conf.filter_tgid && bpf_map_lookup_elem(&filter_tgids, &tgid))
+    return true;
+  if (conf.filter_cgroup) {
+    // 容器里的任务常在它的子 cgroup 里：从所在 cgroup 沿祖先往上匹配
+    struct kernfs_node *kn = BPF_CORE_READ(t, cgroups, dfl_cgrp, kn);
+    for (int i = 0; i < MAX_CGROUP_DEPTH && kn; i++) {
+      __u64 cgid = BPF_CORE_READ(kn, id);
+      if (bpf_map_lookup_elem(&filter_cgroups, &cgid))
+        return true;
+      kn = kn_parent(kn);
+    }
+  }
+  if (conf.filter_comm) {
+    // 用进程（线程组 leader）的名字，工作线程改了名也能匹配
+    struct comm_lpm_key key = {.prefixlen = TASK_COMM_LEN * 8};
+    BPF_CORE_READ_STR_INTO(&key.comm, t, group_leader, comm);
+    if (bpf_map_lookup_elem(&filter_comms, &key))
+      return true;
+  }
+  return false;
+}
+
+// 把 [last_ts, now) 记到线程当前状态上，然后切到 state
+static __always_inline void thread_times_move(struct task_struct *t, __u32 pid,
+                                              __u8 state, __u64 now) {
+  struct thread_times *tt = bpf_map_lookup_elem(&thread_times, &pid);
+  if (!tt) {
+    struct thread_times init = {};
+    init.tgid = BPF_CORE_READ(t, tgid);
+    init.state = state;
+    init.last_ts = now;
+    bpf_core_read_str(&init.comm, sizeof(init.comm), t->comm);
+    bpf_map_update_elem(&thread_times, &pid, &init, BPF_NOEXIST);
+    return;
+  }
+  __u8 cur = tt->state;
+  if (cur < OFFCPU_STATE_MAX)
+    tt->ns[cur] += now - tt->last_ts;
+  tt->state = state;
+  tt->last_ts = now;
+}
+
+static __always_inline void account_thread_times(bool preempt,
+                                                 struct task_struct *prev,
+                                                 struct task_struct *next,
+                                                 __u64 now) {
+  __u32 prev_pid = BPF_CORE_READ(prev, pid);
+  if (prev_pid && task_allowed(prev, BPF_CORE_READ(prev, tgid))) {
+    __u8 iowait = BPF_CORE_READ_BITFIELD_PROBED(prev, in_iowait);
+    thread_times_move(prev, prev_pid,
+                      classify_state(preempt, get_task_state(prev), iowait),
+                      now);
+  }
+  __u32 next_pid = BPF_CORE_READ(next, pid);
+  if (next_pid && task_allowed(next, BPF_CORE_READ(next, tgid)))
+    thread_times_move(next, next_pid, OFFCPU_ONCPU, now);
+}
+
+// 睡眠中的线程被唤醒：之后到真正上 CPU 之前算排队（R）
+static __always_inline int thread_times_wakeup(struct task_struct *p) {
+  __u32 pid = BPF_CORE_READ(p, pid);
+  struct thread_times *tt = bpf_map_lookup_elem(&thread_times, &pid);
+  if (!tt || tt->state == OFFCPU_ONCPU || tt->state == OFFCPU_R)
+    return 0;
+  thread_times_move(p, pid, OFFCPU_R, bpf_ktime_get_ns());
+  return 0;
+}
+
+SEC("tp_btf/sched_wakeup")
+int BPF_PROG(on_sched_wakeup, struct task_struct *p) {
+  return thread_times_wakeup(p);
+}
+
+static __always_inline void account_hist_only(bool preempt,
+                                              struct task_struct *prev,
+                                              struct task_struct *next,
+                                              __u64 now) {
+  __u32 tgid = BPF_CORE_READ(prev, tgid);
+  if (BPF_CORE_READ(prev, pid) && task_allowed(prev, tgid)) {
+    __u8 iowait = BPF_CORE_READ_BITFIELD_PROBED(prev, in_iowait);
+    __u8 state = classify_state(preempt, get_task_state(prev), iowait);
+    struct hist_only_start *st = bpf_task_storage_get(
+        &hist_starts, prev, 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (st && (!conf.sleep_only || state != OFFCPU_R)) {
+      st->ts_ns = now;
+      st->preempted = state == OFFCPU_R;
+    }
+  }
+
+  struct hist_only_start *st = bpf_task_storage_get(&hist_starts, next, 0, 0);
+  if (!st || !st->ts_ns)
+    return;
+  __u64 delta = now - st->ts_ns;
+  st->ts_ns = 0;
+  if (delta < conf.threshold_ns)
+    return;
+
+  struct hist_only_key key = {
+      .tgid = BPF_CORE_READ(next, tgid),
+      .preempted = st->preempted,
+  };
+  struct offcpu_log2_hist *h = bpf_map_lookup_elem(&tgid_hists, &key);
+  if (!h) {
+    struct offcpu_log2_hist zero = {};
+    bpf_map_update_elem(&tgid_hists, &key, &zero, BPF_NOEXIST);
+    h = bpf_map_lookup_elem(&tgid_hists, &key);
+    if (!h)
+      return;
+  }
+  int slot = log2l_u64(delta / 1000);
+  if (slot >= OFFCPU_HIST_SLOTS)
+    slot = OFFCPU_HIST_SLOTS - 1;
+  h->slots[slot]++;
+}
+
+// wakeup_graph 模式：sched_waking 总在唤醒方上下文里触发（sched_wakeup 在
+// TTWU_QUEUE 时可能跑在被唤醒方的 CPU 上，current 不是唤醒方）
+// preempt_count 的中断位（include/linux/preempt.h）
+#define SOFTIRQ_OFFSET 0x100
+#define HARDIRQ_MASK 0xf0000
+#define NMI_MASK 0xf00000
+
+// x86 上 preempt_count 在 6.2 ~ 6.14 放在 pcpu_hot 里，其余版本是单独的
+// per-CPU 变量 __preempt_count（同 selftests 的 bpf_in_interrupt）
+extern const int __preempt_count __ksym __weak;
+struct pcpu_hot___local {
+  int preempt_count;
+} __attribute__((preserve_access_index));
+extern struct pcpu_hot___local pcpu_hot __ksym __weak;
+
+// 正在处理硬中断、软中断或 NMI；只关了下半部（local_bh_disable）的任务不算
+static __always_inline bool in_irq_context(void) {
+  int pcnt;
+  if (bpf_ksym_exists(&pcpu_hot))
+    pcnt = ((struct pcpu_hot___local *)bpf_this_cpu_ptr(&pcpu_hot))
+               ->preempt_count;
+  else
+    pcnt = *(const int *)bpf_this_cpu_ptr(&__preempt_count);
+  return pcnt & (NMI_MASK | HARDIRQ_MASK | SOFTIRQ_OFFSET);
+}
+
+SEC("tp_btf/sched_waking")
+int BPF_PROG(on_sched_waking, struct task_struct *p) {
+  __u32 wakee = BPF_CORE_READ(p, pid);
+  struct start_info *sip = bpf_map_lookup_elem(&starts, &wakee);
+  if (!sip || sip->state == OFFCPU_R) // 没睡下去的（被抢占）不算依赖
+    return 0;
+  __u64 now = bpf_ktime_get_ns();
+  if (now - sip->ts_ns < conf.threshold_ns)
+    return 0;
+
+  struct wakeup_event *e = bpf_ringbuf_reserve(&rb, sizeof(*e), 0);
+  if (!e) {
+    rb_reserve_failed();
+    return 0;
+  }
+  e->ts_ns = now;
+  e->blocked_ns = now - sip->ts_ns;
+  e->wakee_pid = wakee;
+  e->wakee_tgid = BPF_CORE_READ(p, tgid);
+  e->waker_kstack_id = get_kstack_id(ctx, SCRATCH_WAKEUP);
+  if (in_irq_context()) {
+    // 中断里的唤醒（I/O 完成、定时器等）：current 只是被打断的任务，
+    // 不是唤醒方，只留中断处理的内核栈
+    e->waker_pid = 0;
+    e->waker_tgid = 0;
+    e->waker_ustack_id = -1;
+    e->waker_ctx = WAKER_IRQ;
+    __builtin_memcpy(e->waker_comm, "[irq]", sizeof("[irq]"));
+  } else {
+    __u64 id = bpf_get_current_pid_tgid();
+    e->waker_pid = (__u32)id;
+    e->waker_tgid = id >> 32;
+    e->waker_ustack_id = get_ustack_id(ctx, SCRATCH_WAKEUP);
+    // 过滤范围外的 waker 没有阻塞记录，分析时不能当成一直在跑
+    e->waker_ctx = task_allowed((struct task_struct *)bpf_get_current_task(),
+                                    e->waker_tgid)
+                       ? WAKER_TASK
+                       : WAKER_UNTRACKED;
+    bpf_get_current_comm(&e->waker_comm, sizeof(e->waker_comm));
+  }
+  e->wakee_kstack_id = sip->kstack_id;
+  e->wakee_ustack_id = sip->ustack_id;
+  e->wakee_state = sip->state;
+  bpf_core_read_str(&e->wakee_comm, sizeof(e->wakee_comm), p->comm);
+  bpf_ringbuf_submit(e, rb_submit_flags());
+  // 边已经记下，切入时不再结算这一段
+  bpf_map_delete_elem(&starts, &wakee);
+  return 0;
 }
 
 SEC("tp_btf/sched_switch")
-int BPF_PROG(on_sched_switch, struct task_struct *prev,
+int BPF_PROG(on_sched_switch, bool preempt, struct task_struct *prev,
              struct task_struct *next) {
   __u64 now = bpf_ktime_get_ns();
 
+  if (conf.thread_times) {
+    account_thread_times(preempt, prev, next, now);
+    return 0;
+  }
+  if (conf.hist_only) {
+    account_hist_only(preempt, prev, next, now);
+    return 0;
+  }
+
   // ---- 处理 prev：被切出 ----
   __u32 prev_pid = BPF_CORE_READ(prev, pid);
   __u32 prev_tgid = BPF_CORE_READ(prev, tgid);
   if (prev_pid) {
-    // 过滤 TGID（进程维度）
-    if (!conf.target_tgid || conf.target_tgid == prev_tgid) {
-      long state = BPF_CORE_READ(prev, state);
+    // 按 tgid / cgroup / 进程名过滤
+    if (task_allowed(prev, prev_tgid)) {
       struct start_info si = {};
       si.ts_ns = now;
-      si.asleep = is_sleeping(state) ? 1 : 0;
+      si.raw_state = get_task_state(prev);
+      si.iowait = BPF_CORE_READ_BITFIELD_PROBED(prev, in_iowait);
+      si.state = classify_state(preempt, si.raw_state, si.iowait);
 
-      if (!conf.sleep_only || si.asleep) {
+      if (conf.syscall_mode) {
+        // 便宜模式：不采栈，只记系统调用号
+        si.syscall = get_syscall_nr(prev);
+        si.kstack_id = -1;
+        si.ustack_id = -1;
+      } else if (!conf.sleep_only || si.state != OFFCPU_R) {
         // 仅在需要时采集堆栈（与 BCC offcputime 一致：更偏好在 sleep
         // 时抓阻塞栈）
-        si.kstack_id =
-            get_kstack_id((void *)bpf_get_current_task()); // ctx 也可
-        si.ustack_id = get_ustack_id((void *)bpf_get_current_task());
+        // 切出时 current 仍是 prev，栈辅助函数只接受程序 ctx
+        si.kstack_id = get_kstack_id(ctx, SCRATCH_SWITCH);
+        if (conf.dwarf_stack) {
+          // 用户栈由用户态按 CFI 离线回溯，不走 bpf_get_stackid
+          save_user_stack(prev, prev_pid, now);
+          si.ustack_id = -1;
+        } else {
+          si.ustack_id = get_ustack_id(ctx, SCRATCH_SWITCH);
+        }
       } else {
         si.kstack_id = -1;
         si.ustack_id = -1;
@@ -89,23 +818,22 @@ int BPF_PROG(on_sched_switch, struct task_struct *prev,
   __u32 next_pid = BPF_CORE_READ(next, pid);
   __u32 next_tgid = BPF_CORE_READ(next, tgid);
   if (next_pid) {
-    if (!conf.target_tgid || conf.target_tgid == next_tgid) {
+    if (task_allowed(next, next_tgid)) {
       struct start_info *sip = bpf_map_lookup_elem(&starts, &next_pid);
       if (sip) {
         __u64 delta = now - sip->ts_ns;
-        if (delta >= conf.threshold_ns) {
-          struct event *e = bpf_ringbuf_reserve(&rb, sizeof(*e), 0);
-          if (e) {
-            e->pid = next_pid;
-            e->tgid = next_tgid;
-            e->cpu = bpf_get_smp_processor_id();
-            e->delta_ns = delta;
-            e->kstack_id = sip->kstack_id;
-            e->ustack_id = sip->ustack_id;
-            e->asleep = sip->asleep;
-            bpf_core_read_str(&e->comm, sizeof(e->comm), next->comm);
-            bpf_ringbuf_submit(e, 0);
-          }
+        // wakeup_graph 模式只在 sched_waking 里出边，这里仅清理
+        if (!conf.wakeup_graph && delta >= conf.threshold_ns) {
+          if (conf.syscall_mode)
+            account_syscall(next_tgid, sip, delta);
+          else if (conf.hist_mode)
+            account_hist(next_tgid, next_pid, sip, delta);
+          else if (conf.aggregate)
+            account_agg(next_tgid, next_pid, sip, delta);
+          else if (conf.dwarf_stack)
+            emit_dwarf_event(next, next_pid, next_tgid, sip, delta);
+          else
+            emit_event(next, next_pid, next_tgid, sip, delta);
         }
         bpf_map_delete_elem(&starts, &next_pid);
       }
@@ -114,3 +842,90 @@ int BPF_PROG(on_sched_switch, struct task_struct *prev,
 
   return 0;
 }
+
+// wall 模式：软件 CPU clock 采样 on-CPU 栈，写进与 off-CPU 相同的 aggs/stacks，
+// 每个样本按采样周期折算时长，和 off-CPU 时间可以直接相加
+SEC("perf_event")
+int on_cpu_sample(struct bpf_perf_event_data *ctx) {
+  __u64 id = bpf_get_current_pid_tgid();
+  __u32 pid = (__u32)id;
+  __u32 tgid = id >> 32;
+  if (!pid) // idle
+    return 0;
+  if (!task_allowed((struct task_struct *)bpf_get_current_task(), tgid))
+    return 0;
+
+  struct start_info si = {};
+  si.state = OFFCPU_ONCPU;
+  si.kstack_id = get_kstack_id(ctx, SCRATCH_SAMPLE);
+  si.ustack_id = get_ustack_id(ctx, SCRATCH_SAMPLE);
+  account_agg(tgid, pid, &si, conf.sample_period_ns);
+  return 0;
+}
+
+// futex 模式：只看会阻塞在某个用户地址上的 op
+#define FUTEX_WAIT 0
+#define FUTEX_LOCK_PI 6
+#define FUTEX_WAIT_BITSET 9
+#define FUTEX_WAIT_REQUEUE_PI 11
+#define FUTEX_LOCK_PI2 13
+#define FUTEX_CMD_MASK 0x7f // 去掉 PRIVATE(128)/CLOCK_REALTIME(256)
+
+SEC("tracepoint/syscalls/sys_enter_futex")
+int on_futex_enter(struct trace_event_raw_sys_enter *ctx) {
+  __u64 id = bpf_get_current_pid_tgid();
+  __u32 pid = (__u32)id;
+  __u32 tgid = id >> 32;
+  int cmd = (int)ctx->args[1] & FUTEX_CMD_MASK;
+  if (cmd != FUTEX_WAIT && cmd != FUTEX_WAIT_BITSET && cmd != FUTEX_LOCK_PI &&
+      cmd != FUTEX_LOCK_PI2 && cmd != FUTEX_WAIT_REQUEUE_PI)
+    return 0;
+  if (!task_allowed((struct task_struct *)bpf_get_current_task(), tgid))
+    return 0;
+
+  struct futex_start fs = {
+      .ts_ns = bpf_ktime_get_ns(),
+      .uaddr = ctx->args[0],
+      .ustack_id = get_ustack_id(ctx, SCRATCH_FUTEX),
+  };
+  bpf_map_update_elem(&futex_starts, &pid, &fs, BPF_ANY);
+  return 0;
+}
+
+SEC("tracepoint/syscalls/sys_exit_futex")
+int on_futex_exit(struct trace_event_raw_sys_exit *ctx) {
+  __u64 id = bpf_get_current_pid_tgid();
+  __u32 pid = (__u32)id;
+  struct futex_start *fs = bpf_map_lookup_elem(&futex_starts, &pid);
+  if (!fs)
+    return 0;
+  __u64 delta = bpf_ktime_get_ns() - fs->ts_ns;
+  // -EAGAIN：进内核时锁字已经变了，没有真正睡下去
+  if (ctx->ret != -EAGAIN && delta >= conf.threshold_ns) {
+    struct futex_key key = {
+        .tgid = id >> 32,
+        .ustack_id = fs->ustack_id,
+        .uaddr = fs->uaddr,
+    };
+    struct offcpu_hist_val *v = bpf_map_lookup_elem(&futex_aggs, &key);
+    if (!v) {
+      struct offcpu_hist_val zero = {};
+      bpf_map_update_elem(&futex_aggs, &key, &zero, BPF_NOEXIST);
+      v = bpf_map_lookup_elem(&futex_aggs, &key);
+    }
+    if (v)
+      hist_add(v, delta);
+  }
+  bpf_map_delete_elem(&futex_starts, &pid);
+  return 0;
+}
+
+// exec 换掉了整个地址空间（pid 被新程序复用也是 exec），之前按 tgid 缓存的
+// 映射作废。不处理退出：已退出进程的旧快照还要用来符号化剩下的聚合条目
+SEC("tp_btf/sched_process_exec")
+int BPF_PROG(on_process_exec, struct task_struct *p, pid_t old_pid,
+             struct linux_binprm *bprm) {
+  __u32 tgid = BPF_CORE_READ(p, tgid);
+  bpf_ringbuf_output(&exec_rb, &tgid, sizeof(tgid), 0);
+  return 0;
+}
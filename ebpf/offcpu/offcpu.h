@@ -1,15 +1,75 @@
 // offcpu.h
 #pragma once
+#ifndef __VMLINUX_H__
 #include <linux/types.h>
+#endif
 
 #define TASK_COMM_LEN 16
 #define MAX_STACK_DEPTH 127
+#define OFFCPU_HIST_SLOTS 32 // log2(us) 槽位，最后一槽约 35 分钟
+#define STACK_STORE_PROBES 4 // stack_store 冲突时线性探测的槽位数
+#define DWARF_STACK_MAX 8192 // dwarf 模式单次拷贝的用户栈窗口上限（同 perf 默认）
+
+// 与内核 include/linux/sched.h 保持一致（vmlinux.h 中没有宏定义）
+#define OFFCPU_TASK_INTERRUPTIBLE 0x0001
+#define OFFCPU_TASK_UNINTERRUPTIBLE 0x0002
+#define OFFCPU_TASK_NOLOAD 0x0400
+
+// 切出时的状态分桶，ps 风格：R / S / D / D+iowait / 其他(T/t/I/...)
+enum offcpu_state {
+    OFFCPU_R = 0,        // 被抢占或主动让出，仍在运行队列上
+    OFFCPU_S = 1,        // TASK_INTERRUPTIBLE：锁、epoll、nanosleep...
+    OFFCPU_D = 2,        // TASK_UNINTERRUPTIBLE：缺页、内核锁等
+    OFFCPU_D_IOWAIT = 3, // D 且 in_iowait：块设备 I/O
+    OFFCPU_OTHER = 4,    // stopped/traced/idle(TASK_NOLOAD) 等
+    OFFCPU_ONCPU = 5,    // wall 模式：perf_event 采到的 on-CPU 样本
+    OFFCPU_STATE_MAX,
+};
+
+// 切出时不在系统调用中的几种情况（syscall 模式的 key.syscall < 0）
+#define OFFCPU_SC_NONE -1    // 用户态被中断/抢占
+#define OFFCPU_SC_FAULT -2   // 缺页等异常（orig_ax 为 error code）
+#define OFFCPU_SC_KTHREAD -3 // 内核线程，没有用户态 pt_regs
+
+// 运行时配置（由 user 空间写入 .rodata）
+struct offcpu_cfg {
+    __u64 threshold_ns;
+    __u8 filter_tgid;    // 1: 放行 filter_tgids 里的进程
+    __u8 filter_cgroup;  // 1: 放行 filter_cgroups 里的 cgroup（v2 id）
+    __u8 filter_comm;    // 1: 放行进程名前缀命中 filter_comms 的进程
+    __u8 sleep_only;     // 1: 仅统计 sleep (state != R) 的 offcpu
+    __u8 capture_kernel; // 1: 采集内核栈
+    __u8 capture_user;   // 1: 采集用户栈
+    __u8 aggregate;      // 1: 内核内聚合到 aggs，不走 rb
+    __u8 syscall_mode;   // 1: 只记系统调用号，聚合到 sc_aggs，不采栈
+    __u8 hist_mode;      // 1: 按栈聚合 log2 直方图 + max 到 hist_aggs
+    __u8 per_thread;     // 1: 聚合 key 带上 tid，否则 pid 字段为 0
+    __u64 sample_period_ns; // wall 模式：每个 on-CPU 样本折算的时长
+    __u8 stack_store;    // 1: 栈写入内容寻址的 stack_store，而非 stacks
+    __u8 dwarf_stack;    // 1: 切出时拷贝用户寄存器 + 栈窗口，用户态按 CFI 回溯
+    __u32 ustack_bytes;  // dwarf 模式拷贝的栈窗口字节数（<= DWARF_STACK_MAX）
+    __u32 wakeup_batch;  // rb 提交用 NO_WAKEUP，每 N 个事件强制唤醒一次；0: 每个都唤醒
+    __u64 wakeup_ns;     // 距上次唤醒超过该时长也强制唤醒
+    __u8 thread_times;   // 1: 只按 tid 累计各状态时长到 thread_times，不采栈
+    __u8 futex_mode;     // 1: 只跟踪 futex 等待，按 (tgid, 锁地址, 用户栈) 聚合
+    __u8 wakeup_graph;   // 1: 只输出唤醒边 wakeup_event，供离线关键路径分析
+    __u8 hist_only;      // 1: 不采栈不走 rb，只按 (tgid, 睡眠/被抢占) 累计 log2 直方图
+};
+
+// filter_comms（LPM trie）的 key：prefixlen 为前缀的比特数
+struct comm_lpm_key {
+    __u32 prefixlen;
+    char comm[TASK_COMM_LEN];
+};
 
 struct start_info {
     __u64 ts_ns;  // 线程离开 CPU 的时刻, offcpu = now - ts_ns
     int kstack_id;  // 线程切出时采集到的 kernel stack ID，BPF_MAP_TYPE_STACK_TRACE map 的一个 key
     int ustack_id;
-    __u8 asleep;   // 1: 上下文切出时处于可中断/不可中断睡眠；0: 运行态(被抢占/自愿让出)
+    __u32 raw_state; // 切出时的 __state 原始位
+    __u8 state;      // enum offcpu_state
+    __u8 iowait;     // 切出时的 in_iowait
+    int syscall;     // syscall 模式：系统调用号或 OFFCPU_SC_*
 };
 
 struct event {
@@ -21,5 +81,140 @@ struct event {
 
     int kstack_id; // -EFAULT/-ENOENT 表示未采集或失败
     int ustack_id;
-    __u8 asleep;   // 同上
+    __u32 raw_state; // 同上
+    __u8 state;
+    __u8 iowait;
+};
+
+// 内核内聚合：同一 (tgid[, tid], 栈, 状态) 的 off-CPU 时间累加
+struct offcpu_key {
+    __u32 tgid;
+    __u32 pid;   // 仅 per_thread 时填 tid
+    int kstack_id;
+    int ustack_id;
+    __u32 state; // enum offcpu_state
+};
+
+struct offcpu_val {
+    __u64 total_ns;
+    __u64 count;
+};
+
+// syscall 模式聚合：(tgid, 系统调用号) -> 总时长/次数
+struct offcpu_sc_key {
+    __u32 tgid;
+    int syscall; // >= 0: 系统调用号；< 0: OFFCPU_SC_*
+};
+
+// hist 模式：每个 (tgid, 栈, 状态) 旁边挂一个小 log2(us) 直方图和最大值
+struct offcpu_hist_val {
+    __u64 total_ns;
+    __u64 count;
+    __u64 max_ns;
+    __u64 slots[OFFCPU_HIST_SLOTS];
+};
+
+// stack_store 的 value：按内容哈希寻址，key 为 hash 折叠出的 31 位 stack id
+struct stack_entry {
+    __u64 hash;         // 完整 64 位内容哈希，用来识别槽位冲突
+    __u64 last_seen_ns; // 最近一次命中，用户态据此 GC
+    __u32 nr;           // 有效帧数
+    __u32 _pad;
+    __u64 ips[MAX_STACK_DEPTH];
+};
+
+// 栈采集计数（per-CPU，用户态求和）
+struct stack_stats {
+    __u64 stored;     // 新写入的栈
+    __u64 hits;       // 已存在、直接复用
+    __u64 collisions; // 槽位被不同内容占用（STACK_TRACE 模式为 -EEXIST）
+    __u64 dropped;    // map 满或探测失败，样本丢栈
+    __u64 errors;     // bpf_get_stack/bpf_get_stackid 其他错误
+};
+
+// futex 模式：FUTEX_WAIT 系列按 (tgid, uaddr, 用户栈) 聚合，value 用 offcpu_hist_val
+struct futex_key {
+    __u32 tgid;
+    int ustack_id;
+    __u64 uaddr;
+};
+
+struct futex_start {
+    __u64 ts_ns;
+    __u64 uaddr;
+    int ustack_id;
+};
+
+// wakeup_graph 模式：一条唤醒边。waker 在 sched_waking 时是 current，
+// 它的栈是“释放”动作发生的位置；wakee 的栈是它切出时阻塞的位置
+// 唤醒方所处的上下文
+enum waker_ctx {
+    WAKER_TASK = 0,      // 普通任务
+    WAKER_IRQ = 1,       // 硬/软中断、NMI：waker 记为 0，只有内核栈
+    WAKER_UNTRACKED = 2, // 不在过滤范围内的任务：它自己的阻塞没有记录
+};
+
+struct wakeup_event {
+    __u64 ts_ns;      // 唤醒时刻（bpf_ktime_get_ns，CLOCK_MONOTONIC）
+    __u64 blocked_ns; // wakee 从切出到被唤醒
+    __u32 waker_pid;
+    __u32 waker_tgid;
+    __u32 wakee_pid;
+    __u32 wakee_tgid;
+    int waker_kstack_id;
+    int waker_ustack_id;
+    int wakee_kstack_id;
+    int wakee_ustack_id;
+    __u8 wakee_state; // 切出时的 enum offcpu_state
+    __u8 waker_ctx;   // enum waker_ctx
+    char waker_comm[TASK_COMM_LEN];
+    char wakee_comm[TASK_COMM_LEN];
+};
+
+// hist_only 模式：per-CPU 直方图的 key
+struct hist_only_key {
+    __u32 tgid;
+    __u32 preempted; // 1: 切出时仍可运行（被抢占/让出），0: 睡眠
+};
+
+struct offcpu_log2_hist {
+    __u64 slots[OFFCPU_HIST_SLOTS]; // 单位 us，slot i 为 [2^i, 2^(i+1))
+};
+
+// thread_times 模式：每个线程在各状态下累计的时长（内核内累加，用户态定期批量读）。
+// ns[] 按 enum offcpu_state 下标：ONCPU 在 CPU 上，R 可运行但在排队，
+// S/D/D_IOWAIT/OTHER 同切出分类。被 sched_wakeup 唤醒时从睡眠态转入 R
+struct thread_times {
+    __u64 last_ts;  // 进入当前状态的时刻
+    __u64 ns[OFFCPU_STATE_MAX];
+    __u32 tgid;
+    __u8 state;     // 当前状态
+    __u8 _pad[3];
+    char comm[TASK_COMM_LEN];
+};
+
+// rb 提交计数（per-CPU，用户态求和）；pending/last_wakeup_ns 仅供 BPF 侧批量唤醒
+struct rb_stats {
+    __u64 submitted;
+    __u64 dropped; // bpf_ringbuf_reserve 失败（rb 满）
+    __u64 wakeups; // 强制唤醒次数
+    __u64 pending; // 上次唤醒后提交的事件数
+    __u64 last_wakeup_ns;
+};
+
+// dwarf 模式：切出时用户态的寄存器和从 sp 开始的一段栈内存
+struct ustack_snap {
+    __u64 ts_ns; // 对应切出的 start_info.ts_ns，切入时不相等说明不是这一段的
+    __u64 ip;
+    __u64 sp;
+    __u64 bp;
+    __u32 size; // data 中有效字节数，0 表示拷贝失败
+    __u32 _pad;
+    __u8 data[DWARF_STACK_MAX];
+};
+
+// dwarf 模式的 ringbuf 记录：普通 event 后面跟栈快照，用户态按长度区分
+struct dwarf_event {
+    struct event ev;
+    struct ustack_snap snap;
 };
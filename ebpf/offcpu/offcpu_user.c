@@ -1,16 +1,30 @@
 // offcpu_user.c
 #define _GNU_SOURCE
+#include "classify.h"
+#include "consumer.h"
 #include "offcpu.h"
 #include "offcpu.skel.h"
+#include "stack_cache.h"
+#include "syms.h"
+#include "syscall_names.h"
+#include <bpf/bpf.h>
 #include <bpf/libbpf.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fnmatch.h>
 #include <getopt.h>
+#include <limits.h>
+#include <linux/perf_event.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
 static volatile sig_atomic_t exiting;
 
@@ -18,50 +32,1240 @@ static void on_sigint(int signo) { exiting = 1; }
 
 static const struct option long_opts[] = {
     {"threshold", required_argument, NULL, 't'}, // 毫秒
-    {"pid", required_argument, NULL, 'p'},       // 进程 TGID 过滤
+    {"pid", required_argument, NULL, 'p'},       // 进程 TGID 过滤，可逗号分隔/重复
+    {"comm", required_argument, NULL, 'C'},      // 进程名前缀过滤，可重复
+    {"cgroup", required_argument, NULL, 'G'},    // cgroup v2 路径过滤，可重复
+    {"follow", required_argument, NULL, 'L'},    // 按进程名通配跟踪新进程
+    {"pin-filters", required_argument, NULL, 'P'}, // 把过滤 map pin 到目录
     {"sleep", no_argument, NULL, 'S'},           // 仅 sleep
     {"kernel", no_argument, NULL, 'k'},          // 采集内核栈
     {"user", no_argument, NULL, 'u'},            // 采集用户栈
     {"duration", required_argument, NULL, 'd'},  // 运行秒数
+    {"aggregate", no_argument, NULL, 'a'},       // 内核内聚合
+    {"syscall", no_argument, NULL, 's'},         // 按系统调用聚合，不采栈
+    {"interval", required_argument, NULL, 'i'},  // -s/-A 模式打印间隔秒
+    {"hist", no_argument, NULL, 'H'},            // 每个栈一个延迟直方图
+    {"wall", no_argument, NULL, 'W'},            // on-CPU 采样 + off-CPU
+    {"freq", required_argument, NULL, 'F'},      // wall 模式采样频率 Hz
+    {"per-thread", no_argument, NULL, 'T'},      // 聚合按线程区分
+    {"folded", no_argument, NULL, 'f'},          // 输出 folded 栈
+    {"content-stacks", no_argument, NULL, 'c'},  // 内容寻址栈存储
+    {"gc", required_argument, NULL, 'g'},        // -c 模式 GC 间隔秒
+    {"dwarf", required_argument, NULL, 'D'},     // 拷贝用户栈字节数，CFI 回溯
+    {"no-stack-cache", no_argument, NULL, 'N'},  // 每个事件都查 map（对比用）
+    {"workers", required_argument, NULL, 'w'},   // 逐事件模式的处理线程数
+    {"wakeup-batch", required_argument, NULL, 'B'}, // 每 N 个事件唤醒一次
+    {"wakeup-us", required_argument, NULL, 'U'}, // 或距上次唤醒超过 us 微秒
+    {"thread-times", no_argument, NULL, 'A'},    // 按线程统计各状态时长
+    {"futex", no_argument, NULL, 'x'},           // futex 锁竞争，按锁地址聚合
+    {"wakeups", required_argument, NULL, 'K'},   // 唤醒边写到文件
+    {"hist-only", no_argument, NULL, 'O'},       // 只按进程出延迟直方图
+    {"classify", no_argument, NULL, 'y'},        // 内核栈按阻塞类别汇总
+    {"rules", required_argument, NULL, 'r'},     // 追加分类规则文件
     {0, 0, 0, 0}};
 
+// 按状态分桶的总计（事件模式在 handle_event 里累加）
+static __u64 state_total_ns[OFFCPU_STATE_MAX];
+static __u64 state_count[OFFCPU_STATE_MAX];
+
+// -c 模式下栈在 stack_store 里，lookup_stack 改查它
+static int store_fd = -1;
+
 static int lookup_stack(int map_fd, int stack_id, __u64 *buf, int max_depth) {
   if (stack_id < 0)
     return 0;
   __u32 key = stack_id;
-  return bpf_map_lookup_elem(map_fd, &key, buf);
+  if (store_fd < 0)
+    return bpf_map_lookup_elem(map_fd, &key, buf);
+
+  struct stack_entry ent;
+  int err = bpf_map_lookup_elem(store_fd, &key, &ent);
+  if (err)
+    return err;
+  int n = (int)ent.nr < max_depth ? (int)ent.nr : max_depth;
+  memcpy(buf, ent.ips, n * sizeof(__u64));
+  memset(buf + n, 0, (max_depth - n) * sizeof(__u64));
+  return 0;
+}
+
+static int stacks_fd = -1;
+
+static int lookup_stack_cb(void *ctx, int stack_id, uint64_t *ips,
+                           int max_depth) {
+  (void)ctx;
+  return lookup_stack(stacks_fd, stack_id, (__u64 *)ips, max_depth);
+}
+
+static struct consumer main_consumer; // 默认在 poll 线程里直接处理
+static struct consumer_pool pool;      // -w N
+static struct classify_rules *cls_rules; // -y 时加载，各 consumer 共享
+
+// -K 模式：唤醒边写成 TSV，栈在这里就符号化（stack id 离线没有意义），
+// 用 wakegraph 离线做关键路径分析
+static void fold_cached(FILE *out, const struct cached_stack *st, bool kernel,
+                        bool *first) {
+  for (int i = st->nr - 1; i >= 0; i--) { // 从根到叶
+    const struct cached_frame *f = &st->frames[i];
+    fprintf(out, "%s%s%s", *first ? "" : ";", f->name ? f->name : "[unknown]",
+            kernel ? "_[k]" : "");
+    *first = false;
+  }
+}
+
+static void write_stack(struct consumer *c, FILE *out, __u32 tgid,
+                        int ustack_id, int kstack_id) {
+  const struct cached_stack *st;
+  bool first = true;
+  if (ustack_id >= 0 &&
+      (st = stack_cache__get(c->scache, ustack_id, tgid, true)))
+    fold_cached(out, st, false, &first);
+  if (kstack_id >= 0 &&
+      (st = stack_cache__get(c->scache, kstack_id, tgid, false)))
+    fold_cached(out, st, true, &first);
+  if (first)
+    fputc('-', out);
+}
+
+static void write_comm(FILE *out, const char *comm) {
+  for (int i = 0; i < TASK_COMM_LEN && comm[i]; i++)
+    fputc(comm[i] == '\t' ? ' ' : comm[i], out);
+}
+
+static int handle_wakeup(void *ctx, void *data, size_t size) {
+  FILE *out = ctx;
+  const struct wakeup_event *e = data;
+  (void)size;
+  main_consumer.events++;
+  fprintf(out, "%llu\t%u\t%u\t", (unsigned long long)e->ts_ns, e->waker_pid,
+          e->waker_tgid);
+  write_comm(out, e->waker_comm);
+  fprintf(out, "\t%u\t%u\t", e->wakee_pid, e->wakee_tgid);
+  write_comm(out, e->wakee_comm);
+  fprintf(out, "\t%llu\t%s\t", (unsigned long long)e->blocked_ns,
+          state_name(e->wakee_state));
+  write_stack(&main_consumer, out, e->waker_tgid, e->waker_ustack_id,
+              e->waker_kstack_id);
+  fputc('\t', out);
+  write_stack(&main_consumer, out, e->wakee_tgid, e->wakee_ustack_id,
+              e->wakee_kstack_id);
+  fprintf(out, "\t%s\n", e->waker_ctx == WAKER_IRQ         ? "irq"
+                          : e->waker_ctx == WAKER_UNTRACKED ? "untracked"
+                                                            : "task");
+  return 0;
 }
 
 static int handle_event(void *ctx, void *data, size_t size) {
+  consumer__process_event(ctx, data, size);
+  return 0;
+}
+
+// -w 模式的 rb 回调：poll 线程只做拷贝，队列满时等 worker 腾出空间
+// （此时 rb 在内核侧继续缓冲）
+static int dispatch_event(void *ctx, void *data, size_t size) {
+  (void)ctx;
   const struct event *e = data;
-  printf("[%s] tgid=%u tid=%u cpu=%u offcpu=%.3f ms%s\n", e->comm, e->tgid,
-         e->pid, e->cpu, (double)e->delta_ns / 1e6,
-         e->asleep ? " (sleep)" : "");
+  consumer_pool__dispatch(&pool, e->tgid, data, size);
+  return 0;
+}
 
-  int stacks_fd = *(int *)ctx;
-  __u64 pcs[MAX_STACK_DEPTH];
+// exec_rb 的回调：符号缓存按 consumer 各持一份，worker 的那份只能在它自己的
+// 线程里动，通知跟该 tgid 的事件走同一个队列
+static int handle_exec(void *ctx, void *data, size_t size) {
+  (void)ctx;
+  __u32 tgid = *(const __u32 *)data;
+  consumer__forget(&main_consumer, tgid);
+  if (pool.nr_running)
+    consumer_pool__dispatch(&pool, tgid, data, size);
+  return 0;
+}
 
-  if (e->kstack_id >= 0) {
-    if (!lookup_stack(stacks_fd, e->kstack_id, pcs, MAX_STACK_DEPTH)) {
-      printf("  kstack:\n");
-      for (int i = 0; i < MAX_STACK_DEPTH && pcs[i]; i++)
-        printf("    [<%p>] %p\n", (void *)pcs[i], (void *)pcs[i]);
-    } else {
-      printf("  kstack: <lookup failed>\n");
+static void consumer_merge(const struct consumer *c,
+                           struct stack_cache_stats *cst, __u64 *events) {
+  for (int i = 0; i < OFFCPU_STATE_MAX; i++) {
+    state_total_ns[i] += c->state_total_ns[i];
+    state_count[i] += c->state_count[i];
+  }
+  if (c->cls && c != &main_consumer)
+    classifier__merge(main_consumer.cls, c->cls);
+  if (c->scache) {
+    struct stack_cache_stats s;
+    stack_cache__stats(c->scache, &s);
+    cst->hits += s.hits;
+    cst->misses += s.misses;
+    cst->lookup_errs += s.lookup_errs;
+  }
+  *events += c->events;
+}
+
+// 遍历 aggs：打印每个 (tgid, 栈, 状态) 的聚合结果，并累加到状态总计
+static void dump_aggs(int aggs_fd) {
+  struct offcpu_key key, next;
+  struct offcpu_val val;
+  void *prev = NULL;
+
+  while (bpf_map_get_next_key(aggs_fd, prev, &next) == 0) {
+    key = next;
+    prev = &key;
+    if (bpf_map_lookup_elem(aggs_fd, &key, &val))
+      continue;
+    if (key.state < OFFCPU_STATE_MAX) {
+      state_total_ns[key.state] += val.total_ns;
+      state_count[key.state] += val.count;
     }
+    printf("tgid=%u state=%s count=%llu total=%.3f ms\n", key.tgid,
+           state_name(key.state), (unsigned long long)val.count,
+           (double)val.total_ns / 1e6);
+    int cat = consumer__classify(&main_consumer, key.tgid, key.kstack_id,
+                                 key.state, val.total_ns);
+    if (cat >= 0)
+      printf("  category: %s\n", classify_rules__name(cls_rules, cat));
+    consumer__print_stack(&main_consumer, "kstack", key.kstack_id, key.tgid,
+                          false);
+    consumer__print_stack(&main_consumer, "ustack", key.ustack_id, key.tgid,
+                          true);
   }
-  if (e->ustack_id >= 0) {
-    if (!lookup_stack(stacks_fd, e->ustack_id, pcs, MAX_STACK_DEPTH)) {
-      printf("  ustack:\n");
-      for (int i = 0; i < MAX_STACK_DEPTH && pcs[i]; i++)
-        printf("    [<%p>] %p\n", (void *)pcs[i], (void *)pcs[i]);
+}
+
+static const char *syscall_name(int nr, char *buf, size_t len) {
+  switch (nr) {
+  case OFFCPU_SC_NONE:
+    return "[no syscall]";
+  case OFFCPU_SC_FAULT:
+    return "[page fault]";
+  case OFFCPU_SC_KTHREAD:
+    return "[kthread]";
+  }
+  if (nr >= 0 && (size_t)nr < SYSCALL_NAMES_LEN && syscall_names[nr])
+    return syscall_names[nr];
+  snprintf(buf, len, "syscall_%d", nr);
+  return buf;
+}
+
+struct sc_row {
+  struct offcpu_sc_key key;
+  struct offcpu_val val;
+};
+
+// qsort 比较函数里的降序（大的在前）
+static int cmp_desc_u64(__u64 x, __u64 y) {
+  if (x == y)
+    return 0;
+  return x < y ? 1 : -1;
+}
+
+static int cmp_sc_row(const void *a, const void *b) {
+  const struct sc_row *x = a, *y = b;
+  return cmp_desc_u64(x->val.total_ns, y->val.total_ns);
+}
+
+// 读出并删除同一个条目，中间 BPF 累加上去的不会丢；5.14 之前的内核 hash
+// 不支持 lookup_and_delete，退回先读后删
+static int map_take_elem(int fd, const void *key, void *val) {
+  int err = bpf_map_lookup_and_delete_elem(fd, key, val);
+  if (!err || err == -ENOENT)
+    return err;
+  if ((err = bpf_map_lookup_elem(fd, key, val)))
+    return err;
+  bpf_map_delete_elem(fd, key);
+  return 0;
+}
+
+// 读出整个 hash map，*keys/*vals 为两个等长的数组，由调用方 free，返回条数。
+// 先收齐 key 再逐个读值，边遍历边删会让 get_next_key 从头开始；clear 时
+// 每个条目读出即删，下一轮重新累计。val_sz 是一次 lookup 读出的字节数
+// （per-CPU map 为单个值 × CPU 数）
+static size_t collect_map(int fd, size_t key_sz, size_t val_sz, bool clear,
+                          void **keys, void **vals) {
+  size_t cap = 256, nr_keys = 0, n = 0;
+  char *k = malloc(cap * key_sz), *v;
+  while (k) {
+    if (nr_keys == cap) {
+      char *tmp = realloc(k, cap * 2 * key_sz);
+      if (!tmp)
+        break;
+      k = tmp;
+      cap *= 2;
+    }
+    char *next = k + nr_keys * key_sz;
+    if (bpf_map_get_next_key(fd, nr_keys ? next - key_sz : NULL, next))
+      break;
+    nr_keys++;
+  }
+  v = malloc((nr_keys ? nr_keys : 1) * val_sz);
+  if (!k || !v) {
+    perror("malloc");
+    free(k);
+    free(v);
+    *keys = *vals = NULL;
+    return 0;
+  }
+  for (size_t i = 0; i < nr_keys; i++) {
+    char *key = k + i * key_sz, *val = v + n * val_sz;
+    if (clear ? map_take_elem(fd, key, val)
+              : bpf_map_lookup_elem(fd, key, val))
+      continue;
+    memmove(k + n * key_sz, key, key_sz);
+    n++;
+  }
+  *keys = k;
+  *vals = v;
+  return n;
+}
+
+// 打印 sc_aggs（按总时长降序）；clear 时读完即删，下一轮重新累计
+static void dump_sc_aggs(int fd, int clear) {
+  struct offcpu_sc_key *keys;
+  struct offcpu_val *vals;
+  size_t n = collect_map(fd, sizeof(*keys), sizeof(*vals), clear,
+                         (void **)&keys, (void **)&vals);
+  struct sc_row *rows = calloc(n ? n : 1, sizeof(*rows));
+  if (!rows) {
+    perror("calloc");
+    n = 0;
+  }
+  for (size_t i = 0; rows && i < n; i++) {
+    rows[i].key = keys[i];
+    rows[i].val = vals[i];
+  }
+  free(keys);
+  free(vals);
+
+  qsort(rows, n, sizeof(*rows), cmp_sc_row);
+  printf("\n%-8s %-24s %10s %14s %12s\n", "TGID", "SYSCALL", "COUNT",
+         "TOTAL(ms)", "AVG(us)");
+  for (size_t i = 0; i < n; i++) {
+    char buf[32];
+    const struct sc_row *r = &rows[i];
+    printf("%-8u %-24s %10llu %14.3f %12.1f\n", r->key.tgid,
+           syscall_name(r->key.syscall, buf, sizeof(buf)),
+           (unsigned long long)r->val.count, (double)r->val.total_ns / 1e6,
+           r->val.count ? (double)r->val.total_ns / r->val.count / 1e3 : 0.0);
+  }
+  fflush(stdout);
+  free(rows);
+}
+
+// log2(us) 直方图，格式同 runqlat
+static void print_log2_hist(const __u64 *slots, int nslots, const char *indent) {
+  __u64 peak = 0;
+  int last = -1;
+  for (int i = 0; i < nslots; i++) {
+    if (slots[i] > peak)
+      peak = slots[i];
+    if (slots[i])
+      last = i;
+  }
+  for (int i = 0; i <= last; i++) {
+    unsigned long long lo = (i == 0) ? 0ull : (1ull << i);
+    unsigned long long hi = (1ull << (i + 1));
+    int bars = peak ? (int)(slots[i] * 30 / peak) : 0;
+    if (bars < 1 && slots[i])
+      bars = 1;
+    printf("%s%8llu - %-8llu us : %-8llu | ", indent, lo, hi,
+           (unsigned long long)slots[i]);
+    for (int b = 0; b < bars; b++)
+      putchar('#');
+    putchar('\n');
+  }
+}
+
+struct hist_row {
+  struct offcpu_key key;
+  struct offcpu_hist_val val;
+};
+
+static int cmp_hist_row(const void *a, const void *b) {
+  const struct hist_row *x = a, *y = b;
+  return cmp_desc_u64(x->val.total_ns, y->val.total_ns);
+}
+
+// 打印 hist_aggs：按总时长降序，每个栈给出次数/总计/最大值和分布
+static void dump_hist_aggs(int fd) {
+  struct offcpu_key *keys;
+  struct offcpu_hist_val *vals;
+  size_t n = collect_map(fd, sizeof(*keys), sizeof(*vals), false,
+                         (void **)&keys, (void **)&vals);
+  struct hist_row *rows = calloc(n ? n : 1, sizeof(*rows));
+  if (!rows) {
+    perror("calloc");
+    n = 0;
+  }
+  for (size_t i = 0; rows && i < n; i++) {
+    rows[i].key = keys[i];
+    rows[i].val = vals[i];
+  }
+  free(keys);
+  free(vals);
+
+  qsort(rows, n, sizeof(*rows), cmp_hist_row);
+  for (size_t i = 0; i < n; i++) {
+    const struct hist_row *r = &rows[i];
+    if (r->key.state < OFFCPU_STATE_MAX) {
+      state_total_ns[r->key.state] += r->val.total_ns;
+      state_count[r->key.state] += r->val.count;
+    }
+    printf("\ntgid=%u state=%s count=%llu total=%.3f ms avg=%.3f ms "
+           "max=%.3f ms\n",
+           r->key.tgid, state_name(r->key.state),
+           (unsigned long long)r->val.count, (double)r->val.total_ns / 1e6,
+           r->val.count ? (double)r->val.total_ns / r->val.count / 1e6 : 0.0,
+           (double)r->val.max_ns / 1e6);
+    int cat = consumer__classify(&main_consumer, r->key.tgid, r->key.kstack_id,
+                                 r->key.state, r->val.total_ns);
+    if (cat >= 0)
+      printf("  category: %s\n", classify_rules__name(cls_rules, cat));
+    consumer__print_stack(&main_consumer, "kstack", r->key.kstack_id,
+                          r->key.tgid, false);
+    consumer__print_stack(&main_consumer, "ustack", r->key.ustack_id,
+                          r->key.tgid, true);
+    print_log2_hist(r->val.slots, OFFCPU_HIST_SLOTS, "    ");
+  }
+  free(rows);
+}
+
+// 从 log2 直方图估算百分位（桶内线性插值），单位 ns
+static double hist_percentile(const __u64 *slots, __u64 count, double pct) {
+  if (!count)
+    return 0;
+  double target = count * pct, cum = 0;
+  for (int i = 0; i < OFFCPU_HIST_SLOTS; i++) {
+    if (!slots[i])
+      continue;
+    if (cum + slots[i] >= target) {
+      double lo = i ? (double)(1ull << i) : 0, hi = (double)(1ull << (i + 1));
+      return (lo + (hi - lo) * (target - cum) / slots[i]) * 1000;
+    }
+    cum += slots[i];
+  }
+  return (double)(1ull << OFFCPU_HIST_SLOTS) * 1000;
+}
+
+// -x 模式：futex_aggs 按 (tgid, 锁地址, 用户栈)；报告时先按锁合并，
+// 锁按总等待时长排序，每把锁下列出等待最多的几个调用栈
+struct futex_row {
+  struct futex_key key;
+  struct offcpu_hist_val val;
+};
+
+struct lock_row {
+  __u32 tgid;
+  __u64 uaddr;
+  struct offcpu_hist_val val;
+  size_t first, nr; // 在排序后 futex_row 数组里的区间
+};
+
+#define FUTEX_TOP_LOCKS 20
+#define FUTEX_TOP_STACKS 3
+
+static int cmp_futex_row(const void *a, const void *b) {
+  const struct futex_row *x = a, *y = b;
+  if (x->key.tgid != y->key.tgid)
+    return x->key.tgid < y->key.tgid ? -1 : 1;
+  if (x->key.uaddr != y->key.uaddr)
+    return x->key.uaddr < y->key.uaddr ? -1 : 1;
+  return cmp_desc_u64(x->val.total_ns, y->val.total_ns);
+}
+
+static int cmp_lock_row(const void *a, const void *b) {
+  const struct lock_row *x = a, *y = b;
+  return cmp_desc_u64(x->val.total_ns, y->val.total_ns);
+}
+
+// 锁地址 -> 变量名+偏移 [模块]；堆上的锁只能给出 [heap] 之类的映射名
+static void format_lock(char *buf, size_t len, __u32 tgid, __u64 uaddr) {
+  struct sym_info si;
+  if (syms_cache__map_data(main_consumer.usyms, (int)tgid, uaddr, &si)) {
+    snprintf(buf, len, "0x%llx", (unsigned long long)uaddr);
+    return;
+  }
+  const char *mod = strrchr(si.module, '/');
+  mod = mod ? mod + 1 : si.module;
+  if (si.name)
+    snprintf(buf, len, "%s+0x%llx [%s]", si.name,
+             (unsigned long long)si.offset, mod);
+  else
+    snprintf(buf, len, "0x%llx [%s]", (unsigned long long)uaddr, mod);
+}
+
+static void dump_futex_aggs(int fd) {
+  struct futex_key *keys;
+  struct offcpu_hist_val *vals;
+  size_t n = collect_map(fd, sizeof(*keys), sizeof(*vals), false,
+                         (void **)&keys, (void **)&vals);
+  size_t nr_locks = 0;
+  struct futex_row *rows = calloc(n ? n : 1, sizeof(*rows));
+  struct lock_row *locks = NULL;
+  if (!rows) {
+    perror("calloc");
+    n = 0;
+  }
+  for (size_t i = 0; rows && i < n; i++) {
+    rows[i].key = keys[i];
+    rows[i].val = vals[i];
+  }
+  free(keys);
+  free(vals);
+  qsort(rows, n, sizeof(*rows), cmp_futex_row);
+
+  locks = calloc(n ? n : 1, sizeof(*locks));
+  if (!locks) {
+    free(rows);
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    struct lock_row *l = nr_locks ? &locks[nr_locks - 1] : NULL;
+    if (!l || l->tgid != rows[i].key.tgid || l->uaddr != rows[i].key.uaddr) {
+      l = &locks[nr_locks++];
+      l->tgid = rows[i].key.tgid;
+      l->uaddr = rows[i].key.uaddr;
+      l->first = i;
+    }
+    l->nr++;
+    l->val.total_ns += rows[i].val.total_ns;
+    l->val.count += rows[i].val.count;
+    if (rows[i].val.max_ns > l->val.max_ns)
+      l->val.max_ns = rows[i].val.max_ns;
+    for (int s = 0; s < OFFCPU_HIST_SLOTS; s++)
+      l->val.slots[s] += rows[i].val.slots[s];
+  }
+  qsort(locks, nr_locks, sizeof(*locks), cmp_lock_row);
+
+  printf("%zu locks, %zu (lock, stack) pairs\n", nr_locks, n);
+  for (size_t i = 0; i < nr_locks && i < FUTEX_TOP_LOCKS; i++) {
+    const struct lock_row *l = &locks[i];
+    char name[256];
+    format_lock(name, sizeof(name), l->tgid, l->uaddr);
+    printf("\n#%zu tgid=%u lock=%s\n", i + 1, l->tgid, name);
+    printf("    waits=%llu total=%.3f ms avg=%.3f ms p50=%.3f p90=%.3f "
+           "p99=%.3f max=%.3f ms\n",
+           (unsigned long long)l->val.count, l->val.total_ns / 1e6,
+           l->val.count ? l->val.total_ns / 1e6 / l->val.count : 0.0,
+           hist_percentile(l->val.slots, l->val.count, 0.50) / 1e6,
+           hist_percentile(l->val.slots, l->val.count, 0.90) / 1e6,
+           hist_percentile(l->val.slots, l->val.count, 0.99) / 1e6,
+           l->val.max_ns / 1e6);
+    for (size_t j = 0; j < l->nr && j < FUTEX_TOP_STACKS; j++) {
+      const struct futex_row *r = &rows[l->first + j];
+      printf("  waiter stack %zu/%zu: waits=%llu total=%.3f ms\n", j + 1,
+             l->nr, (unsigned long long)r->val.count, r->val.total_ns / 1e6);
+      if (r->key.ustack_id < 0 ||
+          consumer__print_stack(&main_consumer, "ustack", r->key.ustack_id,
+                                r->key.tgid, true))
+        printf("    <no stack>\n");
+    }
+  }
+  free(locks);
+  free(rows);
+}
+
+// -A 模式：thread_times 里是各线程自加载以来的累计值，每个周期批量读一次，
+// 和上个周期的快照相减
+struct tt_row {
+  __u32 tid;
+  struct thread_times v;
+  __u64 ns[OFFCPU_STATE_MAX]; // 本周期增量
+  __u64 wall_ns;
+  __u64 wait_ns; // 除 on-CPU 外的所有状态
+};
+
+static struct tt_row *tt_prev;
+static size_t tt_prev_n;
+
+#define TT_BATCH 4096
+#define TT_TOP 30
+
+static int cmp_tt_tid(const void *a, const void *b) {
+  const struct tt_row *x = a, *y = b;
+  return x->tid < y->tid ? -1 : x->tid > y->tid;
+}
+
+static int cmp_tt_wait(const void *a, const void *b) {
+  const struct tt_row *x = a, *y = b;
+  if (x->wait_ns != y->wait_ns)
+    return x->wait_ns < y->wait_ns ? 1 : -1;
+  __u64 xb = x->ns[OFFCPU_R] + x->ns[OFFCPU_D] + x->ns[OFFCPU_D_IOWAIT];
+  __u64 yb = y->ns[OFFCPU_R] + y->ns[OFFCPU_D] + y->ns[OFFCPU_D_IOWAIT];
+  return xb < yb ? 1 : xb > yb ? -1 : 0;
+}
+
+static size_t read_thread_times(int fd, struct tt_row **out) {
+  __u32 keys[TT_BATCH], token;
+  struct thread_times vals[TT_BATCH];
+  struct tt_row *rows = NULL;
+  size_t n = 0, cap = 0;
+  void *in = NULL;
+  int err = 0;
+
+  while (!err) {
+    __u32 count = TT_BATCH;
+    err = bpf_map_lookup_batch(fd, in, &token, keys, vals, &count, NULL);
+    if (err && err != -ENOENT)
+      break;
+    if (n + count > cap) {
+      size_t ncap = cap ? cap * 2 : TT_BATCH;
+      while (ncap < n + count)
+        ncap *= 2;
+      struct tt_row *tmp = realloc(rows, ncap * sizeof(*rows));
+      if (!tmp)
+        break;
+      rows = tmp;
+      cap = ncap;
+    }
+    for (__u32 i = 0; i < count; i++) {
+      rows[n].tid = keys[i];
+      rows[n].v = vals[i];
+      n++;
+    }
+    in = &token;
+  }
+  *out = rows;
+  return n;
+}
+
+static void dump_thread_times(int fd) {
+  struct tt_row *rows;
+  size_t n = read_thread_times(fd, &rows);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts); // 与 bpf_ktime_get_ns 同一时钟
+  __u64 now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  qsort(rows, n, sizeof(*rows), cmp_tt_tid);
+  size_t shown = 0, dominated = 0;
+  for (size_t i = 0; i < n; i++) {
+    struct tt_row *r = &rows[i];
+    // 线程还停在当前状态里：把这段未结算的时间补上
+    if (r->v.state < OFFCPU_STATE_MAX && now > r->v.last_ts)
+      r->v.ns[r->v.state] += now - r->v.last_ts;
+    struct tt_row key = {.tid = r->tid};
+    const struct tt_row *p =
+        tt_prev ? bsearch(&key, tt_prev, tt_prev_n, sizeof(key), cmp_tt_tid)
+                : NULL;
+    if (p && p->v.tgid != r->v.tgid)
+      p = NULL; // tid 被复用
+    r->wall_ns = r->wait_ns = 0;
+    for (int s = 0; s < OFFCPU_STATE_MAX; s++) {
+      __u64 before = p && p->v.ns[s] <= r->v.ns[s] ? p->v.ns[s] : 0;
+      r->ns[s] = r->v.ns[s] - before;
+      r->wall_ns += r->ns[s];
+      if (s != OFFCPU_ONCPU)
+        r->wait_ns += r->ns[s];
+    }
+  }
+  free(tt_prev);
+  tt_prev = malloc(n * sizeof(*rows));
+  tt_prev_n = tt_prev ? n : 0;
+  if (tt_prev)
+    memcpy(tt_prev, rows, n * sizeof(*rows));
+
+  qsort(rows, n, sizeof(*rows), cmp_tt_wait);
+  printf("\n%-7s %-7s %-16s %10s %6s %6s %6s %6s %7s\n", "TGID", "TID",
+         "COMM", "WALL(ms)", "CPU%", "RUNQ%", "SLEEP%", "D%", "IOWAIT%");
+  for (size_t i = 0; i < n; i++) {
+    const struct tt_row *r = &rows[i];
+    // 只列等待时间占一半以上的线程
+    if (!r->wall_ns || r->wait_ns * 2 <= r->wall_ns)
+      continue;
+    dominated++;
+    if (shown >= TT_TOP)
+      continue;
+    shown++;
+    double w = r->wall_ns / 100.0;
+    printf("%-7u %-7u %-16s %10.1f %6.1f %6.1f %6.1f %6.1f %7.1f\n",
+           r->v.tgid, r->tid, r->v.comm, r->wall_ns / 1e6,
+           r->ns[OFFCPU_ONCPU] / w, r->ns[OFFCPU_R] / w,
+           (r->ns[OFFCPU_S] + r->ns[OFFCPU_OTHER]) / w, r->ns[OFFCPU_D] / w,
+           r->ns[OFFCPU_D_IOWAIT] / w);
+  }
+  printf("%zu threads, %zu wait-dominated\n", n, dominated);
+  fflush(stdout);
+  free(rows);
+}
+
+static void read_comm(__u32 tgid, __u32 pid, char *buf, size_t len) {
+  char path[64];
+  if (pid)
+    snprintf(path, sizeof(path), "/proc/%u/task/%u/comm", tgid, pid);
+  else
+    snprintf(path, sizeof(path), "/proc/%u/comm", tgid);
+  FILE *f = fopen(path, "r");
+  if (!f || !fgets(buf, (int)len, f))
+    snprintf(buf, len, "[%u]", tgid); // 进程已退出
+  else
+    buf[strcspn(buf, "\n")] = '\0';
+  if (f)
+    fclose(f);
+  // folded 格式里 ';' 是分隔符，空格会被 flamegraph.pl 当作数值分隔
+  for (char *c = buf; *c; c++)
+    if (*c == ';' || *c == ' ')
+      *c = '_';
+}
+
+// -O 模式：tgid_hists 是 per-CPU 的，读出来按 CPU 求和，
+// 每个 (tgid, 睡眠/被抢占) 打印一个 log2 分布
+struct tgid_hist_row {
+  struct hist_only_key key;
+  __u64 count;
+  __u64 slots[OFFCPU_HIST_SLOTS];
+};
+
+static int cmp_tgid_hist_row(const void *a, const void *b) {
+  const struct tgid_hist_row *x = a, *y = b;
+  if (x->count != y->count)
+    return cmp_desc_u64(x->count, y->count);
+  if (x->key.tgid != y->key.tgid)
+    return x->key.tgid < y->key.tgid ? -1 : 1;
+  return x->key.preempted < y->key.preempted ? -1 : 1;
+}
+
+static void dump_tgid_hists(int fd, int clear) {
+  int ncpus = libbpf_num_possible_cpus();
+  if (ncpus <= 0)
+    return;
+  struct hist_only_key *keys;
+  struct offcpu_log2_hist *vals;
+  size_t n = collect_map(fd, sizeof(*keys), ncpus * sizeof(*vals), clear,
+                         (void **)&keys, (void **)&vals);
+  struct tgid_hist_row *rows = calloc(n ? n : 1, sizeof(*rows));
+  if (!rows) {
+    perror("calloc");
+    n = 0;
+  }
+  for (size_t k = 0; rows && k < n; k++) {
+    struct tgid_hist_row *r = &rows[k];
+    r->key = keys[k];
+    for (int c = 0; c < ncpus; c++)
+      for (int i = 0; i < OFFCPU_HIST_SLOTS; i++)
+        r->slots[i] += vals[k * ncpus + c].slots[i];
+    for (int i = 0; i < OFFCPU_HIST_SLOTS; i++)
+      r->count += r->slots[i];
+  }
+  free(keys);
+  free(vals);
+
+  qsort(rows, n, sizeof(*rows), cmp_tgid_hist_row);
+  for (size_t i = 0; i < n; i++) {
+    const struct tgid_hist_row *r = &rows[i];
+    char comm[TASK_COMM_LEN];
+    read_comm(r->key.tgid, 0, comm, sizeof(comm));
+    printf("\ntgid = %u %s %s count = %llu\n", r->key.tgid, comm,
+           r->key.preempted ? "preempted" : "sleep",
+           (unsigned long long)r->count);
+    print_log2_hist(r->slots, OFFCPU_HIST_SLOTS, "");
+  }
+  if (!n)
+    printf("no off-CPU events\n");
+  fflush(stdout);
+  free(rows);
+}
+
+static void fold_ustack(FILE *out, struct syms_cache *usyms, __u32 tgid,
+                        const __u64 *pcs) {
+  int depth = 0;
+  while (depth < MAX_STACK_DEPTH && pcs[depth])
+    depth++;
+  for (int i = depth - 1; i >= 0; i--) { // folded 从根到叶
+    struct sym_info si;
+    if (syms_cache__map_addr(usyms, (int)tgid, pcs[i], &si)) {
+      fprintf(out, ";[unknown]");
+    } else if (si.name) {
+      fprintf(out, ";%s", si.name);
     } else {
-      printf("  ustack: <lookup failed>\n");
+      const char *base = strrchr(si.module, '/');
+      fprintf(out, ";%s+0x%llx", base ? base + 1 : si.module,
+              (unsigned long long)si.offset);
+    }
+  }
+}
+
+static void fold_kstack(FILE *out, const struct ksyms *ksyms,
+                        const __u64 *pcs) {
+  int depth = 0;
+  while (depth < MAX_STACK_DEPTH && pcs[depth])
+    depth++;
+  for (int i = depth - 1; i >= 0; i--) {
+    const struct ksym *ks = ksyms__map_addr(ksyms, pcs[i]);
+    fprintf(out, ";%s_[k]", ks ? ks->name : "[unknown]");
+  }
+}
+
+// 把 aggs 输出为 folded 栈（flamegraph.pl 输入）：
+//   comm[-tid];用户栈...;内核栈..._[k];[on-cpu|off-cpu:S] 微秒
+// 叶子上的标签帧区分同一调用路径的 on-CPU 与各类 off-CPU 时间
+static void dump_folded(FILE *out, int aggs_fd, int stacks_fd,
+                        const struct ksyms *ksyms, struct syms_cache *usyms) {
+  struct offcpu_key key, next;
+  struct offcpu_val val;
+  __u64 pcs[MAX_STACK_DEPTH];
+  void *prev = NULL;
+
+  while (bpf_map_get_next_key(aggs_fd, prev, &next) == 0) {
+    key = next;
+    prev = &key;
+    if (bpf_map_lookup_elem(aggs_fd, &key, &val))
+      continue;
+    if (key.state < OFFCPU_STATE_MAX) {
+      state_total_ns[key.state] += val.total_ns;
+      state_count[key.state] += val.count;
+    }
+    consumer__classify(&main_consumer, key.tgid, key.kstack_id, key.state,
+                       val.total_ns);
+    __u64 us = val.total_ns / 1000;
+    if (!us)
+      continue;
+
+    char comm[TASK_COMM_LEN + 16];
+    read_comm(key.tgid, key.pid, comm, sizeof(comm));
+    if (key.pid)
+      fprintf(out, "%s-%u", comm, key.pid);
+    else
+      fprintf(out, "%s", comm);
+
+    if (key.ustack_id >= 0 &&
+        !lookup_stack(stacks_fd, key.ustack_id, pcs, MAX_STACK_DEPTH))
+      fold_ustack(out, usyms, key.tgid, pcs);
+    if (key.kstack_id >= 0 &&
+        !lookup_stack(stacks_fd, key.kstack_id, pcs, MAX_STACK_DEPTH))
+      fold_kstack(out, ksyms, pcs);
+
+    if (key.state == OFFCPU_ONCPU)
+      fprintf(out, ";[on-cpu] %llu\n", (unsigned long long)us);
+    else
+      fprintf(out, ";[off-cpu:%s] %llu\n", state_name(key.state),
+              (unsigned long long)us);
+  }
+}
+
+// 每个 CPU 打开一个软件 CPU clock 事件并挂上 on_cpu_sample，无需硬件 PMU
+static int attach_cpu_clock(struct bpf_program *prog, int freq,
+                            struct bpf_link ***links_out, int *nr_out) {
+  int ncpu = libbpf_num_possible_cpus();
+  if (ncpu <= 0)
+    return -EINVAL;
+  struct bpf_link **links = calloc(ncpu, sizeof(*links));
+  if (!links)
+    return -ENOMEM;
+
+  struct perf_event_attr attr = {
+      .type = PERF_TYPE_SOFTWARE,
+      .config = PERF_COUNT_SW_CPU_CLOCK,
+      .size = sizeof(attr),
+      .freq = 1,
+      .sample_freq = freq,
+  };
+  for (int cpu = 0; cpu < ncpu; cpu++) {
+    int fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1,
+                     PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) {
+      if (errno == ENODEV) // 不在线的 CPU
+        continue;
+      fprintf(stderr, "perf_event_open(cpu %d): %s\n", cpu, strerror(errno));
+      *links_out = links;
+      *nr_out = cpu;
+      return -errno;
+    }
+    links[cpu] = bpf_program__attach_perf_event(prog, fd);
+    if (!links[cpu]) {
+      fprintf(stderr, "attach perf_event(cpu %d) failed\n", cpu);
+      close(fd);
+      *links_out = links;
+      *nr_out = cpu;
+      return -EINVAL;
+    }
+  }
+  *links_out = links;
+  *nr_out = ncpu;
+  return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  __u32 x = *(const __u32 *)a, y = *(const __u32 *)b;
+  return x < y ? -1 : x > y;
+}
+
+// 引用 stack id 的 map：id 字段在 key 里（聚合 map）或 value 里（starts 这类
+// 进行中的记录），off 为字段偏移，-1 表示没有这个字段
+struct stack_ref_map {
+  int fd;
+  size_t key_size, value_size;
+  bool in_value;
+  int koff, uoff;
+};
+
+static void add_ref(__u32 **ids, size_t *n, size_t *cap, const char *rec,
+                    int off) {
+  int id;
+  if (off < 0)
+    return;
+  memcpy(&id, rec + off, sizeof(id));
+  if (id < 0)
+    return;
+  if (*n == *cap) {
+    size_t ncap = *cap ? *cap * 2 : 1024;
+    __u32 *tmp = realloc(*ids, ncap * sizeof(*tmp));
+    if (!tmp)
+      return;
+    *ids = tmp;
+    *cap = ncap;
+  }
+  (*ids)[(*n)++] = id;
+}
+
+// 收集 map 里仍被引用的 stack id，GC 时不能删
+static void collect_stack_refs(const struct stack_ref_map *m, __u32 **ids,
+                               size_t *n, size_t *cap) {
+  char *key = malloc(m->key_size), *next = malloc(m->key_size);
+  char *val = malloc(m->value_size);
+  void *prev = NULL;
+  while (key && next && val && bpf_map_get_next_key(m->fd, prev, next) == 0) {
+    memcpy(key, next, m->key_size);
+    prev = key;
+    const char *rec = key;
+    if (m->in_value) {
+      if (bpf_map_lookup_elem(m->fd, key, val))
+        continue;
+      rec = val;
+    }
+    add_ref(ids, n, cap, rec, m->koff);
+    add_ref(ids, n, cap, rec, m->uoff);
+  }
+  free(key);
+  free(next);
+  free(val);
+}
+
+// 把 rb 里和 worker 队列里已提交的事件处理完：它们的 start 已经删掉，
+// 引用的 id 不在任何 map 里
+static void drain_events(struct ring_buffer *rb) {
+  ring_buffer__consume(rb);
+  consumer_pool__wait_idle(&pool);
+}
+
+// 删除 ttl 内没被命中、且不再被引用的栈；返回释放条数。
+// 引用来自聚合 map 和进行中的记录（starts、futex_starts）：先收集引用，再把
+// 收集前已经出队的事件处理完，之后出队的事件引用的 id 都在收集到的集合里
+static size_t gc_stack_store(struct offcpu_bpf *skel, struct ring_buffer *rb,
+                             __u64 ttl_ns) {
+  int fd = bpf_map__fd(skel->maps.stack_store);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts); // 与 bpf_ktime_get_ns 同一时钟
+  __u64 now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  const struct stack_ref_map maps[] = {
+      {bpf_map__fd(skel->maps.aggs), sizeof(struct offcpu_key),
+       sizeof(struct offcpu_val), false, offsetof(struct offcpu_key, kstack_id),
+       offsetof(struct offcpu_key, ustack_id)},
+      {bpf_map__fd(skel->maps.hist_aggs), sizeof(struct offcpu_key),
+       sizeof(struct offcpu_hist_val), false,
+       offsetof(struct offcpu_key, kstack_id),
+       offsetof(struct offcpu_key, ustack_id)},
+      {bpf_map__fd(skel->maps.starts), sizeof(__u32),
+       sizeof(struct start_info), true, offsetof(struct start_info, kstack_id),
+       offsetof(struct start_info, ustack_id)},
+      {bpf_map__fd(skel->maps.futex_aggs), sizeof(struct futex_key),
+       sizeof(struct offcpu_hist_val), false, -1,
+       offsetof(struct futex_key, ustack_id)},
+      {bpf_map__fd(skel->maps.futex_starts), sizeof(__u32),
+       sizeof(struct futex_start), true, -1,
+       offsetof(struct futex_start, ustack_id)},
+  };
+  __u32 *refs = NULL;
+  size_t nrefs = 0, cap = 0;
+  for (size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++)
+    collect_stack_refs(&maps[i], &refs, &nrefs, &cap);
+  drain_events(rb);
+  qsort(refs, nrefs, sizeof(*refs), cmp_u32);
+
+  __u32 key, next, *victims = NULL;
+  size_t nvict = 0, vcap = 0;
+  struct stack_entry ent;
+  void *prev = NULL;
+  while (bpf_map_get_next_key(fd, prev, &next) == 0) {
+    key = next;
+    prev = &key;
+    if (bpf_map_lookup_elem(fd, &key, &ent))
+      continue;
+    if (now < ent.last_seen_ns + ttl_ns)
+      continue;
+    if (nrefs && bsearch(&key, refs, nrefs, sizeof(*refs), cmp_u32))
+      continue;
+    if (nvict == vcap) {
+      size_t ncap = vcap ? vcap * 2 : 256;
+      __u32 *tmp = realloc(victims, ncap * sizeof(*tmp));
+      if (!tmp)
+        break;
+      victims = tmp;
+      vcap = ncap;
+    }
+    victims[nvict++] = key;
+  }
+  // 遍历完再删，避免 get_next_key 在删除后从头开始
+  size_t freed = 0;
+  for (size_t i = 0; i < nvict; i++)
+    freed += bpf_map_delete_elem(fd, &victims[i]) == 0;
+  free(victims);
+  free(refs);
+  return freed;
+}
+
+static void print_stack_stats(FILE *out, int stats_fd, size_t gc_freed) {
+  int ncpu = libbpf_num_possible_cpus();
+  if (ncpu <= 0)
+    return;
+  struct stack_stats *pcpu = calloc(ncpu, sizeof(*pcpu));
+  struct stack_stats total = {};
+  __u32 key = 0;
+  if (!pcpu)
+    return;
+  if (!bpf_map_lookup_elem(stats_fd, &key, pcpu)) {
+    for (int c = 0; c < ncpu; c++) {
+      total.stored += pcpu[c].stored;
+      total.hits += pcpu[c].hits;
+      total.collisions += pcpu[c].collisions;
+      total.dropped += pcpu[c].dropped;
+      total.errors += pcpu[c].errors;
+    }
+  }
+  fprintf(out,
+          "\nstacks: stored=%llu hits=%llu collisions=%llu dropped=%llu "
+          "errors=%llu gc_freed=%zu\n",
+          (unsigned long long)total.stored, (unsigned long long)total.hits,
+          (unsigned long long)total.collisions,
+          (unsigned long long)total.dropped, (unsigned long long)total.errors,
+          gc_freed);
+  free(pcpu);
+}
+
+// rb 的提交/丢弃/唤醒次数，以及用户态实际处理的事件速率
+static void print_rb_stats(FILE *out, int stats_fd, __u64 consumed,
+                           double secs) {
+  int ncpu = libbpf_num_possible_cpus();
+  if (ncpu <= 0)
+    return;
+  struct rb_stats *pcpu = calloc(ncpu, sizeof(*pcpu));
+  struct rb_stats total = {};
+  __u32 key = 0;
+  if (!pcpu)
+    return;
+  if (!bpf_map_lookup_elem(stats_fd, &key, pcpu)) {
+    for (int c = 0; c < ncpu; c++) {
+      total.submitted += pcpu[c].submitted;
+      total.dropped += pcpu[c].dropped;
+      total.wakeups += pcpu[c].wakeups;
+    }
+  }
+  fprintf(out,
+          "ringbuf: submitted=%llu dropped=%llu wakeups=%llu consumed=%llu "
+          "(%.0f events/s)\n",
+          (unsigned long long)total.submitted,
+          (unsigned long long)total.dropped, (unsigned long long)total.wakeups,
+          (unsigned long long)consumed, secs > 0 ? consumed / secs : 0.0);
+  free(pcpu);
+}
+
+// 按状态打印 off-CPU 时间占比，区分 S / D / D+iowait
+static void print_state_summary(FILE *out) {
+  __u64 grand = 0;
+  for (int i = 0; i < OFFCPU_STATE_MAX; i++)
+    grand += state_total_ns[i];
+
+  fprintf(out, "\n%-10s %10s %14s %7s\n", "state", "count", "total(ms)",
+          "pct");
+  for (int i = 0; i < OFFCPU_STATE_MAX; i++) {
+    fprintf(out, "%-10s %10llu %14.3f %6.1f%%\n", state_name(i),
+            (unsigned long long)state_count[i],
+            (double)state_total_ns[i] / 1e6,
+            grand ? state_total_ns[i] * 100.0 / grand : 0.0);
+  }
+}
+
+static void tgid_comm(uint32_t tgid, char *buf, size_t len) {
+  read_comm(tgid, 0, buf, len);
+}
+
+// -y 模式：各 consumer 已并进 main_consumer
+static void print_categories(FILE *out) {
+  uint64_t hits, misses;
+  classifier__print(main_consumer.cls, out, tgid_comm, 0);
+  classifier__stats(main_consumer.cls, &hits, &misses);
+  fprintf(out, "classify cache: hits=%llu misses=%llu\n",
+          (unsigned long long)hits, (unsigned long long)misses);
+}
+
+// 过滤条件：命令行给出的部分在加载后写进 filter_* map；
+// filter_tgids 的 value 区分来源，--follow 只增删自己加的条目
+#define MAX_FILTERS 64
+#define FILTER_EXPLICIT 1
+#define FILTER_FOLLOWED 2
+
+struct filter_args {
+  __u32 tgids[MAX_FILTERS];
+  int nr_tgids;
+  __u64 cgroups[MAX_FILTERS];
+  int nr_cgroups;
+  const char *comms[MAX_FILTERS];
+  int nr_comms;
+  const char *follow; // fnmatch 通配，匹配 /proc/<pid>/comm
+  const char *pin_dir;
+};
+
+static int parse_tgids(struct filter_args *fa, char *arg) {
+  char *save = NULL;
+  for (char *tok = strtok_r(arg, ",", &save); tok;
+       tok = strtok_r(NULL, ",", &save)) {
+    if (fa->nr_tgids == MAX_FILTERS)
+      return -E2BIG;
+    __u32 tgid = strtoul(tok, NULL, 10);
+    if (!tgid)
+      return -EINVAL;
+    fa->tgids[fa->nr_tgids++] = tgid;
+  }
+  return 0;
+}
+
+// cgroup v2 的 id 就是 cgroupfs 里对应目录的 inode 号；相对路径按
+// /sys/fs/cgroup 解析，比如 system.slice/nginx.service
+static int parse_cgroup(struct filter_args *fa, const char *arg) {
+  char path[PATH_MAX];
+  struct stat st;
+  if (fa->nr_cgroups == MAX_FILTERS)
+    return -E2BIG;
+  if (arg[0] == '/')
+    snprintf(path, sizeof(path), "%s", arg);
+  else
+    snprintf(path, sizeof(path), "/sys/fs/cgroup/%s", arg);
+  if (stat(path, &st) || !S_ISDIR(st.st_mode))
+    return -ENOENT;
+  fa->cgroups[fa->nr_cgroups++] = st.st_ino;
+  return 0;
+}
+
+static int add_comm_prefix(int fd, const char *prefix) {
+  struct comm_lpm_key key = {};
+  __u8 one = 1;
+  size_t len = strnlen(prefix, TASK_COMM_LEN - 1);
+  key.prefixlen = len * 8;
+  memcpy(key.comm, prefix, len);
+  return bpf_map_update_elem(fd, &key, &one, BPF_ANY);
+}
+
+static int setup_filters(struct offcpu_bpf *skel, const struct filter_args *fa) {
+  int tgid_fd = bpf_map__fd(skel->maps.filter_tgids);
+  int cg_fd = bpf_map__fd(skel->maps.filter_cgroups);
+  int comm_fd = bpf_map__fd(skel->maps.filter_comms);
+  __u8 v = FILTER_EXPLICIT;
+  int err;
+
+  for (int i = 0; i < fa->nr_tgids; i++)
+    if ((err = bpf_map_update_elem(tgid_fd, &fa->tgids[i], &v, BPF_ANY)))
+      return err;
+  for (int i = 0; i < fa->nr_cgroups; i++)
+    if ((err = bpf_map_update_elem(cg_fd, &fa->cgroups[i], &v, BPF_ANY)))
+      return err;
+  for (int i = 0; i < fa->nr_comms; i++)
+    if ((err = add_comm_prefix(comm_fd, fa->comms[i])))
+      return err;
+
+  if (fa->pin_dir) {
+    struct bpf_map *maps[] = {skel->maps.filter_tgids,
+                              skel->maps.filter_cgroups,
+                              skel->maps.filter_comms};
+    for (size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", fa->pin_dir,
+               bpf_map__name(maps[i]));
+      if ((err = bpf_map__pin(maps[i], path))) {
+        fprintf(stderr, "pin %s failed: %d\n", path, err);
+        return err;
+      }
     }
   }
   return 0;
 }
 
+static void unpin_filters(struct offcpu_bpf *skel, const char *pin_dir) {
+  struct bpf_map *maps[] = {skel->maps.filter_tgids, skel->maps.filter_cgroups,
+                            skel->maps.filter_comms};
+  for (size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", pin_dir, bpf_map__name(maps[i]));
+    bpf_map__unpin(maps[i], path);
+  }
+}
+
+static int cmp_tgid(const void *a, const void *b) {
+  __u32 x = *(const __u32 *)a, y = *(const __u32 *)b;
+  return x < y ? -1 : x > y;
+}
+
+// --follow：扫描 /proc，把名字匹配的进程加进 filter_tgids，
+// 把之前加过、现在已退出（或改名）的删掉
+static void follow_scan(int fd, const char *pattern) {
+  size_t n = 0, cap = 64;
+  __u32 *live = malloc(cap * sizeof(*live));
+  DIR *dir = opendir("/proc");
+  struct dirent *de;
+  if (!live || !dir)
+    goto out;
+
+  while ((de = readdir(dir))) {
+    char *end, path[64], comm[TASK_COMM_LEN + 1];
+    __u32 tgid = strtoul(de->d_name, &end, 10);
+    if (!tgid || *end)
+      continue;
+    snprintf(path, sizeof(path), "/proc/%u/comm", tgid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+      continue;
+    bool ok = fgets(comm, sizeof(comm), f) != NULL;
+    fclose(f);
+    if (!ok)
+      continue;
+    comm[strcspn(comm, "\n")] = '\0';
+    if (fnmatch(pattern, comm, 0))
+      continue;
+    if (n == cap) {
+      __u32 *tmp = realloc(live, cap * 2 * sizeof(*live));
+      if (!tmp)
+        break;
+      live = tmp;
+      cap *= 2;
+    }
+    live[n++] = tgid;
+    __u8 v = FILTER_FOLLOWED;
+    bpf_map_update_elem(fd, &tgid, &v, BPF_NOEXIST); // 不覆盖 -p 给的
+  }
+  qsort(live, n, sizeof(*live), cmp_tgid);
+
+  // 先遍历完再删，边遍历边删会让 get_next_key 从头开始
+  __u32 key, next, *stale = NULL;
+  size_t nr_stale = 0, stale_cap = 0;
+  void *prev = NULL;
+  while (bpf_map_get_next_key(fd, prev, &next) == 0) {
+    __u8 v;
+    key = next;
+    prev = &key;
+    if (bpf_map_lookup_elem(fd, &key, &v) || v != FILTER_FOLLOWED ||
+        bsearch(&key, live, n, sizeof(*live), cmp_tgid))
+      continue;
+    if (nr_stale == stale_cap) {
+      size_t ncap = stale_cap ? stale_cap * 2 : 256;
+      __u32 *tmp = realloc(stale, ncap * sizeof(*tmp));
+      if (!tmp)
+        break;
+      stale = tmp;
+      stale_cap = ncap;
+    }
+    stale[nr_stale++] = key;
+  }
+  for (size_t i = 0; i < nr_stale; i++)
+    bpf_map_delete_elem(fd, &stale[i]);
+  free(stale);
+out:
+  if (dir)
+    closedir(dir);
+  free(live);
+}
+
 static void bump_memlock_rlimit(void) {
   struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
   if (setrlimit(RLIMIT_MEMLOCK, &r)) {
@@ -73,13 +1277,52 @@ static void bump_memlock_rlimit(void) {
 static void usage(const char *prog) {
   fprintf(
       stderr,
-      "Usage: %s [-t ms] [-p tgid] [-S] [-k] [-u] [-d sec]\n"
+      "Usage: %s [-t ms] [-p tgid,...] [-C prefix] [-G cgroup] [-L pattern] "
+      "[-P dir] [-S] [-k] [-u] [-d sec] [-a] [-H] [-s "
+      "[-i sec]] [-W [-F hz]] [-T] [-f] [-c [-g sec]] [-D bytes] [-N]\n"
+      "          [-w n] [-B n [-U us]] [-A [-i sec]] [-x] [-K file]\n"
       "  -t, --threshold  最小时长(毫秒)，默认 10\n"
-      "  -p, --pid        仅统计指定 TGID 进程\n"
-      "  -S, --sleep      仅统计 sleep 段（prev->state != 0）\n"
+      "  -p, --pid        仅统计指定 TGID 进程，逗号分隔或重复给出\n"
+      "  -C, --comm       仅统计进程名以 prefix 开头的进程（新进程自动生效）\n"
+      "  -G, --cgroup     仅统计该 cgroup v2 下的任务（路径或相对 "
+      "/sys/fs/cgroup 的路径）\n"
+      "  -L, --follow     每秒扫描 /proc，进程名匹配通配 pattern 的加入过滤\n"
+      "  -P, --pin-filters 把 filter_tgids/filter_cgroups/filter_comms pin "
+      "到 dir，运行中可用 bpftool 增删\n"
+      "  以上过滤条件取并集\n"
+      "  -S, --sleep      仅统计 sleep 段（非 R 状态切出）\n"
       "  -k, --kernel     采集内核栈\n"
       "  -u, --user       采集用户栈（可能需要较低的 perf_event_paranoid）\n"
-      "  -d, --duration   运行秒数，默认无限直到 Ctrl-C\n",
+      "  -d, --duration   运行秒数，默认无限直到 Ctrl-C\n"
+      "  -a, --aggregate  内核内按 (tgid, 栈, 状态) 聚合，退出时打印\n"
+      "  -H, --hist       同 -a，但每个栈额外给出 log2 延迟分布和最大值\n"
+      "  -s, --syscall    不采栈，按 (tgid, 切出时所在系统调用) 聚合\n"
+      "  -i, --interval   -s/-A/-O 模式下每隔 sec 秒打印（-s/-O 打印后清零）\n"
+      "  -W, --wall       wall-clock：软件 CPU clock 采样 on-CPU 栈 + off-CPU，"
+      "输出 folded\n"
+      "  -F, --freq       -W 采样频率 Hz，默认 99\n"
+      "  -T, --per-thread 聚合按线程（tid）区分\n"
+      "  -f, --folded     -a/-W 结果输出为 folded 栈（flamegraph.pl）\n"
+      "  -c, --content-stacks 栈按内容哈希存入 stack_store（可 GC，统计冲突/丢弃）\n"
+      "  -g, --gc         -c 模式 GC 间隔秒，默认 10；超过该时长未命中的栈被回收\n"
+      "  -D, --dwarf      切出时拷贝 bytes 字节用户栈 + 寄存器，用户态按 "
+      ".eh_frame/.debug_frame 回溯（无帧指针的二进制），上限 8192\n"
+      "  -N, --no-stack-cache 不缓存已符号化的栈，每个事件都查 map\n"
+      "  -w, --workers    逐事件模式：poll 线程只拷贝记录，n 个线程符号化并输出\n"
+      "  -B, --wakeup-batch 每 n 个事件（每 CPU）才唤醒一次消费者，其余 NO_WAKEUP\n"
+      "  -U, --wakeup-us  -B 模式下距上次唤醒超过 us 微秒也唤醒，默认 1000\n"
+      "  -A, --thread-times 不采栈，按线程统计 on-CPU/排队/S/D/iowait 时长，"
+      "列出等待为主的线程（-i 周期打印）\n"
+      "  -x, --futex      跟踪 FUTEX_WAIT 系列，按 (锁地址, 用户栈) 聚合，"
+      "列出竞争最重的锁（地址解析到变量名）\n"
+      "  -K, --wakeups    把唤醒边（waker, wakee, 时刻, 阻塞时长, 双方栈）写到 "
+      "file，用 wakegraph 做关键路径分析\n"
+      "  -O, --hist-only  不采栈、不走 ring buffer，只按 (进程, 睡眠/被抢占) "
+      "统计 off-CPU 时长的 log2 分布，开销最低\n"
+      "  -y, --classify   按内核栈把每段 off-CPU 归到阻塞类别（futex/epoll/"
+      "sleep/io/pagecache/pipe/net/rwsem...），退出时按进程汇总\n"
+      "  -r, --rules      追加分类规则文件（隐含 -y），每行 “类别 通配...”，"
+      "优先于内置表\n",
       prog);
 }
 
@@ -88,16 +1331,63 @@ int main(int argc, char **argv) {
   int err, opt;
   int duration = 0;
   __u64 threshold_ms = 10;
-  __u32 target_tgid = 0;
+  struct filter_args fa = {};
   __u8 sleep_only = 0, cap_k = 1, cap_u = 0; // 默认采 kernel 栈
+  __u8 aggregate = 0, syscall_mode = 0, hist_mode = 0;
+  __u8 wall = 0, per_thread = 0, folded = 0, content_stacks = 0;
+  int interval = 0, freq = 99, gc_interval = 10;
+  size_t gc_freed = 0;
+  __u32 dwarf_bytes = 0;
+  bool use_stack_cache = true;
+  int nr_threads = 0;
+  __u32 wakeup_batch = 0, wakeup_us = 1000;
+  __u8 thread_times = 0, futex_mode = 0, hist_only = 0;
+  const char *wakeups_path = NULL;
+  FILE *wakeups_out = NULL;
+  bool classify_mode = false;
+  const char *rules_path = NULL;
+  struct ring_buffer *rb = NULL;
+  struct bpf_link **clock_links = NULL;
+  int nr_clock_links = 0;
+  struct ksyms *ksyms = NULL;
+  struct timespec t_start, t_end;
 
-  while ((opt = getopt_long(argc, argv, "t:p:Skud:", long_opts, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "t:p:C:G:L:P:Skud:asi:HWF:Tfcg:D:Nw:B:U:AxK:Oyr:", long_opts, NULL)) !=
+         -1) {
     switch (opt) {
     case 't':
       threshold_ms = strtoull(optarg, NULL, 10);
       break;
     case 'p':
-      target_tgid = strtoul(optarg, NULL, 10);
+      if ((err = parse_tgids(&fa, optarg))) {
+        if (err == -E2BIG)
+          fprintf(stderr, "too many -p tgids (max %d)\n", MAX_FILTERS);
+        else
+          fprintf(stderr, "invalid -p: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'C':
+      if (fa.nr_comms == MAX_FILTERS) {
+        fprintf(stderr, "too many -C prefixes (max %d)\n", MAX_FILTERS);
+        return 1;
+      }
+      fa.comms[fa.nr_comms++] = optarg;
+      break;
+    case 'G':
+      if ((err = parse_cgroup(&fa, optarg))) {
+        if (err == -E2BIG)
+          fprintf(stderr, "too many -G cgroups (max %d)\n", MAX_FILTERS);
+        else
+          fprintf(stderr, "invalid cgroup: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'L':
+      fa.follow = optarg;
+      break;
+    case 'P':
+      fa.pin_dir = optarg;
       break;
     case 'S':
       sleep_only = 1;
@@ -111,12 +1401,155 @@ int main(int argc, char **argv) {
     case 'd':
       duration = atoi(optarg);
       break;
+    case 'a':
+      aggregate = 1;
+      break;
+    case 's':
+      syscall_mode = 1;
+      break;
+    case 'i':
+      interval = atoi(optarg);
+      break;
+    case 'H':
+      hist_mode = 1;
+      break;
+    case 'W':
+      wall = 1;
+      break;
+    case 'F':
+      freq = atoi(optarg);
+      if (freq <= 0)
+        freq = 99;
+      break;
+    case 'T':
+      per_thread = 1;
+      break;
+    case 'f':
+      folded = 1;
+      break;
+    case 'c':
+      content_stacks = 1;
+      break;
+    case 'g':
+      gc_interval = atoi(optarg);
+      if (gc_interval <= 0)
+        gc_interval = 10;
+      break;
+    case 'N':
+      use_stack_cache = false;
+      break;
+    case 'w':
+      nr_threads = atoi(optarg);
+      if (nr_threads < 0)
+        nr_threads = 0;
+      break;
+    case 'A':
+      thread_times = 1;
+      break;
+    case 'x':
+      futex_mode = 1;
+      break;
+    case 'K':
+      wakeups_path = optarg;
+      break;
+    case 'O':
+      hist_only = 1;
+      break;
+    case 'r':
+      rules_path = optarg;
+      // fallthrough
+    case 'y':
+      classify_mode = true;
+      break;
+    case 'B':
+      wakeup_batch = strtoul(optarg, NULL, 10);
+      break;
+    case 'U':
+      wakeup_us = strtoul(optarg, NULL, 10);
+      if (!wakeup_us)
+        wakeup_us = 1000;
+      break;
+    case 'D':
+      dwarf_bytes = strtoul(optarg, NULL, 10);
+      if (!dwarf_bytes || dwarf_bytes > DWARF_STACK_MAX)
+        dwarf_bytes = DWARF_STACK_MAX;
+      break;
     default:
       usage(prog);
       return 1;
     }
   }
 
+  if (fa.pin_dir && !fa.nr_tgids && !fa.nr_comms && !fa.nr_cgroups &&
+      !fa.follow) {
+    // 三类过滤都启用但全是空的，会把所有任务都过滤掉
+    fprintf(stderr, "-P 需要至少一个初始过滤条件（-p/-C/-G/-L）\n");
+    return 1;
+  }
+  // 四种聚合各写各的 map，BPF 里 -s 优先于 -H 优先于 -a；-W 的 on-CPU 样本
+  // 只进 aggs，与 -H/-s 同用会被丢掉
+  if ((aggregate || wall) + hist_mode + syscall_mode > 1) {
+    fprintf(stderr, "-a/-W、-H、-s 只能选一个\n");
+    return 1;
+  }
+  if (wall) {
+    // on-CPU 样本只能聚合，输出统一为 folded
+    aggregate = 1;
+    folded = 1;
+    // 短的 off-CPU 段也要计入，否则 on + off 加起来不等于墙钟时间
+    threshold_ms = 0;
+  }
+  if (dwarf_bytes && (aggregate || hist_mode || syscall_mode)) {
+    fprintf(stderr, "-D 只支持逐事件输出，不能与 -a/-H/-s/-W 同用\n");
+    return 1;
+  }
+  if (thread_times && (aggregate || hist_mode || syscall_mode || dwarf_bytes)) {
+    fprintf(stderr, "-A 不能与 -a/-H/-s/-W/-D 同用\n");
+    return 1;
+  }
+  if (futex_mode && (aggregate || hist_mode || syscall_mode || dwarf_bytes ||
+                     thread_times)) {
+    fprintf(stderr, "-x 不能与 -a/-H/-s/-W/-D/-A 同用\n");
+    return 1;
+  }
+  if (wakeups_path && (aggregate || hist_mode || syscall_mode || dwarf_bytes ||
+                       thread_times || futex_mode || nr_threads)) {
+    fprintf(stderr, "-K 不能与 -a/-H/-s/-W/-D/-A/-x/-w 同用\n");
+    return 1;
+  }
+  if (hist_only && (aggregate || hist_mode || syscall_mode || dwarf_bytes ||
+                    thread_times || futex_mode || wakeups_path || nr_threads ||
+                    content_stacks)) {
+    fprintf(stderr, "-O 不能与 -a/-H/-s/-W/-D/-A/-x/-K/-w/-c 同用\n");
+    return 1;
+  }
+  if (classify_mode && (syscall_mode || thread_times || futex_mode ||
+                        wakeups_path || hist_only)) {
+    fprintf(stderr, "-y 不能与 -s/-A/-x/-K/-O 同用\n");
+    return 1;
+  }
+  if (classify_mode) {
+    cap_k = 1; // 分类只看内核栈
+    if (!(cls_rules = classify_rules__new(rules_path)))
+      return 1;
+  }
+  if (wakeups_path) {
+    // 低于阈值的阻塞没有边，wakegraph 会把这段时间当成线程在跑
+    threshold_ms = 0;
+  }
+  if (futex_mode) {
+    // 锁的等待点只看用户栈
+    cap_k = 0;
+    cap_u = 1;
+    // 锁等待大多是微秒级，按 -t 的毫秒阈值丢掉就只剩长尾了
+    threshold_ms = 0;
+  }
+  if (nr_threads && (aggregate || hist_mode || syscall_mode)) {
+    fprintf(stderr, "-w 只用于逐事件输出，不能与 -a/-H/-s/-W 同用\n");
+    return 1;
+  }
+  FILE *info = folded ? stderr : stdout; // folded 输出独占 stdout
+
   bump_memlock_rlimit();
   libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
 
@@ -127,51 +1560,253 @@ int main(int argc, char **argv) {
   }
 
   // 配置 rodata
-  skel->rodata->threshold_ns = threshold_ms * 1000000ULL;
-  skel->rodata->target_tgid = target_tgid;
-  skel->rodata->sleep_only = sleep_only;
-  skel->rodata->capture_kernel = cap_k;
-  skel->rodata->capture_user = cap_u;
+  skel->rodata->conf.threshold_ns = threshold_ms * 1000000ULL;
+  // pin 出去的 map 可能在运行中被加条目，三类过滤都打开
+  skel->rodata->conf.filter_tgid = fa.nr_tgids || fa.follow || fa.pin_dir;
+  skel->rodata->conf.filter_cgroup = fa.nr_cgroups || fa.pin_dir;
+  skel->rodata->conf.filter_comm = fa.nr_comms || fa.pin_dir;
+  skel->rodata->conf.sleep_only = sleep_only;
+  skel->rodata->conf.capture_kernel = cap_k;
+  skel->rodata->conf.capture_user = cap_u;
+  skel->rodata->conf.aggregate = aggregate;
+  skel->rodata->conf.syscall_mode = syscall_mode;
+  skel->rodata->conf.hist_mode = hist_mode;
+  skel->rodata->conf.per_thread = per_thread;
+  skel->rodata->conf.sample_period_ns = 1000000000ULL / freq;
+  bpf_program__set_autoload(skel->progs.on_cpu_sample, wall);
+  skel->rodata->conf.stack_store = content_stacks;
+  // 两种栈存储只会用到一种，另一种缩到 1 个条目，少锁十几 MB 内存；
+  // per-CPU 的取栈暂存区只有 stack_store 用
+  if (content_stacks) {
+    bpf_map__set_max_entries(skel->maps.stacks, 1);
+  } else {
+    bpf_map__set_max_entries(skel->maps.stack_store, 1);
+    bpf_map__set_max_entries(skel->maps.stack_scratch, 1);
+  }
+  skel->rodata->conf.dwarf_stack = dwarf_bytes > 0;
+  skel->rodata->conf.ustack_bytes = dwarf_bytes;
+  if (!dwarf_bytes)
+    bpf_map__set_max_entries(skel->maps.ustack_snaps, 1);
+  skel->rodata->conf.wakeup_batch = wakeup_batch;
+  skel->rodata->conf.wakeup_ns = wakeup_us * 1000ULL;
+  skel->rodata->conf.thread_times = thread_times;
+  bpf_program__set_autoload(skel->progs.on_sched_wakeup, thread_times);
+  skel->rodata->conf.wakeup_graph = wakeups_path != NULL;
+  bpf_program__set_autoload(skel->progs.on_sched_waking, wakeups_path != NULL);
+  if (!thread_times)
+    bpf_map__set_max_entries(skel->maps.thread_times, 1);
+  skel->rodata->conf.futex_mode = futex_mode;
+  bpf_program__set_autoload(skel->progs.on_sched_switch, !futex_mode);
+  bpf_program__set_autoload(skel->progs.on_futex_enter, futex_mode);
+  bpf_program__set_autoload(skel->progs.on_futex_exit, futex_mode);
+  // 只有用户栈/用户数据地址才按 tgid 缓存映射
+  bpf_program__set_autoload(skel->progs.on_process_exec, cap_u);
+  if (!futex_mode) {
+    bpf_map__set_max_entries(skel->maps.futex_starts, 1);
+    bpf_map__set_max_entries(skel->maps.futex_aggs, 1);
+  }
+  // 没启用的过滤 map 也缩到 1
+  if (!skel->rodata->conf.filter_tgid)
+    bpf_map__set_max_entries(skel->maps.filter_tgids, 1);
+  if (!skel->rodata->conf.filter_cgroup)
+    bpf_map__set_max_entries(skel->maps.filter_cgroups, 1);
+  if (!skel->rodata->conf.filter_comm)
+    bpf_map__set_max_entries(skel->maps.filter_comms, 1);
+  skel->rodata->conf.hist_only = hist_only;
+  if (hist_only) {
+    // 只用 tgid_hists + task storage，其余 map 全缩到最小；tgid_hists
+    // 不预分配，占用随实际出现的进程数增长，上限按过滤条件估计
+    struct bpf_map *unused[] = {
+        skel->maps.starts,       skel->maps.stacks,
+        skel->maps.stack_store,  skel->maps.stack_stats,
+        skel->maps.ustack_snaps, skel->maps.aggs,
+        skel->maps.sc_aggs,      skel->maps.hist_aggs,
+    };
+    for (size_t i = 0; i < sizeof(unused) / sizeof(unused[0]); i++)
+      bpf_map__set_max_entries(unused[i], 1);
+    bpf_map__set_max_entries(skel->maps.rb, getpagesize());
+    if (fa.nr_tgids && !fa.nr_comms && !fa.nr_cgroups && !fa.follow &&
+        !fa.pin_dir)
+      bpf_map__set_max_entries(skel->maps.tgid_hists, 2 * fa.nr_tgids);
+    else if (fa.nr_tgids || fa.nr_comms || fa.nr_cgroups || fa.follow ||
+             fa.pin_dir)
+      bpf_map__set_max_entries(skel->maps.tgid_hists, 256);
+  } else {
+    bpf_map__set_max_entries(skel->maps.tgid_hists, 1);
+  }
 
   if ((err = offcpu_bpf__load(skel))) {
     fprintf(stderr, "load skel failed: %d\n", err);
     goto cleanup;
   }
+  if ((err = setup_filters(skel, &fa)))
+    goto cleanup;
+  if (fa.follow)
+    follow_scan(bpf_map__fd(skel->maps.filter_tgids), fa.follow);
   if ((err = offcpu_bpf__attach(skel))) {
     fprintf(stderr, "attach failed: %d\n", err);
     goto cleanup;
   }
 
-  int stacks_fd = bpf_map__fd(skel->maps.stacks);
-  struct ring_buffer *rb = ring_buffer__new(bpf_map__fd(skel->maps.rb),
-                                            handle_event, &stacks_fd, NULL);
+  if (wall && (err = attach_cpu_clock(skel->progs.on_cpu_sample, freq,
+                                      &clock_links, &nr_clock_links)))
+    goto cleanup;
+
+  stacks_fd = bpf_map__fd(skel->maps.stacks);
+  if (content_stacks)
+    store_fd = bpf_map__fd(skel->maps.stack_store);
+  ksyms = ksyms__load();
+  struct consumer_opts copts = {
+      .lookup = lookup_stack_cb,
+      .ksyms = ksyms,
+      .rules = cls_rules,
+      .dwarf = dwarf_bytes > 0,
+      .use_cache = use_stack_cache,
+      .out = stdout,
+  };
+  if ((err = consumer__init(&main_consumer, &copts)))
+    goto cleanup;
+  if (nr_threads && (err = consumer_pool__start(&pool, nr_threads, &copts))) {
+    fprintf(stderr, "start workers failed: %d\n", err);
+    goto cleanup;
+  }
+  if (wakeups_path) {
+    wakeups_out = fopen(wakeups_path, "w");
+    if (!wakeups_out) {
+      fprintf(stderr, "open %s: %s\n", wakeups_path, strerror(errno));
+      err = -errno;
+      goto cleanup;
+    }
+    fprintf(wakeups_out,
+            "# ts_ns\twaker_tid\twaker_tgid\twaker_comm\twakee_tid\t"
+            "wakee_tgid\twakee_comm\tblocked_ns\twakee_state\twaker_stack\t"
+            "wakee_stack\twaker_ctx\n");
+    rb = ring_buffer__new(bpf_map__fd(skel->maps.rb), handle_wakeup,
+                          wakeups_out, NULL);
+  } else {
+    rb = ring_buffer__new(bpf_map__fd(skel->maps.rb),
+                          nr_threads ? dispatch_event : handle_event,
+                          &main_consumer, NULL);
+  }
   if (!rb) {
     fprintf(stderr, "ring_buffer__new failed\n");
     goto cleanup;
   }
+  if (cap_u && (err = ring_buffer__add(rb, bpf_map__fd(skel->maps.exec_rb),
+                                       handle_exec, NULL))) {
+    fprintf(stderr, "ring_buffer__add(exec_rb): %d\n", err);
+    goto cleanup;
+  }
 
   signal(SIGINT, on_sigint);
   signal(SIGTERM, on_sigint);
 
-  printf("Running... threshold=%llums target_tgid=%u sleep_only=%u kernel=%u "
-         "user=%u\n",
-         (unsigned long long)threshold_ms, target_tgid, sleep_only, cap_k,
-         cap_u);
+  fprintf(info,
+          "Running... threshold=%llums tgids=%d comms=%d cgroups=%d "
+          "follow=%s sleep_only=%u kernel=%u user=%u aggregate=%u syscall=%u "
+          "hist=%u wall=%u(%dHz)\n",
+          (unsigned long long)threshold_ms, fa.nr_tgids, fa.nr_comms,
+          fa.nr_cgroups, fa.follow ? fa.follow : "-", sleep_only, cap_k, cap_u,
+          aggregate, syscall_mode, hist_mode, wall, freq);
 
+  // -B 模式下没凑够一批的事件不会唤醒 epoll，poll 超时后主动 consume
+  int poll_ms = wakeup_batch ? (int)(wakeup_us + 999) / 1000 : 200;
+  clock_gettime(CLOCK_MONOTONIC, &t_start);
   time_t end_ts = duration > 0 ? time(NULL) + duration : 0;
+  time_t next_dump = interval > 0 ? time(NULL) + interval : 0;
+  time_t next_gc = time(NULL) + gc_interval;
+  time_t next_follow = time(NULL) + 1;
   while (!exiting) {
-    err = ring_buffer__poll(rb, 200 /* ms */);
+    err = ring_buffer__poll(rb, poll_ms);
+    if (err >= 0 && wakeup_batch)
+      err = ring_buffer__consume(rb);
     if (err == -EINTR)
       break;
     if (err < 0) {
       fprintf(stderr, "ring_buffer__poll: %d\n", err);
       break;
     }
+    if (interval > 0 && time(NULL) >= next_dump) {
+      if (syscall_mode)
+        dump_sc_aggs(bpf_map__fd(skel->maps.sc_aggs), 1);
+      else if (thread_times)
+        dump_thread_times(bpf_map__fd(skel->maps.thread_times));
+      else if (hist_only)
+        dump_tgid_hists(bpf_map__fd(skel->maps.tgid_hists), 1);
+      next_dump += interval;
+    }
+    if (content_stacks && time(NULL) >= next_gc) {
+      size_t freed = gc_stack_store(skel, rb, gc_interval * 1000000000ULL);
+      if (freed) // 被回收的 id 之后可能装进别的栈
+        consumer__invalidate_all();
+      gc_freed += freed;
+      next_gc += gc_interval;
+    }
+    if (fa.follow && time(NULL) >= next_follow) {
+      follow_scan(bpf_map__fd(skel->maps.filter_tgids), fa.follow);
+      next_follow = time(NULL) + 1;
+    }
     if (duration > 0 && time(NULL) >= end_ts)
       break;
   }
+  if (wakeup_batch)
+    ring_buffer__consume(rb);
+  consumer_pool__stop(&pool);
+  clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+  if (syscall_mode) {
+    dump_sc_aggs(bpf_map__fd(skel->maps.sc_aggs), 0);
+    goto cleanup;
+  }
+  if (thread_times) {
+    dump_thread_times(bpf_map__fd(skel->maps.thread_times));
+    goto cleanup;
+  }
+  if (futex_mode) {
+    dump_futex_aggs(bpf_map__fd(skel->maps.futex_aggs));
+    goto cleanup;
+  }
+  if (hist_only) {
+    dump_tgid_hists(bpf_map__fd(skel->maps.tgid_hists), 0);
+    goto cleanup;
+  }
+  if (hist_mode) {
+    dump_hist_aggs(bpf_map__fd(skel->maps.hist_aggs));
+  } else if (aggregate && folded) {
+    dump_folded(stdout, bpf_map__fd(skel->maps.aggs), stacks_fd, ksyms,
+                main_consumer.usyms);
+  } else if (aggregate) {
+    dump_aggs(bpf_map__fd(skel->maps.aggs));
+  }
+  struct stack_cache_stats cst = {};
+  __u64 consumed = 0;
+  consumer_merge(&main_consumer, &cst, &consumed);
+  for (int i = 0; i < pool.nr; i++)
+    consumer_merge(&pool.workers[i], &cst, &consumed);
+  print_state_summary(info);
+  if (cls_rules)
+    print_categories(info);
+  print_stack_stats(info, bpf_map__fd(skel->maps.stack_stats), gc_freed);
+  fprintf(info, "stack cache: hits=%llu misses=%llu lookup_errs=%llu\n",
+          (unsigned long long)cst.hits, (unsigned long long)cst.misses,
+          (unsigned long long)cst.lookup_errs);
+  print_rb_stats(info, bpf_map__fd(skel->maps.rb_stats), consumed,
+                 (t_end.tv_sec - t_start.tv_sec) +
+                     (t_end.tv_nsec - t_start.tv_nsec) / 1e9);
 
 cleanup:
+  if (fa.pin_dir && skel)
+    unpin_filters(skel, fa.pin_dir);
+  for (int i = 0; i < nr_clock_links; i++)
+    bpf_link__destroy(clock_links[i]);
+  free(clock_links);
+  consumer_pool__free(&pool);
+  free(tt_prev);
+  if (wakeups_out)
+    fclose(wakeups_out);
+  consumer__free(&main_consumer);
+  classify_rules__free(cls_rules);
+  ksyms__free(ksyms);
   ring_buffer__free(rb);
   offcpu_bpf__destroy(skel);
   return err != 0;
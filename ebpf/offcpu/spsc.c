@@ -0,0 +1,102 @@
+// spsc.c
+#include "spsc.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHELINE 64
+#define REC_HDR 8         // 长度头占 8 字节，保证数据 8 字节对齐
+#define REC_SKIP 0xffffffffu // 环尾放不下时的占位，消费者跳回开头
+
+struct spsc_ring {
+  // 生产者和消费者各写一个位置，分开放在不同 cache line 上避免伪共享
+  _Alignas(CACHELINE) _Atomic size_t head; // 生产者写
+  size_t cached_tail;                      // 生产者眼中的 tail，减少跨核读
+  _Alignas(CACHELINE) _Atomic size_t tail; // 消费者写
+  size_t cur_len;                          // peek 出来尚未 release 的记录
+  _Alignas(CACHELINE) size_t size;
+  size_t mask;
+  char *data;
+};
+
+static size_t rec_size(uint32_t len) { return (REC_HDR + len + 7) & ~(size_t)7; }
+
+struct spsc_ring *spsc_ring__new(size_t size) {
+  size_t n = 4096;
+  while (n < size)
+    n <<= 1;
+  struct spsc_ring *r = aligned_alloc(CACHELINE, sizeof(*r));
+  if (!r)
+    return NULL;
+  memset(r, 0, sizeof(*r));
+  r->data = aligned_alloc(CACHELINE, n);
+  if (!r->data) {
+    free(r);
+    return NULL;
+  }
+  r->size = n;
+  r->mask = n - 1;
+  return r;
+}
+
+void spsc_ring__free(struct spsc_ring *r) {
+  if (!r)
+    return;
+  free(r->data);
+  free(r);
+}
+
+int spsc_ring__push(struct spsc_ring *r, const void *data, uint32_t len) {
+  size_t need = rec_size(len);
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t off = head & r->mask;
+  size_t pad = off + need > r->size ? r->size - off : 0; // 环尾放不下：整段跳过
+  if (need + pad > r->size)
+    return -1;
+
+  if (head + pad + need - r->cached_tail > r->size) {
+    r->cached_tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head + pad + need - r->cached_tail > r->size)
+      return -1;
+  }
+  if (pad) {
+    *(uint32_t *)(r->data + off) = REC_SKIP;
+    head += pad;
+    off = 0;
+  }
+  *(uint32_t *)(r->data + off) = len;
+  memcpy(r->data + off + REC_HDR, data, len);
+  atomic_store_explicit(&r->head, head + need, memory_order_release);
+  return 0;
+}
+
+const void *spsc_ring__peek(struct spsc_ring *r, uint32_t *len) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (tail == head)
+    return NULL;
+  size_t off = tail & r->mask;
+  uint32_t n = *(uint32_t *)(r->data + off);
+  if (n == REC_SKIP) {
+    tail += r->size - off;
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+    if (tail == head)
+      return NULL;
+    off = 0;
+    n = *(uint32_t *)r->data;
+  }
+  r->cur_len = rec_size(n);
+  *len = n;
+  return r->data + off + REC_HDR;
+}
+
+void spsc_ring__release(struct spsc_ring *r) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  atomic_store_explicit(&r->tail, tail + r->cur_len, memory_order_release);
+  r->cur_len = 0;
+}
+
+bool spsc_ring__empty(struct spsc_ring *r) {
+  return atomic_load_explicit(&r->tail, memory_order_acquire) ==
+         atomic_load_explicit(&r->head, memory_order_acquire);
+}
@@ -0,0 +1,21 @@
+// spsc.h
+// 单生产者单消费者的无锁字节环：poll 线程把 rb 记录原样拷进来，worker 取走处理。
+// 记录变长（event / dwarf_event），8 字节对齐，带 4 字节长度头
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct spsc_ring;
+
+// size 向上取整到 2 的幂
+struct spsc_ring *spsc_ring__new(size_t size);
+void spsc_ring__free(struct spsc_ring *r);
+
+// 生产者：空间不足返回 -1，调用方自行退避重试
+int spsc_ring__push(struct spsc_ring *r, const void *data, uint32_t len);
+
+// 消费者：取出下一条记录的指针和长度（不拷贝），处理完调 release；空时返回 NULL
+const void *spsc_ring__peek(struct spsc_ring *r, uint32_t *len);
+void spsc_ring__release(struct spsc_ring *r);
+bool spsc_ring__empty(struct spsc_ring *r);
@@ -0,0 +1,187 @@
+// stack_cache.c
+#define _GNU_SOURCE
+#include "stack_cache.h"
+#include "offcpu.h"
+#include "syms.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define STACK_CACHE_BUCKETS 65536 // 2 的幂
+
+struct cache_entry {
+  struct cache_entry *next;
+  int stack_id;
+  uint32_t tgid; // 内核栈为 0
+  bool user;
+  uint64_t gen;
+  struct cached_stack stack;
+};
+
+struct stack_cache {
+  stack_lookup_fn lookup;
+  void *lookup_ctx;
+  const struct ksyms *ksyms;
+  struct syms_cache *usyms;
+  bool enabled;
+  uint64_t gen;
+  struct cache_entry **buckets;
+  struct cache_entry scratch; // enabled=false 时复用
+  struct stack_cache_stats stats;
+};
+
+static void stack_release(struct cached_stack *st) {
+  for (int i = 0; i < st->nr; i++)
+    free(st->frames[i].name);
+  free(st->frames);
+  st->frames = NULL;
+  st->nr = 0;
+}
+
+static int resolve(struct stack_cache *sc, int stack_id, uint32_t tgid,
+                   bool user, struct cached_stack *out) {
+  uint64_t ips[MAX_STACK_DEPTH];
+  if (sc->lookup(sc->lookup_ctx, stack_id, ips, MAX_STACK_DEPTH)) {
+    sc->stats.lookup_errs++;
+    return -1;
+  }
+  int nr = 0;
+  while (nr < MAX_STACK_DEPTH && ips[nr])
+    nr++;
+  out->frames = calloc(nr ? nr : 1, sizeof(*out->frames));
+  if (!out->frames)
+    return -1;
+  out->nr = nr;
+
+  for (int i = 0; i < nr; i++) {
+    struct cached_frame *f = &out->frames[i];
+    f->ip = ips[i];
+    if (!user) {
+      const struct ksym *ks = ksyms__map_addr(sc->ksyms, ips[i]);
+      if (ks) {
+        f->name = strdup(ks->name);
+        f->offset = ips[i] - ks->addr;
+        f->has_sym = true;
+      }
+      continue;
+    }
+    struct sym_info si;
+    if (syms_cache__map_addr(sc->usyms, (int)tgid, ips[i], &si))
+      continue;
+    if (si.name) {
+      f->name = strdup(si.name);
+      f->has_sym = true;
+    } else {
+      const char *base = strrchr(si.module, '/');
+      f->name = strdup(base ? base + 1 : si.module);
+    }
+    f->offset = si.offset;
+  }
+  return 0;
+}
+
+struct stack_cache *stack_cache__new(stack_lookup_fn lookup, void *lookup_ctx,
+                                     const struct ksyms *ksyms,
+                                     struct syms_cache *usyms, bool enabled) {
+  struct stack_cache *sc = calloc(1, sizeof(*sc));
+  if (!sc)
+    return NULL;
+  sc->lookup = lookup;
+  sc->lookup_ctx = lookup_ctx;
+  sc->ksyms = ksyms;
+  sc->usyms = usyms;
+  sc->enabled = enabled;
+  if (enabled) {
+    sc->buckets = calloc(STACK_CACHE_BUCKETS, sizeof(*sc->buckets));
+    if (!sc->buckets) {
+      free(sc);
+      return NULL;
+    }
+  }
+  return sc;
+}
+
+void stack_cache__free(struct stack_cache *sc) {
+  if (!sc)
+    return;
+  for (size_t b = 0; sc->buckets && b < STACK_CACHE_BUCKETS; b++) {
+    struct cache_entry *e = sc->buckets[b];
+    while (e) {
+      struct cache_entry *next = e->next;
+      stack_release(&e->stack);
+      free(e);
+      e = next;
+    }
+  }
+  stack_release(&sc->scratch.stack);
+  free(sc->buckets);
+  free(sc);
+}
+
+static size_t bucket_of(int stack_id, uint32_t tgid, bool user) {
+  uint64_t h = (uint64_t)(uint32_t)stack_id * 0x9e3779b97f4a7c15ULL;
+  h ^= ((uint64_t)tgid << 1 | user) * 0xc2b2ae3d27d4eb4fULL;
+  return (h >> 32) & (STACK_CACHE_BUCKETS - 1);
+}
+
+const struct cached_stack *stack_cache__get(struct stack_cache *sc,
+                                            int stack_id, uint32_t tgid,
+                                            bool user) {
+  if (stack_id < 0)
+    return NULL;
+  if (!user)
+    tgid = 0;
+
+  if (!sc->enabled) {
+    sc->stats.misses++;
+    stack_release(&sc->scratch.stack);
+    if (resolve(sc, stack_id, tgid, user, &sc->scratch.stack))
+      return NULL;
+    return &sc->scratch.stack;
+  }
+
+  size_t b = bucket_of(stack_id, tgid, user);
+  struct cache_entry *e = sc->buckets[b];
+  for (; e; e = e->next) {
+    if (e->stack_id == stack_id && e->tgid == tgid && e->user == user)
+      break;
+  }
+  if (e && e->gen == sc->gen) {
+    sc->stats.hits++;
+    return &e->stack;
+  }
+
+  sc->stats.misses++;
+  if (!e) {
+    e = calloc(1, sizeof(*e));
+    if (!e)
+      return NULL;
+    e->stack_id = stack_id;
+    e->tgid = tgid;
+    e->user = user;
+    e->next = sc->buckets[b];
+    sc->buckets[b] = e;
+  } else {
+    stack_release(&e->stack); // 上一代的内容，id 可能已被复用
+  }
+  e->gen = sc->gen;
+  if (resolve(sc, stack_id, tgid, user, &e->stack)) {
+    e->gen = sc->gen - 1; // 下次重试
+    return NULL;
+  }
+  return &e->stack;
+}
+
+void stack_cache__invalidate(struct stack_cache *sc) { sc->gen++; }
+
+void stack_cache__forget_tgid(struct stack_cache *sc, uint32_t tgid) {
+  // 只标记为上一代，条目留在原处：下次命中时重新符号化
+  for (size_t b = 0; sc->buckets && b < STACK_CACHE_BUCKETS; b++)
+    for (struct cache_entry *e = sc->buckets[b]; e; e = e->next)
+      if (e->user && e->tgid == tgid)
+        e->gen = sc->gen - 1;
+}
+
+void stack_cache__stats(const struct stack_cache *sc,
+                        struct stack_cache_stats *stats) {
+  *stats = sc->stats;
+}
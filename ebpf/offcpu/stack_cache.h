@@ -0,0 +1,52 @@
+// stack_cache.h
+// stack id -> 已符号化的帧。重复出现的栈不再走 bpf_map_lookup_elem 系统调用，
+// 栈存储被 GC/重置（id 可能被复用）时通过 generation 整体失效
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ksyms;
+struct syms_cache;
+
+struct cached_frame {
+  uint64_t ip;
+  char *name;      // 符号名；无符号时为模块 basename；都没有时为 NULL
+  uint64_t offset; // 相对 name 的偏移
+  bool has_sym;
+};
+
+struct cached_stack {
+  int nr;
+  struct cached_frame *frames; // 叶子在前
+};
+
+// 从栈存储读出 stack_id 的原始地址（0 结尾），返回 0 表示成功
+typedef int (*stack_lookup_fn)(void *ctx, int stack_id, uint64_t *ips,
+                               int max_depth);
+
+struct stack_cache_stats {
+  uint64_t hits;
+  uint64_t misses;      // 需要查 map + 符号化
+  uint64_t lookup_errs; // map 里已经没有该 id
+};
+
+struct stack_cache;
+
+// enabled=false 时每次都查 map 并重新符号化（用于对比基准）
+struct stack_cache *stack_cache__new(stack_lookup_fn lookup, void *lookup_ctx,
+                                     const struct ksyms *ksyms,
+                                     struct syms_cache *usyms, bool enabled);
+void stack_cache__free(struct stack_cache *sc);
+
+// user=false 时 tgid 被忽略（内核栈与进程无关）；失败返回 NULL
+const struct cached_stack *stack_cache__get(struct stack_cache *sc,
+                                            int stack_id, uint32_t tgid,
+                                            bool user);
+// 栈存储里的 id 可能已被回收复用：之前缓存的内容全部作废
+void stack_cache__invalidate(struct stack_cache *sc);
+// 进程 exec 后地址空间整个换了：该 tgid 的用户栈全部重新符号化。
+// 要扫一遍所有桶，只在确实缓存过该进程时调用
+void stack_cache__forget_tgid(struct stack_cache *sc, uint32_t tgid);
+void stack_cache__stats(const struct stack_cache *sc,
+                        struct stack_cache_stats *stats);
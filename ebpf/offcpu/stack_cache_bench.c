@@ -0,0 +1,138 @@
+// stack_cache_bench.c
+// 对比用户态栈缓存开/关时的事件处理吞吐：
+// 建一个和 offcpu 同样布局的 BPF HASH 栈表，用 /proc/kallsyms 里的真实地址
+// 填充 nr_stacks 个合成内核栈，然后按偏斜分布（少数热点栈占大多数事件，
+// 和真实 off-CPU 事件一致）回放 nr_events 次 stack_cache__get，打印 events/s。
+// 需要 root（bpf_map_create + 非零 kallsyms）。
+#define _GNU_SOURCE
+#include "offcpu.h"
+#include "stack_cache.h"
+#include "syms.h"
+#include <bpf/bpf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STACK_FRAMES 24
+
+static int lookup_cb(void *ctx, int stack_id, uint64_t *ips, int max_depth) {
+  __u64 buf[MAX_STACK_DEPTH] = {};
+  if (bpf_map_lookup_elem(*(int *)ctx, &stack_id, buf))
+    return -1;
+  memcpy(ips, buf, sizeof(__u64) * max_depth);
+  return 0;
+}
+
+static int load_text_addrs(uint64_t **out) {
+  FILE *f = fopen("/proc/kallsyms", "r");
+  if (!f)
+    return -1;
+  size_t n = 0, cap = 0;
+  uint64_t *addrs = NULL;
+  unsigned long long a;
+  char type, name[256];
+  while (fscanf(f, "%llx %c %255s%*[^\n]", &a, &type, name) == 3) {
+    if (!a || (type != 't' && type != 'T'))
+      continue;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 4096;
+      uint64_t *tmp = realloc(addrs, cap * sizeof(*addrs));
+      if (!tmp)
+        break;
+      addrs = tmp;
+    }
+    addrs[n++] = a + 0x10; // 落在函数体内，模拟返回地址
+  }
+  fclose(f);
+  *out = addrs;
+  return (int)n;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int map_fd, const struct ksyms *ksyms, bool cached,
+                  const int *ids, int nr_events) {
+  struct stack_cache *sc =
+      stack_cache__new(lookup_cb, &map_fd, ksyms, NULL, cached);
+  if (!sc)
+    return 0;
+  uint64_t frames = 0;
+  double t0 = now_sec();
+  for (int i = 0; i < nr_events; i++) {
+    const struct cached_stack *st = stack_cache__get(sc, ids[i], 0, false);
+    if (st)
+      frames += st->nr;
+  }
+  double dt = now_sec() - t0;
+  struct stack_cache_stats s;
+  stack_cache__stats(sc, &s);
+  printf("%-10s events=%d frames=%llu hits=%llu misses=%llu "
+         "time=%.3fs  %.0f events/s\n",
+         cached ? "cached" : "uncached", nr_events,
+         (unsigned long long)frames, (unsigned long long)s.hits,
+         (unsigned long long)s.misses, dt, nr_events / dt);
+  stack_cache__free(sc);
+  return nr_events / dt;
+}
+
+int main(int argc, char **argv) {
+  int nr_stacks = argc > 1 ? atoi(argv[1]) : 2000;
+  int nr_events = argc > 2 ? atoi(argv[2]) : 200000;
+  if (nr_stacks <= 0 || nr_events <= 0) {
+    fprintf(stderr, "Usage: %s [nr_stacks] [nr_events]\n", argv[0]);
+    return 1;
+  }
+
+  uint64_t *addrs;
+  int nr_addrs = load_text_addrs(&addrs);
+  if (nr_addrs <= 0) {
+    fprintf(stderr, "no kallsyms addresses (need root)\n");
+    return 1;
+  }
+  struct ksyms *ksyms = ksyms__load();
+  if (!ksyms) {
+    fprintf(stderr, "failed to load kallsyms\n");
+    return 1;
+  }
+
+  int map_fd = bpf_map_create(BPF_MAP_TYPE_HASH, "bench_stacks", sizeof(__u32),
+                              sizeof(__u64) * MAX_STACK_DEPTH, nr_stacks, NULL);
+  if (map_fd < 0) {
+    fprintf(stderr, "bpf_map_create: %s\n", strerror(errno));
+    return 1;
+  }
+  srand(1);
+  for (__u32 id = 0; id < (__u32)nr_stacks; id++) {
+    __u64 ips[MAX_STACK_DEPTH] = {};
+    for (int i = 0; i < STACK_FRAMES; i++)
+      ips[i] = addrs[rand() % nr_addrs];
+    bpf_map_update_elem(map_fd, &id, ips, 0);
+  }
+
+  // 偏斜分布：id = nr_stacks * u^3，u 均匀 [0,1)，热点集中在小 id
+  int *ids = malloc(sizeof(*ids) * nr_events);
+  if (!ids)
+    return 1;
+  for (int i = 0; i < nr_events; i++) {
+    double u = rand() / (RAND_MAX + 1.0);
+    ids[i] = (int)(nr_stacks * u * u * u);
+  }
+
+  double before = run(map_fd, ksyms, false, ids, nr_events);
+  double after = run(map_fd, ksyms, true, ids, nr_events);
+  if (before > 0)
+    printf("speedup: %.1fx\n", after / before);
+
+  free(ids);
+  close(map_fd);
+  ksyms__free(ksyms);
+  free(addrs);
+  return 0;
+}
@@ -0,0 +1,542 @@
+// syms.c
+#define _GNU_SOURCE
+#include "syms.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <gelf.h>
+#include <libelf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// ---------- 内核符号 ----------
+
+struct ksyms {
+  struct ksym *syms;
+  size_t nr, cap;
+};
+
+static int ksym_cmp(const void *a, const void *b) {
+  const struct ksym *x = a, *y = b;
+  if (x->addr == y->addr)
+    return 0;
+  return x->addr < y->addr ? -1 : 1;
+}
+
+struct ksyms *ksyms__load(void) {
+  FILE *f = fopen("/proc/kallsyms", "r");
+  if (!f)
+    return NULL;
+  struct ksyms *ks = calloc(1, sizeof(*ks));
+  if (!ks) {
+    fclose(f);
+    return NULL;
+  }
+
+  char line[512], name[256], type;
+  unsigned long long addr;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%llx %c %255s", &addr, &type, name) != 3)
+      continue;
+    if (!addr) // kptr_restrict 打开时全是 0
+      continue;
+    if (ks->nr == ks->cap) {
+      size_t cap = ks->cap ? ks->cap * 2 : 4096;
+      struct ksym *tmp = realloc(ks->syms, cap * sizeof(*tmp));
+      if (!tmp)
+        break;
+      ks->syms = tmp;
+      ks->cap = cap;
+    }
+    ks->syms[ks->nr].addr = addr;
+    ks->syms[ks->nr].name = strdup(name);
+    if (ks->syms[ks->nr].name)
+      ks->nr++;
+  }
+  fclose(f);
+  qsort(ks->syms, ks->nr, sizeof(*ks->syms), ksym_cmp);
+  return ks;
+}
+
+void ksyms__free(struct ksyms *ks) {
+  if (!ks)
+    return;
+  for (size_t i = 0; i < ks->nr; i++)
+    free((void *)ks->syms[i].name);
+  free(ks->syms);
+  free(ks);
+}
+
+const struct ksym *ksyms__map_addr(const struct ksyms *ks, uint64_t addr) {
+  if (!ks || !ks->nr || addr < ks->syms[0].addr)
+    return NULL;
+  size_t lo = 0, hi = ks->nr; // 找最后一个 syms[i].addr <= addr
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ks->syms[mid].addr <= addr)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return &ks->syms[lo];
+}
+
+// ---------- 用户态符号 ----------
+
+struct dso_sym {
+  uint64_t addr;
+  uint64_t size;
+  char *name;
+};
+
+struct dso_load {
+  uint64_t vaddr;
+  uint64_t offset;
+  uint64_t filesz;
+  uint64_t memsz; // 超出 filesz 的部分是 .bss，映射为紧跟其后的匿名段
+  uint64_t align;
+};
+
+struct dso {
+  char *path; // 实际打开的路径（可能带 /proc/<pid>/root 前缀）
+  struct dso_sym *syms;
+  size_t nr_syms;
+  struct dso_sym *objs; // STT_OBJECT：全局/静态变量，用于解析锁等数据地址
+  size_t nr_objs;
+  struct dso_load *loads;
+  size_t nr_loads;
+};
+
+struct map {
+  uint64_t start, end, offset;
+  struct dso *dso;
+  char *name; // maps 里的原始路径，用于输出；匿名映射为 [heap]/[stack]/[anon]
+  char *file; // 不可执行的文件映射：要打开的路径，第一次解析数据地址时才加载
+  bool exec;
+};
+
+struct proc_maps {
+  int tgid;
+  struct map *maps;
+  size_t nr_maps;
+  time_t loaded_at; // CLOCK_MONOTONIC 秒，未命中时据此限制重读频率
+};
+
+struct syms_cache {
+  struct dso **dsos;
+  size_t nr_dsos;
+  struct proc_maps *procs;
+  size_t nr_procs;
+};
+
+static int dso_sym_cmp(const void *a, const void *b) {
+  const struct dso_sym *x = a, *y = b;
+  if (x->addr == y->addr)
+    return 0;
+  return x->addr < y->addr ? -1 : 1;
+}
+
+static int dso_push_sym(struct dso_sym **arr, size_t *nr, size_t *cap,
+                        const GElf_Sym *sym, const char *nm) {
+  if (*nr == *cap) {
+    size_t ncap = *cap ? *cap * 2 : 1024;
+    struct dso_sym *tmp = realloc(*arr, ncap * sizeof(*tmp));
+    if (!tmp)
+      return -ENOMEM;
+    *arr = tmp;
+    *cap = ncap;
+  }
+  (*arr)[*nr].addr = sym->st_value;
+  (*arr)[*nr].size = sym->st_size;
+  (*arr)[*nr].name = strdup(nm);
+  if ((*arr)[*nr].name)
+    (*nr)++;
+  return 0;
+}
+
+static void dso_add_syms(struct dso *d, Elf *e, Elf_Scn *scn, size_t *cap,
+                         size_t *obj_cap) {
+  GElf_Shdr shdr;
+  if (!gelf_getshdr(scn, &shdr) || !shdr.sh_entsize)
+    return;
+  Elf_Data *data = elf_getdata(scn, NULL);
+  if (!data)
+    return;
+  size_t count = shdr.sh_size / shdr.sh_entsize;
+  for (size_t i = 0; i < count; i++) {
+    GElf_Sym sym;
+    if (!gelf_getsym(data, (int)i, &sym))
+      continue;
+    unsigned char type = GELF_ST_TYPE(sym.st_info);
+    if (type != STT_FUNC && type != STT_GNU_IFUNC && type != STT_OBJECT)
+      continue;
+    if (sym.st_shndx == SHN_UNDEF || !sym.st_value)
+      continue;
+    const char *nm = elf_strptr(e, shdr.sh_link, sym.st_name);
+    if (!nm || !*nm)
+      continue;
+    int err = type == STT_OBJECT
+                  ? dso_push_sym(&d->objs, &d->nr_objs, obj_cap, &sym, nm)
+                  : dso_push_sym(&d->syms, &d->nr_syms, cap, &sym, nm);
+    if (err)
+      return;
+  }
+}
+
+static struct dso *dso_load(const char *path) {
+  struct dso *d = calloc(1, sizeof(*d));
+  if (!d)
+    return NULL;
+  d->path = strdup(path);
+
+  // 只解析普通的 ELF 文件：/dev/*、/dev/shm 和 mmap 的数据文件都跳过，
+  // 打不开或不是 ELF 也缓存下来，避免反复 open
+  struct stat st;
+  if (stat(path, &st) || !S_ISREG(st.st_mode))
+    return d;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return d;
+  char magic[SELFMAG];
+  if (pread(fd, magic, SELFMAG, 0) != SELFMAG || memcmp(magic, ELFMAG, SELFMAG) ||
+      elf_version(EV_CURRENT) == EV_NONE) {
+    close(fd);
+    return d;
+  }
+  Elf *e = elf_begin(fd, ELF_C_READ, NULL);
+  if (!e) {
+    close(fd);
+    return d;
+  }
+
+  size_t nph = 0;
+  if (elf_getphdrnum(e, &nph) == 0 && nph) {
+    d->loads = calloc(nph, sizeof(*d->loads));
+    for (size_t i = 0; d->loads && i < nph; i++) {
+      GElf_Phdr phdr;
+      if (!gelf_getphdr(e, (int)i, &phdr) || phdr.p_type != PT_LOAD)
+        continue;
+      d->loads[d->nr_loads].vaddr = phdr.p_vaddr;
+      d->loads[d->nr_loads].offset = phdr.p_offset;
+      d->loads[d->nr_loads].filesz = phdr.p_filesz;
+      d->loads[d->nr_loads].memsz = phdr.p_memsz;
+      d->loads[d->nr_loads].align = phdr.p_align ? phdr.p_align : 1;
+      d->nr_loads++;
+    }
+  }
+
+  // .symtab 和 .dynsym 都收，剥离过的库只剩 .dynsym
+  size_t cap = 0, obj_cap = 0;
+  Elf_Scn *scn = NULL;
+  while ((scn = elf_nextscn(e, scn)) != NULL) {
+    GElf_Shdr shdr;
+    if (!gelf_getshdr(scn, &shdr))
+      continue;
+    if (shdr.sh_type == SHT_SYMTAB || shdr.sh_type == SHT_DYNSYM)
+      dso_add_syms(d, e, scn, &cap, &obj_cap);
+  }
+  qsort(d->syms, d->nr_syms, sizeof(*d->syms), dso_sym_cmp);
+  qsort(d->objs, d->nr_objs, sizeof(*d->objs), dso_sym_cmp);
+
+  elf_end(e);
+  close(fd);
+  return d;
+}
+
+static void dso_free(struct dso *d) {
+  for (size_t i = 0; i < d->nr_syms; i++)
+    free(d->syms[i].name);
+  free(d->syms);
+  for (size_t i = 0; i < d->nr_objs; i++)
+    free(d->objs[i].name);
+  free(d->objs);
+  free(d->loads);
+  free(d->path);
+  free(d);
+}
+
+// 文件偏移 -> ELF 虚拟地址（符号表里的 st_value 所在的地址空间）。
+// 段按 p_align 向下对齐映射，映射的起始偏移可能小于 p_offset
+static int dso_file_off_to_vaddr(const struct dso *d, uint64_t off,
+                                 uint64_t *vaddr) {
+  for (size_t i = 0; i < d->nr_loads; i++) {
+    const struct dso_load *l = &d->loads[i];
+    if (off >= (l->offset & ~(l->align - 1)) && off < l->offset + l->filesz) {
+      *vaddr = off - l->offset + l->vaddr;
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+static const struct dso_sym *find_sym(const struct dso_sym *syms, size_t nr,
+                                      uint64_t vaddr) {
+  if (!nr || vaddr < syms[0].addr)
+    return NULL;
+  size_t lo = 0, hi = nr;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (syms[mid].addr <= vaddr)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return &syms[lo];
+}
+
+static const struct dso_sym *dso_find_sym(const struct dso *d, uint64_t vaddr) {
+  const struct dso_sym *s = find_sym(d->syms, d->nr_syms, vaddr);
+  if (s && s->size && vaddr >= s->addr + s->size)
+    return NULL;
+  return s;
+}
+
+// 变量要求落在 [addr, addr+size) 内；size 为 0 的只认精确地址
+static const struct dso_sym *dso_find_obj(const struct dso *d, uint64_t vaddr) {
+  const struct dso_sym *s = find_sym(d->objs, d->nr_objs, vaddr);
+  if (!s || vaddr >= s->addr + (s->size ? s->size : 1))
+    return NULL;
+  return s;
+}
+
+// 内存地址 -> ELF 虚拟地址，按 memsz 判断，覆盖 .bss
+static int dso_mem_to_vaddr(const struct dso *d, const struct map *m,
+                            uint64_t addr, uint64_t *vaddr) {
+  uint64_t base;
+  if (dso_file_off_to_vaddr(d, m->offset, &base))
+    return -ENOENT;
+  uint64_t v = addr - m->start + base; // m->start 对应 ELF 里的 base
+  for (size_t i = 0; i < d->nr_loads; i++) {
+    const struct dso_load *l = &d->loads[i];
+    if (v >= l->vaddr && v < l->vaddr + l->memsz) {
+      *vaddr = v;
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+static struct dso *cache_get_dso(struct syms_cache *c, const char *path) {
+  for (size_t i = 0; i < c->nr_dsos; i++)
+    if (!strcmp(c->dsos[i]->path, path))
+      return c->dsos[i];
+  struct dso **tmp = realloc(c->dsos, (c->nr_dsos + 1) * sizeof(*tmp));
+  if (!tmp)
+    return NULL;
+  c->dsos = tmp;
+  struct dso *d = dso_load(path);
+  if (!d)
+    return NULL;
+  c->dsos[c->nr_dsos++] = d;
+  return d;
+}
+
+static struct dso *map_get_dso(struct syms_cache *c, struct map *m) {
+  if (!m->dso && m->file) {
+    m->dso = cache_get_dso(c, m->file);
+    free(m->file);
+    m->file = NULL;
+  }
+  return m->dso;
+}
+
+static time_t monotonic_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static int proc_maps_load(struct syms_cache *c, struct proc_maps *p) {
+  char fn[64];
+  snprintf(fn, sizeof(fn), "/proc/%d/maps", p->tgid);
+  p->loaded_at = monotonic_sec();
+  FILE *f = fopen(fn, "r");
+  if (!f)
+    return -errno;
+
+  char line[4096];
+  size_t cap = 0;
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long long start, end, off;
+    char perms[8];
+    int path_pos = 0;
+    if (sscanf(line, "%llx-%llx %7s %llx %*x:%*x %*u %n", &start, &end, perms,
+               &off, &path_pos) != 4)
+      continue;
+    char *path = line + path_pos;
+    path[strcspn(path, "\n")] = '\0';
+    // 数据地址解析也要用到不可执行的映射和匿名映射（.bss/堆/栈），
+    // 只记下路径，等 syms_cache__map_data 用到时再加载；
+    // [vdso] 和匿名可执行映射（JIT）不加载 ELF
+    char *del = strstr(path, " (deleted)");
+    if (del)
+      *del = '\0';
+    char full[4096 + 64] = "";
+    if (path[0] == '/') {
+      // 容器里的进程：通过 /proc/<pid>/root 访问它自己的文件系统视图
+      snprintf(full, sizeof(full), "/proc/%d/root%s", p->tgid, path);
+      if (access(full, R_OK) != 0)
+        snprintf(full, sizeof(full), "%s", path);
+    }
+
+    if (p->nr_maps == cap) {
+      size_t ncap = cap ? cap * 2 : 64;
+      struct map *tmp = realloc(p->maps, ncap * sizeof(*tmp));
+      if (!tmp)
+        break;
+      p->maps = tmp;
+      cap = ncap;
+    }
+    struct map *m = &p->maps[p->nr_maps];
+    m->start = start;
+    m->end = end;
+    m->offset = off;
+    m->exec = perms[2] == 'x';
+    m->dso = full[0] && m->exec ? cache_get_dso(c, full) : NULL;
+    m->file = full[0] && !m->exec ? strdup(full) : NULL;
+    m->name = strdup(path[0] ? path : "[anon]");
+    p->nr_maps++;
+  }
+  fclose(f);
+  return 0;
+}
+
+static struct proc_maps *cache_get_proc(struct syms_cache *c, int tgid) {
+  for (size_t i = 0; i < c->nr_procs; i++)
+    if (c->procs[i].tgid == tgid)
+      return &c->procs[i];
+  struct proc_maps *tmp =
+      realloc(c->procs, (c->nr_procs + 1) * sizeof(*tmp));
+  if (!tmp)
+    return NULL;
+  c->procs = tmp;
+  struct proc_maps *p = &c->procs[c->nr_procs++];
+  memset(p, 0, sizeof(*p));
+  p->tgid = tgid;
+  proc_maps_load(c, p);
+  return p;
+}
+
+struct syms_cache *syms_cache__new(void) {
+  return calloc(1, sizeof(struct syms_cache));
+}
+
+static void proc_maps_free(struct proc_maps *p) {
+  for (size_t i = 0; i < p->nr_maps; i++) {
+    free(p->maps[i].name);
+    free(p->maps[i].file);
+  }
+  free(p->maps);
+}
+
+void syms_cache__free(struct syms_cache *c) {
+  if (!c)
+    return;
+  for (size_t i = 0; i < c->nr_procs; i++)
+    proc_maps_free(&c->procs[i]);
+  free(c->procs);
+  for (size_t i = 0; i < c->nr_dsos; i++)
+    dso_free(c->dsos[i]);
+  free(c->dsos);
+  free(c);
+}
+
+bool syms_cache__forget(struct syms_cache *c, int tgid) {
+  for (size_t i = 0; i < c->nr_procs; i++) {
+    if (c->procs[i].tgid != tgid)
+      continue;
+    proc_maps_free(&c->procs[i]);
+    c->procs[i] = c->procs[--c->nr_procs];
+    return true;
+  }
+  return false;
+}
+
+// 找 addr 所在的映射。不在任何映射内多半是快照之后 dlopen/mmap 的：
+// 快照超过 1 秒就重读一次（进程已退出读不到时保留旧快照）
+static struct map *proc_find_map(struct syms_cache *c, struct proc_maps *p,
+                                 uint64_t addr) {
+  for (int retry = 0;; retry++) {
+    for (size_t i = 0; i < p->nr_maps; i++)
+      if (addr >= p->maps[i].start && addr < p->maps[i].end)
+        return &p->maps[i];
+    if (retry || monotonic_sec() - p->loaded_at < 1)
+      return NULL;
+    struct proc_maps fresh = {.tgid = p->tgid};
+    if (proc_maps_load(c, &fresh)) {
+      p->loaded_at = fresh.loaded_at;
+      return NULL;
+    }
+    proc_maps_free(p);
+    *p = fresh;
+  }
+}
+
+int syms_cache__map_addr(struct syms_cache *c, int tgid, uint64_t addr,
+                         struct sym_info *info) {
+  memset(info, 0, sizeof(*info));
+  struct proc_maps *p = cache_get_proc(c, tgid);
+  if (!p)
+    return -ENOMEM;
+
+  const struct map *m = proc_find_map(c, p, addr);
+  if (!m || !m->exec || !m->dso)
+    return -ENOENT;
+  uint64_t file_off = addr - m->start + m->offset, vaddr;
+  info->module = m->name;
+  info->offset = file_off;
+  if (dso_file_off_to_vaddr(m->dso, file_off, &vaddr))
+    return 0;
+  const struct dso_sym *s = dso_find_sym(m->dso, vaddr);
+  if (s) {
+    info->name = s->name;
+    info->offset = vaddr - s->addr;
+  }
+  return 0;
+}
+
+int syms_cache__map_dso(struct syms_cache *c, int tgid, uint64_t addr,
+                        const char **path, uint64_t *vaddr) {
+  struct proc_maps *p = cache_get_proc(c, tgid);
+  if (!p)
+    return -ENOMEM;
+  const struct map *m = proc_find_map(c, p, addr);
+  if (!m || !m->exec || !m->dso)
+    return -ENOENT;
+  *path = m->dso->path;
+  return dso_file_off_to_vaddr(m->dso, addr - m->start + m->offset, vaddr);
+}
+
+int syms_cache__map_data(struct syms_cache *c, int tgid, uint64_t addr,
+                         struct sym_info *info) {
+  memset(info, 0, sizeof(*info));
+  struct proc_maps *p = cache_get_proc(c, tgid);
+  if (!p)
+    return -ENOMEM;
+
+  struct map *m = proc_find_map(c, p, addr);
+  if (!m)
+    return -ENOENT;
+  info->module = m->name;
+  info->offset = addr - m->start;
+  // .bss 超出文件的部分是匿名映射：往前找同一段连续映射的 ELF
+  struct map *fm = m;
+  while (!fm->dso && !fm->file && fm > p->maps && fm[-1].end == fm->start)
+    fm--;
+  struct dso *d = map_get_dso(c, fm);
+  uint64_t vaddr;
+  if (!d || dso_mem_to_vaddr(d, fm, addr, &vaddr))
+    return 0;
+  info->module = fm->name;
+  info->offset = vaddr;
+  const struct dso_sym *s = dso_find_obj(d, vaddr);
+  if (s) {
+    info->name = s->name;
+    info->offset = vaddr - s->addr;
+  }
+  return 0;
+}
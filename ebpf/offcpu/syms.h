@@ -0,0 +1,45 @@
+// syms.h
+// 用户态符号化：内核地址走 /proc/kallsyms，用户地址走 /proc/<pid>/maps + ELF 符号表
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ksym {
+  uint64_t addr;
+  const char *name;
+};
+
+struct ksyms;
+
+struct ksyms *ksyms__load(void);
+void ksyms__free(struct ksyms *ksyms);
+// 返回不大于 addr 的最近符号；找不到返回 NULL
+const struct ksym *ksyms__map_addr(const struct ksyms *ksyms, uint64_t addr);
+
+struct sym_info {
+  const char *name;   // 符号名；未命中时为 NULL
+  const char *module; // 所在 ELF 路径；不在任何文件映射内时为 NULL
+  uint64_t offset;    // 相对符号（或模块）的偏移
+};
+
+// 按 tgid 缓存进程的映射和各 ELF 的符号表（同一文件在多个进程间共享）
+struct syms_cache;
+
+struct syms_cache *syms_cache__new(void);
+void syms_cache__free(struct syms_cache *cache);
+// 解析 tgid 进程中的 addr；返回 0 表示至少定位到了模块
+int syms_cache__map_addr(struct syms_cache *cache, int tgid, uint64_t addr,
+                         struct sym_info *info);
+// 把 tgid 进程中的 addr 换算成所在 ELF 的虚拟地址（符号表/CFI 的地址空间）；
+// path 为实际打开的文件路径，生命周期同 cache
+int syms_cache__map_dso(struct syms_cache *cache, int tgid, uint64_t addr,
+                        const char **path, uint64_t *vaddr);
+// 解析数据地址（全局/静态变量，如锁）：命中 STT_OBJECT 时 name 为变量名、
+// offset 为变量内偏移；否则 name 为 NULL，module 为所在映射
+// （ELF 路径或 [heap]/[stack]/[anon]），offset 为 ELF 虚拟地址或映射内偏移
+int syms_cache__map_data(struct syms_cache *c, int tgid, uint64_t addr,
+                         struct sym_info *info);
+// 进程 exec 后丢弃该 tgid 的映射缓存；缓存里本来就没有时返回 false。
+// 地址不在快照的任何映射内时会自动重读（dlopen），不需要调用方处理
+bool syms_cache__forget(struct syms_cache *cache, int tgid);
@@ -0,0 +1,636 @@
+// unwind.c
+#define _GNU_SOURCE
+#include "unwind.h"
+#include "syms.h"
+#include <fcntl.h>
+#include <gelf.h>
+#include <libelf.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// x86_64 DWARF 寄存器号
+#define DW_REG_RBP 6
+#define DW_REG_RSP 7
+#define DW_REG_RA 16
+
+#define DW_EH_PE_omit 0xff
+#define DW_EH_PE_absptr 0x00
+#define DW_EH_PE_uleb128 0x01
+#define DW_EH_PE_udata2 0x02
+#define DW_EH_PE_udata4 0x03
+#define DW_EH_PE_udata8 0x04
+#define DW_EH_PE_sleb128 0x09
+#define DW_EH_PE_sdata2 0x0a
+#define DW_EH_PE_sdata4 0x0b
+#define DW_EH_PE_sdata8 0x0c
+#define DW_EH_PE_pcrel 0x10
+#define DW_EH_PE_indirect 0x80
+
+// 一行 CFI：[start, end) 内 CFA/返回地址/rbp 的恢复规则
+#define ROW_CFA_VALID 0x1 // CFA = reg + off；否则是表达式，不支持
+#define ROW_RA_SAVED 0x2  // RA = *(CFA + ra_off)
+#define ROW_BP_SAVED 0x4  // rbp = *(CFA + bp_off)
+
+struct cfi_row {
+  uint64_t start, end;
+  int32_t cfa_off;
+  int32_t ra_off;
+  int32_t bp_off;
+  uint8_t cfa_reg;
+  uint8_t flags;
+};
+
+struct cfi_table {
+  char *path;
+  struct cfi_row *rows; // 按 start 排序
+  size_t nr, cap;
+};
+
+struct unwinder {
+  struct syms_cache *syms;
+  struct cfi_table **tables;
+  size_t nr_tables;
+};
+
+// ---------- 字节流读取 ----------
+
+struct cursor {
+  const uint8_t *p, *end;
+  const uint8_t *sec_start; // 所在 section 起始，pcrel 需要
+  uint64_t sec_addr;        // section 的 sh_addr
+  bool bad;
+};
+
+static uint64_t rd_u(struct cursor *c, int n) {
+  if (c->end - c->p < n) {
+    c->bad = true;
+    c->p = c->end;
+    return 0;
+  }
+  uint64_t v = 0;
+  memcpy(&v, c->p, n); // x86_64 小端
+  c->p += n;
+  return v;
+}
+
+static uint64_t rd_uleb(struct cursor *c) {
+  uint64_t v = 0;
+  int shift = 0;
+  while (c->p < c->end) {
+    uint8_t b = *c->p++;
+    if (shift < 64)
+      v |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+    if (!(b & 0x80))
+      return v;
+  }
+  c->bad = true;
+  return v;
+}
+
+static int64_t rd_sleb(struct cursor *c) {
+  int64_t v = 0;
+  int shift = 0;
+  uint8_t b = 0;
+  while (c->p < c->end) {
+    b = *c->p++;
+    if (shift < 64)
+      v |= (int64_t)(b & 0x7f) << shift;
+    shift += 7;
+    if (!(b & 0x80)) {
+      if (shift < 64 && (b & 0x40))
+        v |= -((int64_t)1 << shift);
+      return v;
+    }
+  }
+  c->bad = true;
+  return v;
+}
+
+static uint64_t rd_encoded(struct cursor *c, uint8_t enc) {
+  if (enc == DW_EH_PE_omit)
+    return 0;
+  uint64_t here = c->sec_addr + (uint64_t)(c->p - c->sec_start);
+  uint64_t v;
+  switch (enc & 0x0f) {
+  case DW_EH_PE_absptr:
+  case DW_EH_PE_udata8:
+  case DW_EH_PE_sdata8:
+    v = rd_u(c, 8);
+    break;
+  case DW_EH_PE_uleb128:
+    v = rd_uleb(c);
+    break;
+  case DW_EH_PE_udata2:
+    v = rd_u(c, 2);
+    break;
+  case DW_EH_PE_sdata2:
+    v = (uint64_t)(int64_t)(int16_t)rd_u(c, 2);
+    break;
+  case DW_EH_PE_udata4:
+    v = rd_u(c, 4);
+    break;
+  case DW_EH_PE_sdata4:
+    v = (uint64_t)(int64_t)(int32_t)rd_u(c, 4);
+    break;
+  case DW_EH_PE_sleb128:
+    v = (uint64_t)rd_sleb(c);
+    break;
+  default:
+    c->bad = true;
+    return 0;
+  }
+  // datarel/textrel/funcrel 在 .eh_frame 里基本不出现；indirect 需要读进程内存
+  if ((enc & 0x70) == DW_EH_PE_pcrel)
+    v += here;
+  else if ((enc & 0x70) || (enc & DW_EH_PE_indirect))
+    c->bad = true;
+  return v;
+}
+
+// ---------- CIE/FDE 解析与 CFA 程序执行 ----------
+
+struct cie {
+  uint64_t code_align;
+  int64_t data_align;
+  uint64_t ra_reg;
+  uint8_t fde_enc;
+  bool has_aug; // 'z'：FDE 带 augmentation 长度
+  const uint8_t *insns, *insns_end;
+};
+
+struct reg_state {
+  uint64_t cfa_reg;
+  int64_t cfa_off;
+  bool cfa_expr;
+  bool ra_saved, bp_saved;
+  int64_t ra_off, bp_off;
+};
+
+#define STATE_STACK 8
+
+static int parse_cie(struct cursor c, bool eh, struct cie *cie) {
+  memset(cie, 0, sizeof(*cie));
+  cie->fde_enc = DW_EH_PE_absptr;
+  uint8_t version = rd_u(&c, 1);
+  const char *aug = (const char *)c.p;
+  size_t aug_len = strnlen(aug, c.end - c.p);
+  c.p += aug_len + 1;
+  if (c.p > c.end)
+    return -1;
+  if (!eh && version >= 4) {
+    if (rd_u(&c, 1) != 8) // address_size
+      return -1;
+    rd_u(&c, 1); // segment_selector_size
+  }
+  cie->code_align = rd_uleb(&c);
+  cie->data_align = rd_sleb(&c);
+  cie->ra_reg = version == 1 ? rd_u(&c, 1) : rd_uleb(&c);
+
+  if (aug[0] == 'z') {
+    cie->has_aug = true;
+    uint64_t len = rd_uleb(&c);
+    const uint8_t *aug_end = c.p + len;
+    for (size_t i = 1; i < aug_len && c.p < aug_end; i++) {
+      switch (aug[i]) {
+      case 'R':
+        cie->fde_enc = rd_u(&c, 1);
+        break;
+      case 'P': {
+        uint8_t enc = rd_u(&c, 1);
+        rd_encoded(&c, enc & ~DW_EH_PE_indirect); // personality，跳过
+        break;
+      }
+      case 'L':
+        rd_u(&c, 1);
+        break;
+      default: // 'S' 等无数据
+        break;
+      }
+    }
+    c.p = aug_end;
+  } else if (aug[0] && strcmp(aug, "eh")) {
+    return -1; // 不认识的 augmentation，无法定位指令起点
+  }
+  if (c.bad || c.p > c.end)
+    return -1;
+  cie->insns = c.p;
+  cie->insns_end = c.end;
+  return 0;
+}
+
+static void table_emit(struct cfi_table *t, uint64_t start, uint64_t end,
+                       const struct reg_state *rs) {
+  if (start >= end)
+    return;
+  if (t->nr == t->cap) {
+    size_t ncap = t->cap ? t->cap * 2 : 4096;
+    struct cfi_row *tmp = realloc(t->rows, ncap * sizeof(*tmp));
+    if (!tmp)
+      return;
+    t->rows = tmp;
+    t->cap = ncap;
+  }
+  struct cfi_row *r = &t->rows[t->nr++];
+  memset(r, 0, sizeof(*r));
+  r->start = start;
+  r->end = end;
+  if (!rs->cfa_expr &&
+      (rs->cfa_reg == DW_REG_RSP || rs->cfa_reg == DW_REG_RBP)) {
+    r->flags |= ROW_CFA_VALID;
+    r->cfa_reg = rs->cfa_reg;
+    r->cfa_off = (int32_t)rs->cfa_off;
+  }
+  if (rs->ra_saved) {
+    r->flags |= ROW_RA_SAVED;
+    r->ra_off = (int32_t)rs->ra_off;
+  }
+  if (rs->bp_saved) {
+    r->flags |= ROW_BP_SAVED;
+    r->bp_off = (int32_t)rs->bp_off;
+  }
+}
+
+static void set_saved(struct reg_state *rs, uint64_t reg, uint64_t ra_reg,
+                      bool saved, int64_t off) {
+  if (reg == ra_reg) {
+    rs->ra_saved = saved;
+    rs->ra_off = off;
+  } else if (reg == DW_REG_RBP) {
+    rs->bp_saved = saved;
+    rs->bp_off = off;
+  }
+}
+
+// 执行 CFA 指令。t 为 NULL 时只建立初始状态（CIE 初始指令）；
+// sec_start/sec_addr 同 FDE 解析，set_loc 的 pcrel 地址要用
+static void run_cfa(const struct cie *cie, const uint8_t *sec_start,
+                    uint64_t sec_addr, const uint8_t *p, const uint8_t *end,
+                    struct reg_state *rs, const struct reg_state *init,
+                    struct cfi_table *t, uint64_t loc, uint64_t pc_end) {
+  struct cursor c = {.p = p, .end = end, .sec_start = sec_start,
+                     .sec_addr = sec_addr};
+  struct reg_state stack[STATE_STACK];
+  int depth = 0;
+
+  while (c.p < c.end && !c.bad) {
+    uint8_t op = rd_u(&c, 1);
+    uint8_t hi = op & 0xc0, lo = op & 0x3f;
+    uint64_t reg, new_loc = loc;
+    int64_t off;
+
+    if (hi == 0x40) { // DW_CFA_advance_loc
+      new_loc = loc + lo * cie->code_align;
+    } else if (hi == 0x80) { // DW_CFA_offset
+      off = (int64_t)rd_uleb(&c) * cie->data_align;
+      set_saved(rs, lo, cie->ra_reg, true, off);
+      continue;
+    } else if (hi == 0xc0) { // DW_CFA_restore
+      if (init)
+        set_saved(rs, lo, cie->ra_reg,
+                  lo == cie->ra_reg ? init->ra_saved : init->bp_saved,
+                  lo == cie->ra_reg ? init->ra_off : init->bp_off);
+      continue;
+    } else {
+      switch (op) {
+      case 0x00: // nop
+        continue;
+      case 0x01: // set_loc
+        new_loc = rd_encoded(&c, cie->fde_enc);
+        break;
+      case 0x02: // advance_loc1
+        new_loc = loc + rd_u(&c, 1) * cie->code_align;
+        break;
+      case 0x03: // advance_loc2
+        new_loc = loc + rd_u(&c, 2) * cie->code_align;
+        break;
+      case 0x04: // advance_loc4
+        new_loc = loc + rd_u(&c, 4) * cie->code_align;
+        break;
+      case 0x05: // offset_extended
+        reg = rd_uleb(&c);
+        off = (int64_t)rd_uleb(&c) * cie->data_align;
+        set_saved(rs, reg, cie->ra_reg, true, off);
+        continue;
+      case 0x06: // restore_extended
+        reg = rd_uleb(&c);
+        if (init)
+          set_saved(rs, reg, cie->ra_reg,
+                    reg == cie->ra_reg ? init->ra_saved : init->bp_saved,
+                    reg == cie->ra_reg ? init->ra_off : init->bp_off);
+        continue;
+      case 0x07: // undefined
+      case 0x08: // same_value
+        set_saved(rs, rd_uleb(&c), cie->ra_reg, false, 0);
+        continue;
+      case 0x09: // register：值在另一个寄存器里，栈快照恢复不了
+        reg = rd_uleb(&c);
+        rd_uleb(&c);
+        set_saved(rs, reg, cie->ra_reg, false, 0);
+        continue;
+      case 0x0a: // remember_state
+        if (depth < STATE_STACK)
+          stack[depth++] = *rs;
+        continue;
+      case 0x0b: // restore_state
+        if (depth > 0)
+          *rs = stack[--depth];
+        continue;
+      case 0x0c: // def_cfa
+        rs->cfa_reg = rd_uleb(&c);
+        rs->cfa_off = (int64_t)rd_uleb(&c);
+        rs->cfa_expr = false;
+        continue;
+      case 0x0d: // def_cfa_register
+        rs->cfa_reg = rd_uleb(&c);
+        rs->cfa_expr = false;
+        continue;
+      case 0x0e: // def_cfa_offset
+        rs->cfa_off = (int64_t)rd_uleb(&c);
+        continue;
+      case 0x0f: // def_cfa_expression（PLT 常见），不支持
+        c.p += rd_uleb(&c);
+        rs->cfa_expr = true;
+        continue;
+      case 0x10: // expression
+      case 0x16: // val_expression
+        reg = rd_uleb(&c);
+        c.p += rd_uleb(&c);
+        set_saved(rs, reg, cie->ra_reg, false, 0);
+        continue;
+      case 0x11: // offset_extended_sf
+        reg = rd_uleb(&c);
+        off = rd_sleb(&c) * cie->data_align;
+        set_saved(rs, reg, cie->ra_reg, true, off);
+        continue;
+      case 0x12: // def_cfa_sf
+        rs->cfa_reg = rd_uleb(&c);
+        rs->cfa_off = rd_sleb(&c) * cie->data_align;
+        rs->cfa_expr = false;
+        continue;
+      case 0x13: // def_cfa_offset_sf
+        rs->cfa_off = rd_sleb(&c) * cie->data_align;
+        continue;
+      case 0x14: // val_offset
+      case 0x15: // val_offset_sf：寄存器值 = CFA + off，不是存在栈上
+        reg = rd_uleb(&c);
+        if (op == 0x14)
+          rd_uleb(&c);
+        else
+          rd_sleb(&c);
+        set_saved(rs, reg, cie->ra_reg, false, 0);
+        continue;
+      case 0x2e: // GNU_args_size
+        rd_uleb(&c);
+        continue;
+      case 0x2f: // GNU_negative_offset_extended
+        reg = rd_uleb(&c);
+        off = -(int64_t)rd_uleb(&c) * cie->data_align;
+        set_saved(rs, reg, cie->ra_reg, true, off);
+        continue;
+      default: // 不认识的操作码，后面无法解析
+        return;
+      }
+    }
+    if (t)
+      table_emit(t, loc, new_loc < pc_end ? new_loc : pc_end, rs);
+    loc = new_loc;
+  }
+  if (t)
+    table_emit(t, loc, pc_end, rs);
+}
+
+// 遍历 .eh_frame（eh=true）或 .debug_frame，为每个 FDE 生成 CFI 行
+static void parse_frame_section(struct cfi_table *t, const uint8_t *buf,
+                                size_t size, uint64_t sec_addr, bool eh) {
+  const uint8_t *p = buf, *end = buf + size;
+  while (end - p >= 4) {
+    struct cursor c = {.p = p, .end = end, .sec_start = buf,
+                       .sec_addr = sec_addr};
+    uint64_t len = rd_u(&c, 4);
+    bool dwarf64 = false;
+    if (len == 0xffffffff) {
+      len = rd_u(&c, 8);
+      dwarf64 = true;
+    }
+    if (!len) { // .eh_frame 终止符
+      if (eh)
+        break;
+      p = c.p;
+      continue;
+    }
+    if (c.bad || len > (uint64_t)(end - c.p))
+      break;
+    const uint8_t *entry_end = c.p + len;
+    p = entry_end;
+    c.end = entry_end;
+
+    const uint8_t *id_pos = c.p;
+    uint64_t id = rd_u(&c, dwarf64 ? 8 : 4);
+    bool is_cie = eh ? id == 0 : id == (dwarf64 ? ~0ULL : 0xffffffffULL);
+    if (is_cie)
+      continue;
+
+    // FDE：找到所属 CIE
+    const uint8_t *cie_pos = eh ? id_pos - id : buf + id;
+    if (cie_pos < buf || cie_pos >= end)
+      continue;
+    struct cursor cc = {.p = cie_pos, .end = end, .sec_start = buf,
+                        .sec_addr = sec_addr};
+    uint64_t cie_len = rd_u(&cc, 4);
+    bool cie64 = false;
+    if (cie_len == 0xffffffff) {
+      cie_len = rd_u(&cc, 8);
+      cie64 = true;
+    }
+    if (cc.bad || cie_len > (uint64_t)(end - cc.p))
+      continue;
+    cc.end = cc.p + cie_len;
+    rd_u(&cc, cie64 ? 8 : 4); // CIE id
+    struct cie cie;
+    if (parse_cie(cc, eh, &cie))
+      continue;
+
+    uint64_t pc_begin, pc_range;
+    if (eh) {
+      pc_begin = rd_encoded(&c, cie.fde_enc);
+      pc_range = rd_encoded(&c, cie.fde_enc & 0x0f);
+    } else {
+      pc_begin = rd_u(&c, 8);
+      pc_range = rd_u(&c, 8);
+    }
+    if (cie.has_aug)
+      c.p += rd_uleb(&c);
+    if (c.bad || c.p > c.end || !pc_begin)
+      continue;
+
+    struct reg_state init = {.cfa_reg = DW_REG_RSP};
+    run_cfa(&cie, buf, sec_addr, cie.insns, cie.insns_end, &init, NULL, NULL,
+            0, 0);
+    struct reg_state rs = init;
+    run_cfa(&cie, buf, sec_addr, c.p, c.end, &rs, &init, t, pc_begin,
+            pc_begin + pc_range);
+  }
+}
+
+static int row_cmp(const void *a, const void *b) {
+  const struct cfi_row *x = a, *y = b;
+  if (x->start == y->start)
+    return 0;
+  return x->start < y->start ? -1 : 1;
+}
+
+static struct cfi_table *table_load(const char *path) {
+  struct cfi_table *t = calloc(1, sizeof(*t));
+  if (!t)
+    return NULL;
+  t->path = strdup(path);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return t;
+  Elf *e = elf_version(EV_CURRENT) != EV_NONE
+               ? elf_begin(fd, ELF_C_READ, NULL)
+               : NULL;
+  if (!e) {
+    close(fd);
+    return t;
+  }
+  size_t shstrndx;
+  if (elf_getshdrstrndx(e, &shstrndx) == 0) {
+    Elf_Scn *scn = NULL;
+    while ((scn = elf_nextscn(e, scn)) != NULL) {
+      GElf_Shdr shdr;
+      if (!gelf_getshdr(scn, &shdr) || shdr.sh_type == SHT_NOBITS)
+        continue;
+      const char *name = elf_strptr(e, shstrndx, shdr.sh_name);
+      if (!name)
+        continue;
+      bool eh = !strcmp(name, ".eh_frame");
+      if (!eh && strcmp(name, ".debug_frame"))
+        continue;
+      Elf_Data *data = elf_getdata(scn, NULL);
+      if (data && data->d_buf)
+        parse_frame_section(t, data->d_buf, data->d_size, shdr.sh_addr, eh);
+    }
+  }
+  elf_end(e);
+  close(fd);
+  // 两个 section 都有时会出现重复行，bsearch 命中任意一行即可
+  qsort(t->rows, t->nr, sizeof(*t->rows), row_cmp);
+  return t;
+}
+
+static void table_free(struct cfi_table *t) {
+  free(t->rows);
+  free(t->path);
+  free(t);
+}
+
+static struct cfi_table *get_table(struct unwinder *uw, const char *path) {
+  for (size_t i = 0; i < uw->nr_tables; i++)
+    if (!strcmp(uw->tables[i]->path, path))
+      return uw->tables[i];
+  struct cfi_table **tmp =
+      realloc(uw->tables, (uw->nr_tables + 1) * sizeof(*tmp));
+  if (!tmp)
+    return NULL;
+  uw->tables = tmp;
+  struct cfi_table *t = table_load(path);
+  if (t)
+    uw->tables[uw->nr_tables++] = t;
+  return t;
+}
+
+static const struct cfi_row *table_find(const struct cfi_table *t,
+                                        uint64_t pc) {
+  if (!t->nr || pc < t->rows[0].start)
+    return NULL;
+  size_t lo = 0, hi = t->nr;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (t->rows[mid].start <= pc)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  const struct cfi_row *r = &t->rows[lo];
+  return pc < r->end ? r : NULL;
+}
+
+// ---------- 对外 API ----------
+
+struct unwinder *unwinder__new(struct syms_cache *syms) {
+  struct unwinder *uw = calloc(1, sizeof(*uw));
+  if (uw)
+    uw->syms = syms;
+  return uw;
+}
+
+void unwinder__free(struct unwinder *uw) {
+  if (!uw)
+    return;
+  for (size_t i = 0; i < uw->nr_tables; i++)
+    table_free(uw->tables[i]);
+  free(uw->tables);
+  free(uw);
+}
+
+static bool stack_read(uint64_t sp0, const void *stack, size_t len,
+                       uint64_t addr, uint64_t *val) {
+  if (addr < sp0 || addr - sp0 + 8 > len)
+    return false;
+  memcpy(val, (const uint8_t *)stack + (addr - sp0), 8);
+  return true;
+}
+
+int unwinder__unwind(struct unwinder *uw, int tgid,
+                     const struct unwind_regs *regs, const void *stack,
+                     size_t stack_len, uint64_t *ips, int max_depth) {
+  uint64_t ip = regs->ip, sp = regs->sp, bp = regs->bp;
+  int n = 0;
+
+  while (n < max_depth && ip) {
+    ips[n++] = ip;
+
+    const char *path;
+    uint64_t vaddr;
+    const struct cfi_row *row = NULL;
+    // 非叶子帧的 ip 是返回地址，减 1 才落在 call 指令所在的 FDE 里
+    if (!syms_cache__map_dso(uw->syms, tgid, n == 1 ? ip : ip - 1, &path,
+                             &vaddr)) {
+      struct cfi_table *t = get_table(uw, path);
+      if (t)
+        row = table_find(t, vaddr);
+    }
+
+    uint64_t cfa, ra;
+    if (row && (row->flags & ROW_CFA_VALID) && (row->flags & ROW_RA_SAVED)) {
+      cfa = (row->cfa_reg == DW_REG_RSP ? sp : bp) + row->cfa_off;
+      if (!stack_read(regs->sp, stack, stack_len, cfa + row->ra_off, &ra))
+        break;
+      if (row->flags & ROW_BP_SAVED) {
+        uint64_t saved_bp;
+        if (!stack_read(regs->sp, stack, stack_len, cfa + row->bp_off,
+                        &saved_bp))
+          break;
+        bp = saved_bp;
+      }
+    } else {
+      // 没有 CFI（JIT、PLT 表达式等）时退回帧指针链
+      uint64_t saved_bp;
+      if (!stack_read(regs->sp, stack, stack_len, bp + 8, &ra) ||
+          !stack_read(regs->sp, stack, stack_len, bp, &saved_bp))
+        break;
+      cfa = bp + 16;
+      bp = saved_bp;
+    }
+    if (cfa <= sp) // 栈只会往高地址回退，防止死循环
+      break;
+    sp = cfa;
+    ip = ra;
+  }
+  return n;
+}
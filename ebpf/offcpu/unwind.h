@@ -0,0 +1,24 @@
+// unwind.h
+// 离线 DWARF CFI 回溯：用 .eh_frame/.debug_frame 把切出时的用户寄存器 +
+// 栈窗口还原成调用链（x86_64，类似 perf --call-graph dwarf）
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+struct syms_cache;
+struct unwinder;
+
+struct unwind_regs {
+  uint64_t ip;
+  uint64_t sp;
+  uint64_t bp;
+};
+
+// 解析后的 CFI 表按 ELF 路径缓存，同一个 libc 只解析一次
+struct unwinder *unwinder__new(struct syms_cache *syms);
+void unwinder__free(struct unwinder *uw);
+
+// stack 为从 regs->sp 开始的 stack_len 字节；返回写入 ips 的帧数（叶子在前）
+int unwinder__unwind(struct unwinder *uw, int tgid,
+                     const struct unwind_regs *regs, const void *stack,
+                     size_t stack_len, uint64_t *ips, int max_depth);
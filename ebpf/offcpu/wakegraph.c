@@ -0,0 +1,330 @@
+// wakegraph.c
+// 离线关键路径分析：读 offcpu -K 记录的唤醒边，对指定线程和时间窗口，
+// 从窗口末尾往回走：线程在跑（或排队）的时间记在它自己头上；它阻塞的时间
+// 交给唤醒它的线程，沿 “A 被 B 唤醒，B 之前又被 C 唤醒……” 递归下去，
+// 直到根阻塞者。每段墙钟时间最终归到一个 (线程, 栈) 上；waker 不在 -K 的
+// 过滤范围内时没有它的阻塞记录，那段时间记为 unknown。
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_DEPTH 64
+
+struct edge {
+  uint64_t ts;
+  uint64_t blocked;
+  uint32_t waker, waker_tgid;
+  uint32_t wakee, wakee_tgid;
+  const char *waker_comm, *wakee_comm;
+  const char *state;
+  const char *waker_stack, *wakee_stack;
+  bool waker_untracked;
+};
+
+enum seg_kind {
+  SEG_RUNNING, // 线程在 CPU 上或排队，栈为它随后释放依赖方/阻塞时的位置
+  SEG_BLOCKED, // 追不下去的阻塞（定时器/中断唤醒、自唤醒、深度上限）
+  SEG_UNKNOWN, // waker 不在跟踪范围内，不知道它在跑还是在等
+};
+
+static const char *const kind_names[] = {"running", "blocked", "unknown"};
+
+struct segment {
+  uint64_t start, end;
+  uint32_t tid;
+  const char *comm;
+  enum seg_kind kind;
+  const char *stack;
+  int depth;
+};
+
+static struct edge *edges; // 按 (wakee, ts) 排序
+static size_t nr_edges;
+static struct segment *segs;
+static size_t nr_segs, cap_segs;
+
+static int cmp_edge(const void *a, const void *b) {
+  const struct edge *x = a, *y = b;
+  if (x->wakee != y->wakee)
+    return x->wakee < y->wakee ? -1 : 1;
+  return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+// tid 在 ts <= hi 内最近一次被唤醒的边
+static const struct edge *last_wakeup(uint32_t tid, uint64_t hi) {
+  size_t lo = 0, n = nr_edges;
+  while (lo < n) { // 第一条 (wakee, ts) > (tid, hi)
+    size_t mid = lo + (n - lo) / 2;
+    const struct edge *e = &edges[mid];
+    if (e->wakee < tid || (e->wakee == tid && e->ts <= hi))
+      lo = mid + 1;
+    else
+      n = mid;
+  }
+  if (!lo || edges[lo - 1].wakee != tid)
+    return NULL;
+  return &edges[lo - 1];
+}
+
+static const char *comm_of(uint32_t tid, const char *fallback) {
+  const struct edge *e = last_wakeup(tid, UINT64_MAX);
+  return e ? e->wakee_comm : fallback;
+}
+
+static void emit(uint64_t start, uint64_t end, uint32_t tid, const char *comm,
+                 enum seg_kind kind, const char *stack, int depth) {
+  if (end <= start)
+    return;
+  if (nr_segs == cap_segs) {
+    size_t ncap = cap_segs ? cap_segs * 2 : 1024;
+    struct segment *tmp = realloc(segs, ncap * sizeof(*tmp));
+    if (!tmp)
+      return;
+    segs = tmp;
+    cap_segs = ncap;
+  }
+  segs[nr_segs++] = (struct segment){start, end, tid, comm, kind, stack, depth};
+}
+
+// 把 (lo, hi] 这段时间归因到 tid 及其依赖链上。run_stack 是 tid 在 hi 时刻
+// 的位置（唤醒依赖方时的栈），更早的运行段用它随后阻塞处的栈
+static void walk(uint32_t tid, const char *comm, uint64_t lo, uint64_t hi,
+                 const char *run_stack, int depth) {
+  while (hi > lo) {
+    const struct edge *e = last_wakeup(tid, hi);
+    if (!e || e->ts <= lo) {
+      emit(lo, hi, tid, comm, SEG_RUNNING, run_stack, depth);
+      return;
+    }
+    emit(e->ts, hi, tid, comm, SEG_RUNNING, run_stack, depth);
+    uint64_t bstart = e->ts - e->blocked > lo ? e->ts - e->blocked : lo;
+    // waker 为 0：空闲 CPU 上的中断/定时器唤醒，没有可追的线程
+    if (!e->waker || e->waker == tid || depth >= MAX_DEPTH)
+      emit(bstart, e->ts, tid, comm, SEG_BLOCKED, e->wakee_stack, depth);
+    else if (e->waker_untracked)
+      emit(bstart, e->ts, e->waker, e->waker_comm, SEG_UNKNOWN, e->waker_stack,
+           depth + 1);
+    else
+      walk(e->waker, e->waker_comm, bstart, e->ts, e->waker_stack, depth + 1);
+    hi = bstart;
+    run_stack = e->wakee_stack;
+  }
+}
+
+// 只用于按 (tid, kind, stack) 汇总
+struct attr {
+  uint32_t tid;
+  const char *comm;
+  enum seg_kind kind;
+  const char *stack;
+  uint64_t ns;
+};
+
+static int cmp_seg_key(const void *a, const void *b) {
+  const struct segment *x = a, *y = b;
+  if (x->tid != y->tid)
+    return x->tid < y->tid ? -1 : 1;
+  if (x->kind != y->kind)
+    return x->kind < y->kind ? -1 : 1;
+  return strcmp(x->stack, y->stack);
+}
+
+static int cmp_seg_start(const void *a, const void *b) {
+  const struct segment *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int cmp_attr(const void *a, const void *b) {
+  const struct attr *x = a, *y = b;
+  return x->ns < y->ns ? 1 : x->ns > y->ns ? -1 : 0;
+}
+
+static char *next_field(char **p) {
+  char *f = *p;
+  if (!f)
+    return NULL;
+  char *tab = strchr(f, '\t');
+  if (tab) {
+    *tab = '\0';
+    *p = tab + 1;
+  } else {
+    f[strcspn(f, "\n")] = '\0';
+    *p = NULL;
+  }
+  return f;
+}
+
+static int load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -errno;
+  char *line = NULL;
+  size_t len = 0, cap = 0;
+  while (getline(&line, &len, f) > 0) {
+    if (line[0] == '#')
+      continue;
+    // 第 12 列 waker_ctx 是后加的，老文件只有 11 列
+    char *p = strdup(line), *fld[12];
+    if (!p)
+      break;
+    char *cur = p;
+    int n = 0;
+    while (n < 12 && (fld[n] = next_field(&cur)))
+      n++;
+    if (n < 11) {
+      free(p);
+      continue;
+    }
+    if (nr_edges == cap) {
+      size_t ncap = cap ? cap * 2 : 4096;
+      struct edge *tmp = realloc(edges, ncap * sizeof(*tmp));
+      if (!tmp)
+        break;
+      edges = tmp;
+      cap = ncap;
+    }
+    // 字段指向 p 内部，p 不释放，生命周期同进程
+    edges[nr_edges++] = (struct edge){
+        .ts = strtoull(fld[0], NULL, 10),
+        .waker = strtoul(fld[1], NULL, 10),
+        .waker_tgid = strtoul(fld[2], NULL, 10),
+        .waker_comm = fld[3],
+        .wakee = strtoul(fld[4], NULL, 10),
+        .wakee_tgid = strtoul(fld[5], NULL, 10),
+        .wakee_comm = fld[6],
+        .blocked = strtoull(fld[7], NULL, 10),
+        .state = fld[8],
+        .waker_stack = fld[9],
+        .wakee_stack = fld[10],
+        .waker_untracked = n > 11 && !strcmp(fld[11], "untracked"),
+    };
+  }
+  free(line);
+  fclose(f);
+  qsort(edges, nr_edges, sizeof(*edges), cmp_edge);
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s -t tid [-s ms] [-e ms] [-n top] [-v] wakeups.tsv\n"
+          "  -t  要分析的线程（比如处理慢请求的线程）\n"
+          "  -s  窗口起点，相对文件中第一条边的毫秒数，默认 0\n"
+          "  -e  窗口终点（同上），默认该线程最后一次被唤醒的时刻\n"
+          "  -n  打印前 n 个归因，默认 20\n"
+          "  -v  同时按时间顺序打印关键路径上的每一段\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  uint32_t tid = 0;
+  double start_ms = 0, end_ms = -1;
+  int top = 20, opt;
+  bool verbose = false;
+
+  while ((opt = getopt(argc, argv, "t:s:e:n:v")) != -1) {
+    switch (opt) {
+    case 't':
+      tid = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      start_ms = atof(optarg);
+      break;
+    case 'e':
+      end_ms = atof(optarg);
+      break;
+    case 'n':
+      top = atoi(optarg);
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!tid || optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  int err = load(argv[optind]);
+  if (err) {
+    fprintf(stderr, "load %s: %s\n", argv[optind], strerror(-err));
+    return 1;
+  }
+  if (!nr_edges) {
+    fprintf(stderr, "no edges\n");
+    return 1;
+  }
+
+  uint64_t t0 = UINT64_MAX;
+  for (size_t i = 0; i < nr_edges; i++)
+    if (edges[i].ts < t0)
+      t0 = edges[i].ts;
+  const struct edge *last = last_wakeup(tid, UINT64_MAX);
+  if (!last && end_ms < 0) {
+    fprintf(stderr, "tid %u never woken in this file; give -e\n", tid);
+    return 1;
+  }
+  uint64_t lo = t0 + (uint64_t)(start_ms * 1e6);
+  uint64_t hi = end_ms >= 0 ? t0 + (uint64_t)(end_ms * 1e6) : last->ts;
+  if (hi <= lo) {
+    fprintf(stderr, "empty window\n");
+    return 1;
+  }
+
+  const char *comm = comm_of(tid, "?");
+  walk(tid, comm, lo, hi, "[window-end]", 0);
+
+  uint64_t wall = hi - lo;
+  printf("critical path of tid %u (%s), window %.3f..%.3f ms (%.3f ms), "
+         "%zu segments\n",
+         tid, comm, (lo - t0) / 1e6, (hi - t0) / 1e6, wall / 1e6, nr_segs);
+
+  if (verbose) {
+    qsort(segs, nr_segs, sizeof(*segs), cmp_seg_start);
+    printf("\n%12s %10s %5s %-8s %-16s %-7s %s\n", "START(ms)", "DUR(ms)",
+           "DEPTH", "TID", "COMM", "KIND", "STACK");
+    for (size_t i = 0; i < nr_segs; i++) {
+      const struct segment *g = &segs[i];
+      printf("%12.3f %10.3f %5d %-8u %-16s %-7s %s\n", (g->start - t0) / 1e6,
+             (g->end - g->start) / 1e6, g->depth, g->tid, g->comm,
+             kind_names[g->kind], g->stack);
+    }
+  }
+
+  // 按 (tid, kind, stack) 汇总，按时长排序
+  qsort(segs, nr_segs, sizeof(*segs), cmp_seg_key);
+  struct attr *attrs = calloc(nr_segs ? nr_segs : 1, sizeof(*attrs));
+  size_t nr_attrs = 0;
+  if (!attrs)
+    return 1;
+  for (size_t i = 0; i < nr_segs; i++) {
+    const struct segment *g = &segs[i];
+    if (!nr_attrs || cmp_seg_key(g, &segs[i - 1])) {
+      attrs[nr_attrs++] =
+          (struct attr){g->tid, g->comm, g->kind, g->stack, 0};
+    }
+    attrs[nr_attrs - 1].ns += g->end - g->start;
+  }
+  qsort(attrs, nr_attrs, sizeof(*attrs), cmp_attr);
+
+  printf("\n%10s %6s %-8s %-16s %-7s %s\n", "TIME(ms)", "PCT", "TID", "COMM",
+         "KIND", "STACK");
+  for (size_t i = 0; i < nr_attrs && (int)i < top; i++) {
+    const struct attr *a = &attrs[i];
+    printf("%10.3f %5.1f%% %-8u %-16s %-7s %s\n", a->ns / 1e6,
+           a->ns * 100.0 / wall, a->tid, a->comm, kind_names[a->kind],
+           a->stack);
+  }
+  free(attrs);
+  free(segs);
+  free(edges);
+  return 0;
+}